@@ -32,21 +32,28 @@
 
 #include "ImageProcessor.hh"
 #include "Transformations.hh"
+#include "LosslessJPEG.hh"
+#include "TileExecutor.hh"
 #include "util/fileutil.hh"
+#include "util/bpthread.hh"
+#include "util/bptime.hh"
 #include "magick/api.h"
 
 #include "service.hh"
 
+#include <algorithm>
 #include <sstream>
 
 #include <assert.h>
+#include <stdlib.h>
 
 #ifdef WIN32
 #define strcasecmp _stricmp
 #endif
 
 // a map of supported types.
-// written in init, and only read after that (for threading issues)
+// written in init, before any worker threads are started, and only read
+// after that (for threading issues)
 struct CaseInsensitiveCompare 
 {
     bool operator()(const std::string& lhs, const std::string& rhs) const 
@@ -57,26 +64,157 @@ struct CaseInsensitiveCompare
 
 typedef std::map<std::string, std::string, CaseInsensitiveCompare> ExtMap;
 static ExtMap s_imgFormats;
+static bool s_initialized = false;
+
+// results of recent transformations
+static imageproc::ResultCache s_results(IA_RESULT_CACHE_BYTES);
+static imageproc::PlanCache s_plans(IA_PLAN_CACHE_ENTRIES);
+
+// limits upon the pixels held by requests, installed in init
+static imageproc::ResourceGovernor s_governor;
+
+// large buffers, reused across requests
+static bp::mem::BufferPool s_buffers(IA_BUFFER_POOL_BYTES);
+
+// GraphicsMagick allocates through these, so that large allocations (its
+// pixel caches, mostly) are drawn from s_buffers.  Smaller ones, and any
+// the pool can't satisfy, go to the system allocator.  Each block is
+// preceded by a header recording where it came from, so that freeing a
+// small block never touches the pool (or its lock).
+union BlockHeader {
+    struct {
+        // usable bytes following the header
+        size_t size;
+        bool pooled;
+    } h;
+    // keeps what follows as aligned as malloc() would
+    long double align;
+};
+
+static inline BlockHeader *
+IP_Header(void * p)
+{
+    return ((BlockHeader *) p) - 1;
+}
+
+static void *
+IP_Malloc(size_t size)
+{
+    size_t total = size + sizeof(BlockHeader);
+    if (total < size) return NULL;
+
+    if (size >= IA_BUFFER_POOL_MIN_BYTES) {
+        size_t usable = 0;
+        BlockHeader * b = (BlockHeader *) s_buffers.acquire(total, &usable);
+        if (b) {
+            b->h.size = usable - sizeof(BlockHeader);
+            b->h.pooled = true;
+            return b + 1;
+        }
+    }
+
+    BlockHeader * b = (BlockHeader *) malloc(total);
+    if (!b) return NULL;
+    b->h.size = size;
+    b->h.pooled = false;
+    return b + 1;
+}
+
+static void
+IP_Free(void * p)
+{
+    if (!p) return;
+    BlockHeader * b = IP_Header(p);
+    if (b->h.pooled) (void) s_buffers.release(b);
+    else free(b);
+}
+
+static void *
+IP_Realloc(void * p, size_t size)
+{
+    if (p == NULL) return IP_Malloc(size);
+    if (size == 0) {
+        IP_Free(p);
+        return NULL;
+    }
+
+    BlockHeader * b = IP_Header(p);
+    if (b->h.pooled) {
+        if (size <= b->h.size) return p;
+    } else if (size < IA_BUFFER_POOL_MIN_BYTES) {
+        // small blocks stay with the system
+        size_t total = size + sizeof(BlockHeader);
+        BlockHeader * n = (BlockHeader *) realloc(b, total);
+        if (!n) return NULL;
+        n->h.size = size;
+        return n + 1;
+    }
+
+    void * n = IP_Malloc(size);
+    if (n) {
+        memcpy(n, p, std::min(b->h.size, size));
+        IP_Free(p);
+    }
+    return n;
+}
 
 const imageproc::Type imageproc::UNKNOWN = NULL;
 
 void
-imageproc::init()
+imageproc::init(const std::string & spillDir)
 {
     unsigned int i;
+
+    // s_imgFormats mustn't change once workers are running
+    if (s_initialized) return;
+    s_initialized = true;
+
+    // GraphicsMagick reads the directory for pixel cache files from the
+    // environment each time it creates one.  It's set here, before any
+    // worker is running, and never changed
+    std::string dir = spillDir;
+    if (dir.empty()) dir = ft::pathAppend(ft::tempDirectory(), IA_SPILL_DIR);
+    if (ft::mkdir(dir, false)) {
+#ifdef WIN32
+        (void) _putenv_s("MAGICK_TMPDIR", dir.c_str());
+#else
+        (void) setenv("MAGICK_TMPDIR", dir.c_str(), 1);
+#endif
+    }
     
+    MagickAllocFunctions(IP_Free, IP_Malloc, IP_Realloc);
+    (void) s_buffers.startTrimmer(IA_BUFFER_POOL_IDLE_MS);
+
     RegisterStaticModules();
     InitializeMagick(NULL);
+    tiles::init();
+
+    imageproc::ResourceLimits limits;
+    limits.memory = IA_MEMORY_BYTES;
+    limits.map = IA_MAP_BYTES;
+    limits.disk = IA_DISK_BYTES;
+    limits.pixels = IA_PIXELS;
+    // each worker's share of the heap, so that a request only spills if
+    // it couldn't fit with every worker busy
+    unsigned int workers = bp::thread::Thread::numProcessors();
+    if (workers > IA_MAX_WORKERS) workers = IA_MAX_WORKERS;
+    limits.requestMemory = IA_MEMORY_BYTES / workers;
+    limits.requestPixels = IA_REQUEST_PIXELS;
+    s_governor.setLimits(limits);
 
     // let's output a startup banner with available image type support
+    // GM allocates through IP_Malloc(), so what it returns must be
+    // released with MagickFree(), never free()
     ExceptionInfo exception;
-    MagickInfo ** arr = GetMagickInfoArray( &exception );
+    GetExceptionInfo(&exception);
+    MagickInfo ** infos = GetMagickInfoArray( &exception );
+    DestroyExceptionInfo(&exception);
     std::stringstream ss;
     
     ss << "GraphicsMagick engine initialized with support for: [ ";
 
     bool first = true;
-    while (arr && *arr) {
+    for (MagickInfo ** arr = infos; arr && *arr; arr++) {
         if (!first) ss << ", ";
         first = false;
         ss << (*arr)->name;
@@ -84,10 +222,10 @@ imageproc::init()
         if (mt) {
             s_imgFormats[(*arr)->name] = std::string(mt);
             ss << " (" << mt << ")";
-            free(mt);
+            MagickFree(mt);
         }
-        arr++;
     }
+    MagickFree(infos);
     ss << " ]";
     g_bpCoreFunctions->log(BP_INFO, ss.str().c_str());
 
@@ -107,7 +245,13 @@ imageproc::init()
 void
 imageproc::shutdown()
 {
+    if (!s_initialized) return;
+    s_initialized = false;
+    s_imgFormats.clear();
+    tiles::shutdown();
     DestroyMagick();
+    s_buffers.stopTrimmer();
+    s_buffers.trim(0);
 }
 
 #ifdef WIN32
@@ -142,80 +286,156 @@ imageproc::typeToExt(Type t)
     return ext;
 }
 
+// can step be performed by mapping samples through a lookup table?
+// tables have MaxRGB + 1 entries, which is too many above 16 bit quanta.
 static
-Image * runTransformations(Image * image,
-                           const bp::List & transList,
-                           int quality, std::string & oError)
+bool isPointOp(const trans::Step & step)
 {
-    g_bpCoreFunctions->log(
-        BP_INFO, "%lu transformation actions specified",
-        transList.size());
-    
-    for (unsigned int i = 0; i < transList.size(); i++)
-    {
-        const bp::Object * o = transList.value(i);
+#if QuantumDepth <= 16
+    return step.t->channelMap != NULL;
+#else
+    return false;
+#endif
+}
 
-        std::string command;
-        const bp::Object * args = NULL;
-        
-        // o may either be a string transformation: i.e. "solarize"
-        // or a may transform: i.e. { "crop": { .25, .75, .25, .75 } }
-        // first we'll extract the command
-        if (o->type() == BPTString) {
-            command = (std::string)(*o);            
-        } else  if (o->type() == BPTMap) {
-            const bp::Map * m = (const bp::Map *) o;
-            if (m->size() != 1) {
-                std::stringstream ss;
-                ss << "transform " << i << " is malformed.  An action is  "
-                   << "an object with a single property which is the action "
-                   << "name";
-                oError = ss.str();
-                break;
+static
+bool isRowLocal(const trans::Step & step)
+{
+    return isPointOp(step) || step.t->rowKernel != NULL;
+}
+
+// Group the run of row local steps beginning at steps[first] into stages.
+// Consecutive point ops are composed into a single lookup table.  Returns
+// the number of steps consumed, and a description of the stages.
+static
+unsigned int buildRowStages(const trans::Plan & steps,
+                            unsigned int first,
+                            std::vector<trans::RowStage> & stages,
+                            std::string & desc)
+{
+    unsigned int i = first;
+    while (i < steps.size() && isRowLocal(steps[i])) {
+        if (!desc.empty()) desc.append(" ");
+        if (isPointOp(steps[i])) {
+            std::vector<trans::ChannelMap> maps;
+            desc.append("lut(");
+            for (; i < steps.size() && isPointOp(steps[i]); i++) {
+                if (!maps.empty()) desc.append("+");
+                desc.append(steps[i].t->name);
+                maps.push_back(steps[i].t->channelMap);
             }
-            bp::Map::Iterator i(*m);
-            command.append(i.nextKey());
-            args = m->get(command.c_str());
-            assert(args != NULL);
+            desc.append(")");
+            stages.push_back(trans::composeChannelMaps(&maps[0],
+                                                       maps.size()));
         } else {
-            std::stringstream ss;
-            ss << "transform " << i << " is malformed.  An action is  "
-               << "either a string or an object with a single property which "
-               << "is the name of an action to perform";
-            oError = ss.str();
-            break;
+            trans::RowStage stage;
+            stage.kernel = steps[i].t->rowKernel;
+            stages.push_back(stage);
+            desc.append(steps[i].t->name);
+            i++;
         }
+    }
+    return i - first;
+}
 
-        g_bpCoreFunctions->log(
-            BP_INFO, "transform [%s] with%s args",
-            command.c_str(), (args ? "" : "out"));
-
-        // does the command exist?
-        const trans::Transformation * t = trans::get(command);
-        if (t == NULL) {
-            std::stringstream ss;
-            ss << "no such transformation: " << command;
-            oError = ss.str();
-            break;
-        }
+// compile actions, whose canonical form is key, reusing a previously
+// compiled plan when possible
+static bool
+IP_CompilePlan(const bp::List & actions, const std::string & key,
+               trans::Plan & plan, std::string & oError)
+{
+    if (s_plans.lookup(key, plan)) return true;
+    if (!trans::compile(actions, plan, oError)) return false;
+    s_plans.insert(key, plan);
+    return true;
+}
 
-        // are the arguments correct?
-        if (t->requiresArgs && !args) {
-            oError.append(command);
-            oError.append(" missing required argument");
-            break;
-        }
+// pixels in every image in a list
+static unsigned long long
+IP_Pixels(const Image * images)
+{
+    unsigned long long pixels = 0;
+    for (; images; images = images->next) {
+        pixels += (unsigned long long) images->columns * images->rows;
+    }
+    return pixels;
+}
 
-        if (!t->acceptsArgs && args) {        
-            oError.append(command);
-            oError.append(" doesn't accept arguments");
-            break;
-        }
+// bytes of pixel cache held by every image in a list
+static unsigned long long
+IP_PixelBytes(const Image * images)
+{
+    return IP_Pixels(images) * sizeof(PixelPacket);
+}
 
-        {
-            Image * newImage = t->transform(image, args, quality, oError);
+// run steps against image, starting with the step at index first.
+// consecutive row local actions are streamed through the image together
+// in a single pass.  As we own image, actions which can modify it in
+// place do, other actions each produce a new image.  If peak is non-NULL
+// it's raised to the most pixel bytes held at once.  If times is non-NULL
+// the time taken by each stage is appended.
+static
+Image * runTransformations(Image * image,
+                           const trans::Plan & steps,
+                           unsigned int first,
+                           int quality, std::string & oError,
+                           unsigned long long * peak = NULL,
+                           std::vector<imageproc::StageTime> * times = NULL)
+{
+    // only the first frame is transformed, animations which stay
+    // animated go through runTransformationsOnFrames().  Actions which
+    // modify in place would carry the other frames along, so drop them
+    if (first < steps.size() && image->next) {
+        Image * rest = image->next;
+        image->next = NULL;
+        rest->previous = NULL;
+        DestroyImageList(rest);
+    }
+
+    for (unsigned int i = first; oError.empty() && i < steps.size(); )
+    {
+        bp::time::Stopwatch sw;
+        std::string desc;
+        Image * newImage = NULL;
+        unsigned long long inBytes = (peak ? IP_PixelBytes(image) : 0);
+
+        // a run of more than one row local action is streamed
+        unsigned int run = 0;
+        while (i + run < steps.size() && isRowLocal(steps[i + run])) run++;
+
+        if (run > 1 && trans::canStreamRows(image)) {
+            std::vector<trans::RowStage> stages;
+            i += buildRowStages(steps, i, stages, desc);
+            newImage = trans::streamRows(image, stages, oError);
+        } else if (steps[i].t->halo > 0) {
+            // neighbourhood filters run a band at a time, in parallel
+            desc = steps[i].t->name;
+            newImage = tiles::apply(steps[i].t, image, steps[i].args,
+                                    quality, oError);
             DestroyImage(image);
-            image = newImage;
+            i++;
+        } else {
+            desc = steps[i].t->name;
+            newImage = trans::apply(steps[i].t, image, steps[i].args,
+                                    quality, oError);
+            i++;
+        }
+        // image is gone, unless it was modified in place and returned
+        if (peak && newImage) {
+            unsigned long long held = inBytes;
+            if (newImage != image) held += IP_PixelBytes(newImage);
+            if (held > *peak) *peak = held;
+        }
+        image = newImage;
+
+        double ms = sw.elapsedMS();
+        g_bpCoreFunctions->log(
+            BP_INFO, "stage [%s] took %.2fms", desc.c_str(), ms);
+        if (times) {
+            imageproc::StageTime st;
+            st.name = desc;
+            st.ms = ms;
+            times->push_back(st);
         }
         
         // abort if the transformation failed
@@ -230,76 +450,648 @@ Image * runTransformations(Image * image,
     return image;
 }
 
+// will images be written as an animation?  true when there's more than
+// one frame, and the output format (or the input format, if UNKNOWN)
+// can hold them all
+static bool
+IP_StaysAnimated(const Image * images, imageproc::Type outputFormat)
+{
+    if (GetImageListLength(images) < 2) return false;
+
+    ExceptionInfo exception;
+    GetExceptionInfo(&exception);
+    const MagickInfo * mi =
+        GetMagickInfo(outputFormat ? outputFormat : images->magick,
+                      &exception);
+    DestroyExceptionInfo(&exception);
+
+    return (mi != NULL && mi->adjoin);
+}
+
+// a frame of an animation, transformed on the shared pool
+struct FrameTask {
+    const trans::Plan * plan;
+    unsigned int first;
+    int quality;
+    // input, replaced by its output (NULL on failure)
+    Image * frame;
+    std::string error;
+};
+
+static void
+frameWorker(void * cookie)
+{
+    FrameTask * t = (FrameTask *) cookie;
+    t->frame = runTransformations(t->frame, *t->plan, t->first, t->quality,
+                                  t->error);
+}
+
+// run steps against every frame of an animation, starting with the step
+// at index first.  Frames are transformed independently on the shared
+// pool of threads, and the list reassembled in order.
+// Frames are coalesced first unless every step is row local, as partial
+// frames are positioned relative to the whole and only row local steps
+// leave that unchanged.
 static Image *
-IP_ReadImageFile(const ImageInfo * image_info,
-                 const std::string & path,
+runTransformationsOnFrames(Image * images,
+                           const trans::Plan & steps,
+                           unsigned int first,
+                           int quality, std::string & oError)
+{
+    bp::time::Stopwatch sw;
+
+    bool coalesce = false;
+    for (unsigned int i = first; i < steps.size(); i++) {
+        if (!isRowLocal(steps[i])) coalesce = true;
+    }
+    if (coalesce) {
+        ExceptionInfo exception;
+        GetExceptionInfo(&exception);
+        Image * full = CoalesceImages(images, &exception);
+        DestroyExceptionInfo(&exception);
+        DestroyImageList(images);
+        if (!full) {
+            oError.append("couldn't coalesce frames");
+            return NULL;
+        }
+        images = full;
+    }
+
+    std::vector<FrameTask> tasks;
+    while (images) {
+        FrameTask t;
+        t.plan = &steps;
+        t.first = first;
+        t.quality = quality;
+        t.frame = RemoveFirstImageFromList(&images);
+        tasks.push_back(t);
+    }
+
+    // on the pool shared by all requests, so that concurrent animations
+    // don't run more threads than there are processors
+    std::vector<void *> cookies;
+    for (unsigned int i = 0; i < tasks.size(); i++) {
+        cookies.push_back((void *) &tasks[i]);
+    }
+    if (!cookies.empty()) {
+        tiles::each(frameWorker, &cookies[0], cookies.size());
+    }
+
+    // reassemble, in order
+    for (unsigned int i = 0; i < tasks.size(); i++) {
+        Image * f = tasks[i].frame;
+        if (!f) {
+            if (oError.empty()) {
+                oError.append(tasks[i].error.empty()
+                              ? "couldn't transform frame" : tasks[i].error);
+            }
+            continue;
+        }
+        if (coalesce) {
+            // each frame is now the whole of the animation, and replaces
+            // the last completely
+            f->page.x = f->page.y = 0;
+            f->page.width = f->columns;
+            f->page.height = f->rows;
+            f->dispose = BackgroundDispose;
+        }
+        AppendImageToList(&images, f);
+    }
+
+    if (!oError.empty() && images) {
+        DestroyImageList(images);
+        images = NULL;
+    }
+
+    g_bpCoreFunctions->log(
+        BP_INFO, "transformed %lu frames in %.2fms",
+        (unsigned long) tasks.size(), sw.elapsedMS());
+
+    return images;
+}
+
+// a single stage describing every action run upon the frames of an
+// animation, from the step at index first
+static imageproc::StageTime
+IP_FramesStage(const trans::Plan & steps, unsigned int first, double ms)
+{
+    imageproc::StageTime st;
+    st.name = "frames(";
+    for (unsigned int i = first; i < steps.size(); i++) {
+        if (i > first) st.name.append(" ");
+        st.name.append(steps[i].t->name);
+    }
+    st.name.append(")");
+    st.ms = ms;
+    return st;
+}
+
+// describes work performed at decode time.  When the pipeline begins
+// with a scale or thumbnail of a JPEG we ask libjpeg to do most of the
+// work in the DCT domain, and then finish the job from the much smaller
+// intermediate.  When it begins with a crop, only the region kept is
+// decoded, and the crop is complete.
+struct DecodeHint {
+    DecodeHint() : downscale(NULL), x(0), y(0), cropped(false) { }
+    const trans::Transformation * downscale;
+    unsigned int x, y;
+    bool cropped;
+};
+
+static bool
+isJPEG(const void * blob, size_t len)
+{
+    const unsigned char * b = (const unsigned char *) blob;
+    return (len >= 3 && b[0] == 0xFF && b[1] == 0xD8 && b[2] == 0xFF);
+}
+
+// learn the dimensions of an in memory image by reading only its headers
+static bool
+IP_PingSize(const ImageInfo * image_info,
+            const void * blob, size_t len,
+            unsigned long & columns, unsigned long & rows,
+            ExceptionInfo * exception)
+{
+    columns = rows = 0;
+    Image * p = PingBlob(image_info, blob, len, exception);
+    if (!p) return false;
+    columns = p->columns;
+    rows = p->rows;
+    DestroyImageList(p);
+    return true;
+}
+
+// decode an in memory image of columns x rows which will be downscaled to
+// no larger than x by y.  When the decoder can help, the image is decoded
+// at a reduced size no smaller than x by y, and true is returned in
+// prescaled.
+static Image *
+IP_DecodeAtLeast(const ImageInfo * image_info,
+                 const void * blob, size_t len,
+                 unsigned long columns, unsigned long rows,
+                 unsigned int x, unsigned int y,
+                 bool & prescaled,
                  ExceptionInfo * exception)
- {
-    if (path.empty()) return NULL;
-    
+{
+    prescaled = false;
+
+    // of the coders we ship, only JPEG can scale while decoding, GIF and
+    // PNG would ignore the hint.  libjpeg can only help with reductions
+    // of 2x or more
+    if (!isJPEG(blob, len) || x == 0 || y == 0 ||
+        (unsigned long) x * 2 > columns || (unsigned long) y * 2 > rows)
+    {
+        return BlobToImage(image_info, blob, len, exception);
+    }
+
+    // the decoder will pick the largest DCT scaling that yields an image
+    // no smaller than the hint in either dimension
+    char size[64];
+    sprintf(size, "%ux%u", x, y);
+    ImageInfo * hinted = CloneImageInfo(image_info);
+    CloneString(&hinted->size, size);
+    Image * i = BlobToImage(hinted, blob, len, exception);
+    DestroyImageInfo(hinted);
+
+    if (i && (i->columns != columns || i->rows != rows)) {
+        g_bpCoreFunctions->log(
+            BP_INFO, "downscale of (%lu, %lu) to (%u, %u) decoded at "
+            "(%lu, %lu)", columns, rows, x, y, i->columns, i->rows);
+
+        // downstream we report and crop relative to the original size
+        i->magick_columns = columns;
+        i->magick_rows = rows;
+        prescaled = true;
+    }
+
+    return i;
+}
+
+// decode the part of an in memory JPEG of columns x rows that is kept by
+// the crop ri, and perform the crop.  Only the blocks around the region
+// are decoded, so time and memory scale with the area kept rather than
+// the whole image.  cropped is false if we decoded the whole image
+// instead, leaving the crop to be done.
+static Image *
+IP_DecodeRegion(const ImageInfo * image_info,
+                const void * blob, size_t len,
+                unsigned long columns, unsigned long rows,
+                const RectangleInfo & ri,
+                bool & cropped,
+                ExceptionInfo * exception)
+{
+    cropped = false;
+
+    // extracting the region costs a pass over the coefficients, which
+    // isn't worthwhile unless most of the image is discarded
+    unsigned long x1 = std::min(ri.x + ri.width, columns);
+    unsigned long y1 = std::min(ri.y + ri.height, rows);
+    if ((x1 - ri.x) * (y1 - ri.y) * 2 > columns * rows) {
+        return BlobToImage(image_info, blob, len, exception);
+    }
+
+    std::string region, why;
+    unsigned int rx = 0, ry = 0;
+    if (!lossless::extractRegion(blob, len, ri.x, ri.y, x1, y1,
+                                 region, rx, ry, why))
+    {
+        g_bpCoreFunctions->log(
+            BP_INFO, "couldn't decode region of image (%s), decoding all "
+            "of it", why.c_str());
+        return BlobToImage(image_info, blob, len, exception);
+    }
+
+    Image * i = BlobToImage(image_info, region.data(), region.size(),
+                            exception);
+    if (!i) return NULL;
+
+    g_bpCoreFunctions->log(
+        BP_INFO, "crop of (%lu, %lu) decoded (%lu, %lu) at %u,%u",
+        columns, rows, i->columns, i->rows, rx, ry);
+
+    // downstream we report and crop relative to the original size
+    i->magick_columns = columns;
+    i->magick_rows = rows;
+
+    RectangleInfo local = ri;
+    local.x -= rx;
+    local.y -= ry;
+    Image * c = CropImage(i, &local, exception);
+    if (c) {
+        // CropImage may record the offset of the crop in the page
+        // geometry, which must be relative to the whole image
+        if (c->page.x != i->page.x) c->page.x += rx;
+        if (c->page.y != i->page.y) c->page.y += ry;
+        cropped = true;
+    }
+    DestroyImage(i);
+
+    return c;
+}
+
+// decode an in memory image.  If plan is non-NULL and begins with a
+// downscale that the decoder can help with, and prescale allows the
+// slightly different pixels that result, a size hint is passed down
+// and hint describes the downscale that remains to be done.  If it
+// begins with a crop, only the region kept may be decoded, in which case
+// hint.cropped is set.
+static Image *
+IP_DecodeBlob(const ImageInfo * image_info,
+              const void * blob, size_t len,
+              const trans::Plan * plan,
+              bool prescale,
+              DecodeHint & hint,
+              ExceptionInfo * exception)
+{
+    hint = DecodeHint();
+
+    if (plan == NULL || !isJPEG(blob, len)) {
+        return BlobToImage(image_info, blob, len, exception);
+    }
+
+    // pinging reads only the headers, so we can learn the source
+    // dimensions and compute exactly the size the downscale will produce
+    unsigned long columns = 0, rows = 0;
+    (void) IP_PingSize(image_info, blob, len, columns, rows, exception);
+
+    RectangleInfo ri;
+    if (trans::leadingCrop(*plan, columns, rows, ri)) {
+        return IP_DecodeRegion(image_info, blob, len, columns, rows, ri,
+                               hint.cropped, exception);
+    }
+
+    unsigned int x = 0, y = 0;
+    const trans::Transformation * t = NULL;
+    if (prescale) t = trans::leadingDownscale(*plan, columns, rows, x, y);
+
+    if (t == NULL) return BlobToImage(image_info, blob, len, exception);
+
+    bool prescaled = false;
+    Image * i = IP_DecodeAtLeast(image_info, blob, len, columns, rows,
+                                 x, y, prescaled, exception);
+    if (prescaled) {
+        hint.downscale = t;
+        hint.x = x;
+        hint.y = y;
+    }
+
+    return i;
+}
+
+// admit a request to decode an in memory image against the resource
+// budget, estimating from its headers how many pixels it will decode.
+// Where IP_DecodeBlob() will decode a JPEG at reduced size (only when
+// prescale is set) or only a region of it, the estimate is reduced to
+// match.  An image we can't
+// ping is admitted, decoding it will report the error.
+static bool
+IP_Admit(const ImageInfo * image_info,
+         const void * blob, size_t len,
+         const trans::Plan * plan,
+         bool prescale,
+         imageproc::ResourceGovernor::Ticket & ticket,
+         std::string & oError)
+{
+    ExceptionInfo exception;
+    GetExceptionInfo(&exception);
+    Image * p = PingBlob(image_info, blob, len, &exception);
+    DestroyExceptionInfo(&exception);
+    if (!p) return true;
+
+    unsigned long long pixels = 0;
+    for (const Image * f = p; f; f = f->next) {
+        pixels += (unsigned long long) f->columns * f->rows;
+    }
+    unsigned long columns = p->columns, rows = p->rows;
+    DestroyImageList(p);
+
+    RectangleInfo ri;
+    unsigned int x = 0, y = 0;
+    if (plan && isJPEG(blob, len)) {
+        if (trans::leadingCrop(*plan, columns, rows, ri)) {
+            unsigned long long kept =
+                (unsigned long long)
+                (std::min(ri.x + ri.width, columns) - ri.x) *
+                (std::min(ri.y + ri.height, rows) - ri.y);
+            if (kept * 2 <= pixels) pixels = kept;
+        } else if (prescale &&
+                   trans::leadingDownscale(*plan, columns, rows, x, y) &&
+                   x > 0 && y > 0)
+        {
+            // libjpeg reduces by 2, 4 or 8
+            unsigned long d = 1;
+            while (d < 8 && (unsigned long) x * d * 2 <= columns &&
+                   (unsigned long) y * d * 2 <= rows)
+            {
+                d *= 2;
+            }
+            pixels = (unsigned long long)
+                ((columns + d - 1) / d) * ((rows + d - 1) / d);
+        }
+    }
+
+    return s_governor.admit(pixels, ticket, oError);
+}
+
+// the contents of an input file, either memory mapped or read into a
+// heap buffer
+struct InputFile {
+    InputFile() : data(NULL), len(0), handle(NULL), mapped(false) { }
+    const void * data;
+    size_t len;
+    void * handle;
+    bool mapped;
+};
+
+// load the file at path.  Where possible the file is memory mapped,
+// which saves us a full copy of the (potentially large) encoded image and
+// lets the decoder fault in only what it reads.  When mapping fails we
+// fall back to reading the file into a heap buffer.
+static bool
+IP_LoadFile(const std::string & path, InputFile & in)
+{
+    in = InputFile();
+    if (path.empty()) return false;
+
+    in.data = ft::mmap_read(path, in.len, &in.handle);
+    if (in.data) {
+        in.mapped = true;
+        return true;
+    }
+
+    g_bpCoreFunctions->log(
+        BP_INFO, "Couldn't map '%s', falling back to read", path.c_str());
+
     FILE * f = ft::fopen_binary_read(path);    
     if (!f) {
         g_bpCoreFunctions->log(
             BP_ERROR, "Couldn't open file for reading: %s", path.c_str());
-        return NULL;
+        return false;
     }
 
     // determine length of file
     int sought = fseek(f, 0L, SEEK_END);
-	long len = ftell(f);
+    long len = ftell(f);
     (void) fseek(f, 0L, SEEK_SET);
 
     if (sought || len <= 0) {
         g_bpCoreFunctions->log(
             BP_ERROR, "Couldn't determine file length: %s", path.c_str());
         fclose(f);
-        return NULL;
+        return false;
     }
 
-    void * img = malloc(len);
-    if (!img) {
+    void * buf = IP_Malloc(len);
+    if (!buf) {
         g_bpCoreFunctions->log(
-            BP_ERROR, "memory allocation failed (%ld bytes) when trying to "
-            "read image", len);
+            BP_ERROR, "memory allocation failed (%ld bytes) when trying "
+            "to read image", len);
         fclose(f);
-        return NULL;
+        return false;
     }
 
-    g_bpCoreFunctions->log(
-        BP_INFO, "Attempting to read %ld bytes from '%s'",
-        len, path.c_str());
-
-    size_t rd = fread(img, sizeof(unsigned char), len, f);
+    size_t rd = fread(buf, sizeof(unsigned char), len, f);
 
     fclose(f); // done with this file handle
     
     if ((long) rd != len) {
         g_bpCoreFunctions->log(
-            BP_ERROR, "Partial read detected, got %ld of %ld bytes",
-            rd, len);
-        free(img);
-        return NULL;
+            BP_ERROR, "Partial read detected, got %lu of %ld bytes",
+            (unsigned long) rd, len);
+        IP_Free(buf);
+        return false;
     }
 
-    // now convert it into a GM image 
-    Image * i = BlobToImage(image_info, img, len, exception);
+    in.data = buf;
+    in.len = (size_t) len;
+    return true;
+}
 
-    g_bpCoreFunctions->log(BP_ERROR, "read img: %p", i);
+// the size of the file at path, zero if it can't be determined
+static unsigned long long
+IP_FileSize(const std::string & path)
+{
+    FILE * f = ft::fopen_binary_read(path);
+    if (!f) return 0;
+    long len = -1;
+    if (fseek(f, 0L, SEEK_END) == 0) len = ftell(f);
+    fclose(f);
+    return (len > 0 ? (unsigned long long) len : 0);
+}
 
-    free(img);
+static void
+IP_ReleaseFile(InputFile & in)
+{
+    if (in.mapped) ft::munmap_read(in.data, in.len, in.handle);
+    else IP_Free((void *) in.data);
+    in = InputFile();
+}
 
-    return i;
+// encode images into the file at path.  Rather than encoding to an in
+// memory blob and then writing that, we open the output file ourselves
+// and hand the handle to GM, so encoded bytes are streamed to disk as
+// they're produced.  We open the file rather than letting GM do it so
+// that we can handle wide filenames safely on win32 systems.
+static bool
+IP_WriteImageFile(const ImageInfo * image_info,
+                  Image * images,
+                  const std::string & path,
+                  unsigned long long & written)
+{
+    written = 0;
+
+    FILE * f = ft::fopen_binary_write(path);
+    if (f == NULL) { 
+        g_bpCoreFunctions->log(
+            BP_ERROR, "Couldn't open '%s' for writing!", path.c_str());
+        return false;
+    }
+
+    bp::time::Stopwatch sw;
+
+    ImageInfo * write_info = CloneImageInfo(image_info);
+    write_info->file = f;
+
+    // the prefix selects the encoder.  the filename itself is never
+    // opened, GM writes to the handle in write_info
+    FormatString(images->filename, "%.64s:%.1024s", images->magick,
+                 path.c_str());
+
+    unsigned int status = WriteImage(write_info, images);
+    DestroyImageInfo(write_info);
+
+    long wt = ftell(f);
+
+    bool ok = (status != MagickFail &&
+               images->exception.severity < ErrorException);
+
+    if (fclose(f) != 0) ok = false;
+
+    if (!ok) {
+        g_bpCoreFunctions->log(
+            BP_ERROR, "Failed to write resultant image '%s': %s",
+            path.c_str(),
+            (images->exception.reason ? images->exception.reason
+                                      : "unknown error"));
+        return false;
+    }
+
+    g_bpCoreFunctions->log(BP_INFO, "Wrote %ld bytes to %s in %.2fms",
+                           wt, path.c_str(), sw.elapsedMS());
+
+    if (wt > 0) written = (unsigned long long) wt;
+    return true;
 }
 
 
+// the leaf name of an output file
+static std::string
+IP_OutputName(const std::string & inPath, imageproc::Type outputFormat)
+{
+    // default to input format
+    std::string name;
+    if (outputFormat == imageproc::UNKNOWN) name.append(ft::basename(inPath));
+    else {
+        name.append("img.");
+        name.append(imageproc::typeToExt(outputFormat));
+    }
+    return name;
+}
+
+// encode images as outputFormat (or their current format if UNKNOWN) into
+// a new file in tmpDir, populating written with its size.  returns the
+// path to the file, or empty on error
+static std::string
+IP_SaveImage(const std::string & tmpDir, const std::string & name,
+             const ImageInfo * image_info, Image * images,
+             imageproc::Type outputFormat,
+             unsigned long long & written, std::string & oError)
+{
+    written = 0;
+
+    // let's set the output format correctly
+    if (outputFormat != imageproc::UNKNOWN) {
+        (void) strncpy(images->magick, outputFormat, MaxTextExtent - 1);
+        g_bpCoreFunctions->log(BP_INFO, "Output to format: %s", outputFormat);
+    }
+    
+    if (!ft::mkdir(tmpDir, false)) {
+        oError.append("Couldn't create temp dir");
+        return std::string();
+    }
+
+    std::string outpath = ft::getPath(tmpDir, name);
+    if (!IP_WriteImageFile(image_info, images, outpath, written)) {
+        oError.append("Error saving output image");
+        return std::string();
+    }
+
+    return outpath;
+}
+
+// write a cached result into a new file in tmpDir
+static std::string
+IP_WriteCachedResult(const std::string & tmpDir,
+                     const std::string & name,
+                     const std::string & data)
+{
+    std::string outpath = ft::getPath(tmpDir, name);
+    FILE * f = ft::fopen_binary_write(outpath);
+    if (f == NULL) {
+        g_bpCoreFunctions->log(
+            BP_ERROR, "Couldn't open '%s' for writing!", outpath.c_str());
+        return std::string();
+    }
+
+    size_t wt = fwrite(data.data(), sizeof(char), data.size(), f);
+    if (fclose(f) != 0 || wt != data.size()) {
+        g_bpCoreFunctions->log(
+            BP_ERROR, "Partial write (%lu/%lu) when writing cached image "
+            "'%s'", (unsigned long) wt, (unsigned long) data.size(),
+            outpath.c_str());
+        return std::string();
+    }
+
+    return outpath;
+}
+
+// remember the output at outpath, of size bytes, for the next identical
+// request.  Outputs are streamed to disk as they're encoded, so one which
+// fits in the cache is read back.  Larger ones aren't cached, and aren't
+// read.
+static void
+IP_CacheResult(const std::string & key, const std::string & outpath,
+               unsigned long long size,
+               unsigned int x, unsigned int y,
+               unsigned int orig_x, unsigned int orig_y)
+{
+    if (size == 0 || size > s_results.stats().capacity) return;
+
+    InputFile out;
+    if (!IP_LoadFile(outpath, out)) return;
+
+    imageproc::ResultCache::Result r;
+    r.data.assign((const char *) out.data, out.len);
+    IP_ReleaseFile(out);
+    r.x = x;
+    r.y = y;
+    r.orig_x = orig_x;
+    r.orig_y = orig_y;
+    s_results.insert(key, r);
+}
+
 std::string
 imageproc::ChangeImage(const std::string & inPath,
                        const std::string & tmpDir,
                        Type outputFormat,
                        const bp::List & transformations,
                        int quality,
+                       bool lossless,
+                       trans::Optimization optimize,
                        unsigned int & x, unsigned int & y, 
                        unsigned int & orig_x, unsigned int & orig_y, 
+                       ResourceUsage & usage,
+                       Timings & timings,
                        std::string & oError)
 {
     ExceptionInfo exception;
@@ -307,25 +1099,169 @@ imageproc::ChangeImage(const std::string & inPath,
     ImageInfo *image_info;
 
     orig_x = orig_y = x = y = 0;
+    usage = ResourceUsage();
+    timings = Timings();
+    bp::time::Stopwatch total;
+
+    // reject malformed requests before touching the input
+    std::string actionsKey = trans::canonicalForm(&transformations);
+    trans::Plan plan;
+    if (!IP_CompilePlan(transformations, actionsKey, plan, oError)) {
+        return std::string();
+    }
+    // decoding a JPEG at reduced size gives slightly different pixels.
+    // that's inherent in a plan which begins with a downscale, but one
+    // moved to the front is only acceptable under 'fast' optimization
+    bool prescale = (trans::beginsWithDownscale(plan) ||
+                     optimize == trans::FastOptimization);
+    (void) trans::optimize(plan, optimize);
     
     GetExceptionInfo(&exception);
     image_info = CloneImageInfo((ImageInfo *) NULL);
 
-    // first we read the image
-    if (exception.severity != UndefinedException)
+    // set quality
+    if (quality > 100) quality = 100;
+    if (quality < 0) quality = 0;
+    image_info->quality = quality;
+
+    g_bpCoreFunctions->log(
+        BP_INFO, "Quality set to %d (0-100, worst-best)", quality);
+
+    std::string name = IP_OutputName(inPath, outputFormat);
+
+    // first we read the image.  mtime is taken first so that a write
+    // racing with the read can't pair new mtime with old contents
+    long long inMtime = ft::mtime(inPath);
+    bp::time::Stopwatch sw;
+    InputFile in;
+    if (!IP_LoadFile(inPath, in))
     {
-		if (exception.reason)
-            g_bpCoreFunctions->log(BP_ERROR, "after: %s\n",
-                                   exception.reason);
-		if (exception.description)
-            g_bpCoreFunctions->log(BP_ERROR, "after: %s\n",
-                                   exception.description);
-		CatchException(&exception);
+        oError.append("couldn't read image");
+        DestroyImageInfo(image_info);
+        image_info = NULL;
+        DestroyExceptionInfo(&exception);
+        return std::string();
+    }
+    double readMS = sw.elapsedMS();
+    timings.read = readMS;
+    timings.inputBytes = in.len;
+
+    // have we done this before?
+    std::string cacheKey;
+    if (s_results.stats().capacity > 0)
+    {
+        std::stringstream ss;
+        ss << s_results.fingerprint(inPath, in.data, in.len, inMtime)
+           << "|" << (outputFormat ? outputFormat : "")
+           << "|" << quality
+           << "|" << (lossless ? "lossless" : "")
+           << "|" << (int) optimize
+           << "|" << actionsKey;
+        cacheKey = ss.str();
+
+        ResultCache::Result cached;
+        if (s_results.lookup(cacheKey, cached))
+        {
+            IP_ReleaseFile(in);
+            DestroyImageInfo(image_info);
+            image_info = NULL;
+            DestroyExceptionInfo(&exception);
+
+            g_bpCoreFunctions->log(
+                BP_INFO, "result cache hit for '%s' (%lu bytes)",
+                inPath.c_str(), (unsigned long) cached.data.size());
+
+            sw.reset();
+            std::string rv = IP_WriteCachedResult(tmpDir, name, cached.data);
+            if (rv.empty()) {
+                oError.append("Error saving output image");
+            } else {
+                x = cached.x;
+                y = cached.y;
+                orig_x = cached.orig_x;
+                orig_y = cached.orig_y;
+                timings.cached = true;
+                timings.encode = sw.elapsedMS();
+                timings.outputBytes = cached.data.size();
+                timings.outputPixels = (unsigned long long) x * y;
+                timings.total = total.elapsedMS();
+            }
+            return rv;
+        }
     }
 
+    // rotations and crops of a JPEG may be possible without decoding
+    if (lossless && isJPEG(in.data, in.len) &&
+        (outputFormat == UNKNOWN || !strcasecmp(outputFormat, "JPEG") ||
+         !strcasecmp(outputFormat, "JPG")))
+    {
+        std::string why;
+        std::string outpath;
+        sw.reset();
+        if (!ft::mkdir(tmpDir, false)) {
+            why.append("couldn't create temp dir");
+        } else {
+            outpath = ft::getPath(tmpDir, name);
+            if (!lossless::transformJPEG(in.data, in.len, plan, true,
+                                         outpath, x, y, orig_x, orig_y,
+                                         why))
+            {
+                outpath.clear();
+            }
+        }
+
+        timings.lossless = sw.elapsedMS();
+        if (!outpath.empty()) {
+            g_bpCoreFunctions->log(
+                BP_INFO, "losslessly transformed '%s' in %.2fms",
+                inPath.c_str(), timings.lossless);
+            timings.outputBytes = IP_FileSize(outpath);
+            timings.outputPixels = (unsigned long long) x * y;
+            timings.total = total.elapsedMS();
+            IP_ReleaseFile(in);
+            DestroyImageInfo(image_info);
+            image_info = NULL;
+            DestroyExceptionInfo(&exception);
+            if (!cacheKey.empty()) {
+                IP_CacheResult(cacheKey, outpath, timings.outputBytes,
+                               x, y, orig_x, orig_y);
+            }
+            return outpath;
+        }
+
+        g_bpCoreFunctions->log(
+            BP_INFO, "lossless transformation not possible (%s), "
+            "decoding", why.c_str());
+        orig_x = orig_y = x = y = 0;
+    }
+
+	(void) strncpy(image_info->filename, inPath.c_str(), MaxTextExtent - 1);
+
+    // held until we're done with the pixels
+    ResourceGovernor::Ticket ticket;
+    if (!IP_Admit(image_info, in.data, in.len, &plan, prescale, ticket,
+                  oError))
+    {
+        IP_ReleaseFile(in);
+        DestroyImageInfo(image_info);
+        image_info = NULL;
+        DestroyExceptionInfo(&exception);
+        return std::string();
+    }
+
+    DecodeHint hint;
+    sw.reset();
+    images = IP_DecodeBlob(image_info, in.data, in.len, &plan, prescale,
+                           hint, &exception);
+    timings.decode = sw.elapsedMS();
+
+    g_bpCoreFunctions->log(
+        BP_INFO, "read %lu input bytes from '%s' (%s) in %.2fms, "
+        "decoded in %.2fms: %p",
+        (unsigned long) in.len, inPath.c_str(),
+        (in.mapped ? "mmap" : "read"), readMS, timings.decode, images);
 
-	(void) strcpy(image_info->filename, inPath.c_str());
-    images = IP_ReadImageFile(image_info, inPath, &exception);
+    IP_ReleaseFile(in);
     
     if (exception.severity != UndefinedException)
     {
@@ -352,16 +1288,46 @@ imageproc::ChangeImage(const std::string & inPath,
         GetImageListLength(images),
         images->magick);
 
-    // set quality
-    if (quality > 100) quality = 100;
-    if (quality < 0) quality = 0;
-    image_info->quality = quality;
-
-    g_bpCoreFunctions->log(
-        BP_INFO, "Quality set to %d (0-100, worst-best)", quality);
+    // finish any downscale that was started by the decoder, and skip
+    // any crop it completed
+    ticket.observe(IP_PixelBytes(images));
+    timings.inputPixels = IP_Pixels(images);
+    unsigned int firstAction = 0;
+    if (hint.downscale) {
+        sw.reset();
+        Image * scaled = trans::downscale(hint.downscale, images,
+                                          hint.x, hint.y);
+        timings.decode += sw.elapsedMS();
+        ticket.observe(IP_PixelBytes(images) + IP_PixelBytes(scaled));
+        DestroyImage(images);
+        images = scaled;
+        firstAction = 1;
+        if (!images) oError.append("couldn't downscale image");
+    } else if (hint.cropped) {
+        firstAction = 1;
+    }
 
-    // execute 'actions' 
-    images = runTransformations(images, transformations, quality, oError);
+    // execute 'actions', frame by frame if the result will be animated
+    if (images && firstAction < plan.size() &&
+        IP_StaysAnimated(images, outputFormat))
+    {
+        // every frame's input and output may be held at once
+        unsigned long long inBytes = IP_PixelBytes(images);
+        sw.reset();
+        images = runTransformationsOnFrames(images, plan, firstAction,
+                                            quality, oError);
+        timings.actions.push_back(IP_FramesStage(plan, firstAction,
+                                                 sw.elapsedMS()));
+        ticket.observe(inBytes + IP_PixelBytes(images));
+    } else if (images) {
+        unsigned long long peak = 0;
+        images = runTransformations(images, plan, firstAction,
+                                    quality, oError, &peak,
+                                    &timings.actions);
+        ticket.observe(peak);
+    }
+    usage.peak = ticket.peak();
+    usage.spilled = ticket.spilled();
 
     // was all that successful?
     if (!images)
@@ -378,75 +1344,368 @@ imageproc::ChangeImage(const std::string & inPath,
     x = images->columns;
     y = images->rows;
 
-    // let's set the output format correctly (default to input format)
-    std::string name;
-    if (outputFormat == UNKNOWN) name.append(ft::basename(inPath));
-    else {
-        name.append("img.");
-        name.append(typeToExt(outputFormat));
-        (void) sprintf(images->magick, outputFormat);
-        g_bpCoreFunctions->log(BP_INFO, "Output to format: %s", outputFormat);
-    }
-    
-    // Now let's go directly from blob to file.  We bypass
-    // GM to-file functions so that we can handle wide filenames
-    // safely on win32 systems.  A superior solution would
-    // be to use GM stream facilities (if they exist)
-    
     // upon success, will hold path to output file and will be returned to
     // client
-    std::string rv;
+    sw.reset();
+    std::string rv = IP_SaveImage(tmpDir, name, image_info, images,
+                                  outputFormat, timings.outputBytes, oError);
+    timings.encode = sw.elapsedMS();
+    timings.outputPixels = IP_Pixels(images);
+    timings.total = total.elapsedMS();
+    if (!rv.empty() && !cacheKey.empty()) {
+        IP_CacheResult(cacheKey, rv, timings.outputBytes,
+                       x, y, orig_x, orig_y);
+    }
     
+    DestroyImage(images);
+    DestroyImageInfo(image_info);
+    image_info = NULL;
+    DestroyExceptionInfo(&exception);
+
+    return rv;
+}
+
+// for ordering outputs largest first
+struct LargerOutput {
+    LargerOutput(const std::vector<unsigned int> & x,
+                 const std::vector<unsigned int> & y) : m_x(x), m_y(y) { }
+    bool operator()(unsigned int a, unsigned int b) const {
+        return ((unsigned long long) m_x[a] * m_y[a] >
+                (unsigned long long) m_x[b] * m_y[b]);
+    }
+    const std::vector<unsigned int> & m_x;
+    const std::vector<unsigned int> & m_y;
+};
+
+bool
+imageproc::ChangeImageMulti(const std::string & inPath,
+                            const std::string & tmpDir,
+                            const std::vector<OutputSpec> & outputs,
+                            std::vector<OutputResult> & results,
+                            std::string & oError)
+{
+    unsigned int i, n = outputs.size();
+    results.clear();
+    results.resize(n);
+
+    // compile every output's actions before touching the input.  invalid
+    // outputs fail individually
+    std::vector<trans::Plan> plans(n);
+    std::vector<bool> valid(n);
+    unsigned int numValid = 0;
+    for (i = 0; i < n; i++) {
+        const bp::List * a = outputs[i].actions;
+        valid[i] = (!a || IP_CompilePlan(*a, trans::canonicalForm(a),
+                                         plans[i], results[i].error));
+        if (valid[i]) {
+            (void) trans::optimize(plans[i], outputs[i].optimize);
+            numValid++;
+        }
+    }
+    if (n > 0 && numValid == 0) return true;
+
+    // read and decode are shared, and reported with every output
+    Timings shared;
+    bp::time::Stopwatch sw;
+    InputFile in;
+    if (!IP_LoadFile(inPath, in)) {
+        oError.append("couldn't read image");
+        return false;
+    }
+    shared.read = sw.elapsedMS();
+    shared.inputBytes = in.len;
+
+    ExceptionInfo exception;
+    GetExceptionInfo(&exception);
+    ImageInfo * image_info = CloneImageInfo((ImageInfo *) NULL);
+	(void) strncpy(image_info->filename, inPath.c_str(), MaxTextExtent - 1);
+
+    // find the outputs that are a plain downscale, and what size each
+    // will be
+    unsigned long columns = 0, rows = 0;
+    bool allDownscales =
+        (n > 0 &&
+         IP_PingSize(image_info, in.data, in.len, columns, rows, &exception));
+    std::vector<const trans::Transformation *> downscales(n);
+    std::vector<unsigned int> tx(n), ty(n);
+    unsigned int maxX = 0, maxY = 0;
+    for (i = 0; i < n; i++) {
+        downscales[i] = NULL;
+        tx[i] = ty[i] = 0;
+        if (!valid[i]) continue;
+        if (plans[i].size() == 1) {
+            downscales[i] = trans::leadingDownscale(plans[i], columns, rows,
+                                                    tx[i], ty[i]);
+        }
+        // a lone downscale wasn't reordered, so the slightly different
+        // pixels of a reduced size decode are acceptable at any level
+        if (!downscales[i]) allDownscales = false;
+        if (tx[i] > maxX) maxX = tx[i];
+        if (ty[i] > maxY) maxY = ty[i];
+    }
+
+    // held until every output has been generated
+    ResourceGovernor::Ticket ticket;
+    if (!IP_Admit(image_info, in.data, in.len, NULL, false, ticket,
+                  oError))
     {
-        size_t l = 0;
-        void * blob = NULL;
-        blob = ImageToBlob( image_info, images, &l, &exception );
+        IP_ReleaseFile(in);
+        DestroyImageInfo(image_info);
+        DestroyExceptionInfo(&exception);
+        return false;
+    }
 
-        if (exception.severity != UndefinedException)
-        {
-            oError.append("ImageToBlob failed.");
-            CatchException(&exception);
+    // decode once.  if every output is a downscale the decoder can skip
+    // detail that none of them need
+    bool prescaled = false;
+    Image * source = NULL;
+    bp::time::Stopwatch decodeSW;
+    if (allDownscales) {
+        source = IP_DecodeAtLeast(image_info, in.data, in.len, columns, rows,
+                                  maxX, maxY, prescaled, &exception);
+    } else {
+        source = BlobToImage(image_info, in.data, in.len, &exception);
+    }
+    shared.decode = decodeSW.elapsedMS();
+    shared.inputPixels = IP_Pixels(source);
+
+    g_bpCoreFunctions->log(
+        BP_INFO, "read and decoded %lu input bytes from '%s' in %.2fms "
+        "for %u outputs: %p", (unsigned long) in.len, inPath.c_str(),
+        sw.elapsedMS(), n, source);
+
+    IP_ReleaseFile(in);
+
+    if (exception.severity != UndefinedException)
+    {
+		if (exception.reason)
+            g_bpCoreFunctions->log(BP_ERROR, "after: %s\n",
+                                   exception.reason);
+		if (exception.description)
+            g_bpCoreFunctions->log(BP_ERROR, "after: %s\n",
+                                   exception.description);
+		CatchException(&exception);
+    }
+
+    if (!source) {
+        oError.append("couldn't read image");
+        DestroyImageInfo(image_info);
+        DestroyExceptionInfo(&exception);
+        return false;
+    }
+
+    // largest first, so each downscale may be resampled from the previous
+    // one.  Other outputs start from the source.
+    std::vector<unsigned int> order;
+    for (i = 0; i < n; i++) order.push_back(i);
+    std::stable_sort(order.begin(), order.end(), LargerOutput(tx, ty));
+
+    Image * prev = NULL;
+    for (unsigned int o = 0; o < n; o++) {
+        i = order[o];
+        const OutputSpec & spec = outputs[i];
+        OutputResult & r = results[i];
+        if (!valid[i]) continue;
+
+        int quality = spec.quality;
+        if (quality > 100) quality = 100;
+        if (quality < 0) quality = 0;
+        image_info->quality = quality;
+
+        sw.reset();
+        r.timings = shared;
+        bp::time::Stopwatch stage;
+        Image * img = NULL;
+        // the source and the last downscale are held throughout
+        unsigned long long held =
+            IP_PixelBytes(source) + IP_PixelBytes(prev);
+        unsigned long long peak = 0;
+        bool animated = (!plans[i].empty() &&
+                         IP_StaysAnimated(source, spec.format));
+        if (animated) {
+            img = CloneImageList(source, &exception);
+            if (!img) r.error.append("couldn't clone image");
+            else {
+                peak = IP_PixelBytes(img);
+                img = runTransformationsOnFrames(img, plans[i], 0, quality,
+                                                 r.error);
+                peak += IP_PixelBytes(img);
+                r.timings.actions.push_back(
+                    IP_FramesStage(plans[i], 0, stage.elapsedMS()));
+            }
+        } else if (downscales[i]) {
+            const Image * from = source;
+            if (prev && prev->columns >= tx[i] && prev->rows >= ty[i]) {
+                from = prev;
+            }
+            img = trans::downscale(downscales[i], from, tx[i], ty[i]);
+            if (!img) r.error.append("couldn't downscale image");
+            StageTime st;
+            st.name = downscales[i]->name;
+            st.ms = stage.elapsedMS();
+            r.timings.actions.push_back(st);
+        } else if (plans[i].empty()) {
+            // no actions, keep every frame
+            img = CloneImageList(source, &exception);
+            if (!img) r.error.append("couldn't clone image");
+        } else {
+            img = CloneImage(source, 0, 0, 1, &exception);
+            if (!img) r.error.append("couldn't clone image");
+            else {
+                img = runTransformations(img, plans[i], 0, quality,
+                                         r.error, &peak,
+                                         &r.timings.actions);
+            }
         }
-        else
-        {
-            g_bpCoreFunctions->log(BP_INFO, "Writing %lu bytes to %s",
-                                   l, name.c_str());
+        peak = held + std::max(peak, IP_PixelBytes(img));
+        ticket.observe(peak);
+        r.usage.peak = peak;
+        r.usage.spilled = ticket.spilled();
+
+        if (img) {
+            r.orig_x = img->magick_columns;
+            r.orig_y = img->magick_rows;
+            r.x = img->columns;
+            r.y = img->rows;
+            stage.reset();
+            r.path = IP_SaveImage(tmpDir, IP_OutputName(inPath, spec.format),
+                                  image_info, img, spec.format,
+                                  r.timings.outputBytes, r.error);
+            r.timings.encode = stage.elapsedMS();
+            r.timings.outputPixels = IP_Pixels(img);
+            r.timings.total = shared.read + shared.decode + sw.elapsedMS();
+            g_bpCoreFunctions->log(
+                BP_INFO, "output %u (%ux%u) %s in %.2fms", i, r.x, r.y,
+                (r.path.empty() ? "failed" : "generated"), sw.elapsedMS());
 
-            if (!ft::mkdir(tmpDir, false)) {
-                oError.append("Couldn't create temp dir");
+            if (downscales[i] && !animated) {
+                if (prev) DestroyImageList(prev);
+                prev = img;
             } else {
-                std::string outpath = ft::getPath(tmpDir, name);
-                FILE * f = ft::fopen_binary_write(outpath);
-                if (f == NULL) { 
-                    g_bpCoreFunctions->log(
-                        BP_ERROR, "Couldn't open '%s' for writing!",
-                        outpath.c_str());
-                    oError.append("Error saving output image");
-                } else {
-                    size_t wt;
-                    wt = fwrite(blob, sizeof(char), l, f);
-                    fclose(f);
-
-                    if (wt != l) {
-                        g_bpCoreFunctions->log(
-                            BP_ERROR,
-                            "Partial write (%lu/%lu) when writing resultant "
-                            "image '%s'",
-                            wt, l, outpath.c_str());
-                        oError.append("Error saving output image");
-                    } else {
-                        // success!
-                        rv = outpath;
-                    }
-                }
+                DestroyImageList(img);
             }
         }
+        
+        if (r.path.empty() && r.error.empty()) r.error.append("unknown");
     }
-    
-    DestroyImage(images);
+
+    if (prev) DestroyImageList(prev);
+    DestroyImageList(source);
     DestroyImageInfo(image_info);
-    image_info = NULL;
     DestroyExceptionInfo(&exception);
 
-    return rv;
+    return true;
+}
+
+void
+imageproc::setResultCacheCapacity(size_t bytes)
+{
+    s_results.setCapacity(bytes);
+}
+
+imageproc::ResultCache::Stats
+imageproc::resultCacheStats()
+{
+    return s_results.stats();
+}
+
+void
+imageproc::setPlanCacheCapacity(unsigned int entries)
+{
+    s_plans.setCapacity(entries);
+}
+
+imageproc::PlanCache::Stats
+imageproc::planCacheStats()
+{
+    return s_plans.stats();
+}
+
+void
+imageproc::setResourceLimits(const ResourceLimits & limits)
+{
+    s_governor.setLimits(limits);
+}
+
+imageproc::ResourceGovernor::Stats
+imageproc::resourceStats()
+{
+    return s_governor.stats();
+}
+
+void
+imageproc::setBufferPoolCapacity(size_t bytes)
+{
+    s_buffers.setCapacity(bytes);
+}
+
+bp::mem::BufferPool::Stats
+imageproc::bufferPoolStats()
+{
+    return s_buffers.stats();
+}
+
+bool
+imageproc::ProbeImage(const std::string & inPath,
+                      ImageSummary & summary,
+                      std::string & oError)
+{
+    summary = ImageSummary();
+
+    InputFile in;
+    if (!IP_LoadFile(inPath, in)) {
+        oError.append("couldn't read image");
+        return false;
+    }
+
+    ExceptionInfo exception;
+    GetExceptionInfo(&exception);
+    ImageInfo * image_info = CloneImageInfo((ImageInfo *) NULL);
+    (void) strncpy(image_info->filename, inPath.c_str(), MaxTextExtent - 1);
+
+    // pinging parses headers but doesn't decode pixels
+    bp::time::Stopwatch sw;
+    Image * images = PingBlob(image_info, in.data, in.len, &exception);
+    IP_ReleaseFile(in);
+
+    if (exception.severity != UndefinedException)
+    {
+		if (exception.reason)
+            g_bpCoreFunctions->log(BP_ERROR, "ping: %s\n",
+                                   exception.reason);
+		if (exception.description)
+            g_bpCoreFunctions->log(BP_ERROR, "ping: %s\n",
+                                   exception.description);
+		CatchException(&exception);
+    }
+
+    if (images) {
+        summary.format = images->magick;
+        summary.width = images->columns;
+        summary.height = images->rows;
+        summary.frames = GetImageListLength(images);
+        summary.depth = images->depth;
+
+        // EXIF orientation (1-8), 1 (top-left) when absent
+        const ImageAttribute * a =
+            GetImageAttribute(images, "EXIF:Orientation");
+        if (a && a->value) {
+            int o = atoi(a->value);
+            if (o >= 1 && o <= 8) summary.orientation = o;
+        }
+
+        g_bpCoreFunctions->log(
+            BP_INFO, "probed '%s' in %.2fms: %s %ux%u, %u frames",
+            inPath.c_str(), sw.elapsedMS(), summary.format.c_str(),
+            summary.width, summary.height, summary.frames);
+
+        DestroyImageList(images);
+    } else {
+        oError.append("couldn't read image");
+    }
+
+    DestroyImageInfo(image_info);
+    DestroyExceptionInfo(&exception);
+
+    return (images != NULL);
 }
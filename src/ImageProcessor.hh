@@ -34,12 +34,22 @@
 #define __IMAGEPROCESSOR_HH__
 
 #include <string>
+#include <vector>
 #include "bptypeutil.hh"
+#include "service.hh"
+#include "ResultCache.hh"
+#include "PlanCache.hh"
+#include "ResourceGovernor.hh"
+#include "util/bpbufferpool.hh"
+#include "Transformations.hh"
 
 namespace imageproc {
     
-	/** once per process initialization */
-	void init();
+	/** once per process initialization, before any other thread uses
+	 *  imageproc.  Pixel caches which don't fit in memory are written
+	 *  to files in spillDir, by default a directory within the system's
+	 *  temp dir */
+	void init(const std::string & spillDir = std::string());
 
 	/** once per process shutdown */
 	void shutdown();
@@ -55,12 +65,81 @@ namespace imageproc {
     /** given an image type, generate a reasonable
      *  contained within */
     std::string typeToExt(Type t);
+
+    /** the pixel cache used to produce an image, for tuning limits */
+    struct ResourceUsage {
+        ResourceUsage() : peak(0), spilled(false) { }
+        // the most bytes of decoded pixels held at once, zero if nothing
+        // was decoded
+        unsigned long long peak;
+        // were pixels held on disk rather than in RAM?
+        bool spilled;
+    };
+
+    /** the time taken by a stage of producing an image */
+    struct StageTime {
+        StageTime() : ms(0.0) { }
+        // the action, or actions when several were streamed together
+        std::string name;
+        double ms;
+    };
+
+    /** where the time went in producing an image, and how much data was
+     *  moved.  Times are in milliseconds, zero for stages which didn't
+     *  run */
+    struct Timings {
+        Timings() : read(0.0), lossless(0.0), decode(0.0), encode(0.0),
+                    total(0.0), inputBytes(0), outputBytes(0),
+                    inputPixels(0), outputPixels(0), cached(false) { }
+        // reading or mapping the input file
+        double read;
+        // rotating or cropping a JPEG without decoding it
+        double lossless;
+        // decoding the input, and finishing any downscale the decoder
+        // started
+        double decode;
+        // each stage of the pipeline, in order
+        std::vector<StageTime> actions;
+        // encoding the output and writing it to its file, which happen
+        // together as encoded bytes are streamed out.  Or writing a
+        // cached result
+        double encode;
+        double total;
+        // sizes of the input and output files
+        unsigned long long inputBytes;
+        unsigned long long outputBytes;
+        // pixels decoded and pixels in the result, summed over frames
+        unsigned long long inputPixels;
+        unsigned long long outputPixels;
+        // was the result cached from an earlier request?
+        bool cached;
+    };
     
-    /** perform a series of operations on an image
+    
+    /** perform a series of operations on an image.  When the image is
+     *  animated and the output format can hold several frames, every
+     *  frame is transformed, frames in parallel.
      *  inPath - the path to an input image
      *  tmpdir - a directory where the result should be stored
      *  outputFormat - the type of image to return (short string rep)
      *  transformations - a list of transformations to perform in order
+     *  quality - 0-100, worst-best
+     *  lossless - if the input is a JPEG and so is the output, perform
+     *             right angle rotations and crops upon its coefficients
+     *             without decoding.  Crop edges are widened to the
+     *             nearest MCU boundary (8 or 16 pixels).  Falls back to
+     *             the normal path if actions include anything else
+     *  optimize - whether downscales may be moved ahead of other actions,
+     *             see trans::optimize().  A JPEG whose actions begin
+     *             with a downscale is decoded at reduced size at any
+     *             level, FastOptimization also allows it for a
+     *             downscale moved to the front
+     *  usage - populated with the pixel cache used.  Requests too
+     *          large for their share of the in RAM budget spill to
+     *          files in the spillDir given to init(), by default
+     *          IA_SPILL_DIR within the system's temp dir, see
+     *          ResourceGovernor
+     *  timings - populated with the time taken by each stage
      *  error - a verbose developer readable english error
      *  x - the horizontal dimension of the resultant image
      *  y - the vertical dimension of the resultant image
@@ -74,8 +153,114 @@ namespace imageproc {
         Type outputFormat,
         const bp::List & transformations,
         int quality,
+        bool lossless,
+        trans::Optimization optimize,
         unsigned int & x, unsigned int & y, 
         unsigned int & orig_x, unsigned int & orig_y, 
+        ResourceUsage & usage,
+        Timings & timings,
+        std::string & error);
+
+    /** one of several outputs to generate from a single input */
+    struct OutputSpec {
+        OutputSpec() : format(UNKNOWN), quality(IA_DEFAULT_QUALITY),
+                       actions(NULL), optimize(trans::NoOptimization) { }
+        // the type of image to produce, UNKNOWN for the input type
+        Type format;
+        // 0-100, worst-best
+        int quality;
+        // transformations to perform, NULL for none
+        const bp::List * actions;
+        // whether downscales may be moved ahead of other actions.  The
+        // input is decoded at reduced size only if every output is a
+        // lone downscale
+        trans::Optimization optimize;
+    };
+
+    /** the outcome of generating an OutputSpec */
+    struct OutputResult {
+        OutputResult() : x(0), y(0), orig_x(0), orig_y(0) { }
+        // path to the resulting image, .empty() on error
+        std::string path;
+        unsigned int x, y;
+        unsigned int orig_x, orig_y;
+        // pixel cache used, including the decoded input
+        ResourceUsage usage;
+        // time taken, read and decode are shared by every output
+        Timings timings;
+        // a verbose developer readable english error
+        std::string error;
+    };
+
+    /** generate several outputs from a single input, which is decoded
+     *  only once.  Outputs which are a single scale or thumbnail are
+     *  cascaded, each resampled from the previous larger one rather
+     *  than from the original.
+     *  inPath - the path to an input image
+     *  tmpdir - a directory where the results should be stored
+     *  outputs - the outputs to generate
+     *  results - populated with one result per output, in order
+     *  error - a verbose developer readable english error
+     *  \returns false if the input couldn't be read, in which case
+     *            error is populated.  Otherwise check each result.
+     */
+    bool ChangeImageMulti(
+        const std::string & inPath,
+        const std::string & tmpdir,
+        const std::vector<OutputSpec> & outputs,
+        std::vector<OutputResult> & results,
+        std::string & error);
+
+    /** limit the bytes of output which ChangeImage will keep in memory
+     *  to satisfy repeated identical requests.  zero disables caching */
+    void setResultCacheCapacity(size_t bytes);
+
+    /** hit/miss counts and utilization of the result cache */
+    ResultCache::Stats resultCacheStats();
+
+    /** limit the number of compiled action lists kept for reuse.  zero
+     *  disables caching */
+    void setPlanCacheCapacity(unsigned int entries);
+
+    /** hit/miss counts and utilization of the plan cache */
+    PlanCache::Stats planCacheStats();
+
+    /** change the ceilings upon memory, memory mapped files, disk and
+     *  pixels used to hold decoded images */
+    void setResourceLimits(const ResourceLimits & limits);
+
+    /** admissions, spills and utilization of resources */
+    ResourceGovernor::Stats resourceStats();
+
+    /** limit the bytes of freed buffers kept for reuse.  zero disables
+     *  retention */
+    void setBufferPoolCapacity(size_t bytes);
+
+    /** reuse and utilization of the buffer pool */
+    bp::mem::BufferPool::Stats bufferPoolStats();
+
+    /** attributes of an image that can be learned without decoding
+     *  its pixels */
+    struct ImageSummary {
+        ImageSummary() : width(0), height(0), frames(0), depth(0),
+                         orientation(1) { }
+        // the format of the image, i.e. "JPEG"
+        std::string format;
+        unsigned int width;
+        unsigned int height;
+        // number of frames (> 1 for animations)
+        unsigned int frames;
+        // bits per sample
+        unsigned int depth;
+        // EXIF orientation, 1-8.  1 (top-left) if unspecified
+        unsigned int orientation;
+    };
+
+    /** read only the headers of the image at inPath, and describe it.
+     *  \returns false on error, in which case error is populated */
+    bool ProbeImage(
+        const std::string & inPath,
+        ImageSummary & summary,
         std::string & error);
 };
 
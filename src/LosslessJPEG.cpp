@@ -0,0 +1,682 @@
+/*
+ * Copyright 2009, Yahoo!
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ * 
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ * 
+ *  3. Neither the name of Yahoo! nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "LosslessJPEG.hh"
+#include "service.hh"
+#include "util/fileutil.hh"
+
+#include <sstream>
+
+#include <math.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <string.h>
+
+extern "C" {
+#include <jpeglib.h>
+#include <jerror.h>
+}
+
+// the region of the source image that is kept, and the number of
+// clockwise quarter turns then applied to it
+struct Geometry {
+    unsigned int x0, y0, x1, y1;
+    unsigned int turns;
+};
+
+// what we need to know about a source image to plan the transformation
+struct SourceInfo {
+    unsigned int width, height;
+    // size of an MCU in pixels
+    unsigned int mcuWidth, mcuHeight;
+};
+
+// libjpeg reports fatal errors by calling error_exit, which mustn't
+// return.  We jump back to the function that started the work.
+struct ErrorManager {
+    struct jpeg_error_mgr pub;
+    jmp_buf jump;
+    char message[JMSG_LENGTH_MAX];
+};
+
+static void
+errorExit(j_common_ptr cinfo)
+{
+    ErrorManager * err = (ErrorManager *) cinfo->err;
+    (*cinfo->err->format_message)(cinfo, err->message);
+    longjmp(err->jump, 1);
+}
+
+static void
+outputMessage(j_common_ptr cinfo)
+{
+    // warnings are not interesting to us
+}
+
+static void
+initErrorManager(ErrorManager & err)
+{
+    jpeg_std_error(&err.pub);
+    err.pub.error_exit = errorExit;
+    err.pub.output_message = outputMessage;
+    err.message[0] = 0;
+}
+
+// a source manager for an in memory image
+static void initSource(j_decompress_ptr cinfo) { }
+static void termSource(j_decompress_ptr cinfo) { }
+
+static boolean
+fillInputBuffer(j_decompress_ptr cinfo)
+{
+    // premature end of data, insert a fake EOI marker as libjpeg's own
+    // source managers do
+    static const JOCTET eoi[2] = { 0xFF, JPEG_EOI };
+    WARNMS(cinfo, JWRN_JPEG_EOF);
+    cinfo->src->next_input_byte = eoi;
+    cinfo->src->bytes_in_buffer = 2;
+    return TRUE;
+}
+
+static void
+skipInputData(j_decompress_ptr cinfo, long num_bytes)
+{
+    if (num_bytes <= 0) return;
+    if ((size_t) num_bytes > cinfo->src->bytes_in_buffer) {
+        (void) fillInputBuffer(cinfo);
+    } else {
+        cinfo->src->next_input_byte += num_bytes;
+        cinfo->src->bytes_in_buffer -= num_bytes;
+    }
+}
+
+static void
+memorySource(j_decompress_ptr cinfo, const void * data, size_t len)
+{
+    cinfo->src = (struct jpeg_source_mgr *)
+        (*cinfo->mem->alloc_small)((j_common_ptr) cinfo, JPOOL_PERMANENT,
+                                   sizeof(struct jpeg_source_mgr));
+    cinfo->src->init_source = initSource;
+    cinfo->src->fill_input_buffer = fillInputBuffer;
+    cinfo->src->skip_input_data = skipInputData;
+    cinfo->src->resync_to_restart = jpeg_resync_to_restart;
+    cinfo->src->term_source = termSource;
+    cinfo->src->next_input_byte = (const JOCTET *) data;
+    cinfo->src->bytes_in_buffer = len;
+}
+
+// a destination manager which appends to a string
+struct MemoryDestination {
+    struct jpeg_destination_mgr pub;
+    std::string * out;
+    JOCTET buffer[4096];
+};
+
+static void
+initDestination(j_compress_ptr cinfo)
+{
+    MemoryDestination * d = (MemoryDestination *) cinfo->dest;
+    d->pub.next_output_byte = d->buffer;
+    d->pub.free_in_buffer = sizeof(d->buffer);
+}
+
+static boolean
+emptyOutputBuffer(j_compress_ptr cinfo)
+{
+    MemoryDestination * d = (MemoryDestination *) cinfo->dest;
+    d->out->append((const char *) d->buffer, sizeof(d->buffer));
+    d->pub.next_output_byte = d->buffer;
+    d->pub.free_in_buffer = sizeof(d->buffer);
+    return TRUE;
+}
+
+static void
+termDestination(j_compress_ptr cinfo)
+{
+    MemoryDestination * d = (MemoryDestination *) cinfo->dest;
+    d->out->append((const char *) d->buffer,
+                   sizeof(d->buffer) - d->pub.free_in_buffer);
+}
+
+static void
+memoryDestination(j_compress_ptr cinfo, std::string * out)
+{
+    MemoryDestination * d = (MemoryDestination *)
+        (*cinfo->mem->alloc_small)((j_common_ptr) cinfo, JPOOL_PERMANENT,
+                                   sizeof(MemoryDestination));
+    d->pub.init_destination = initDestination;
+    d->pub.empty_output_buffer = emptyOutputBuffer;
+    d->pub.term_destination = termDestination;
+    d->out = out;
+    cinfo->dest = &d->pub;
+}
+
+// read the headers of a JPEG.  On failure, message is populated
+static bool
+readSourceInfo(const void * data, size_t len, SourceInfo & info,
+               char * message)
+{
+    struct jpeg_decompress_struct src;
+    ErrorManager err;
+    memset(&src, 0, sizeof(src));
+    initErrorManager(err);
+    src.err = &err.pub;
+
+    if (setjmp(err.jump)) {
+        strcpy(message, err.message);
+        jpeg_destroy_decompress(&src);
+        return false;
+    }
+
+    jpeg_create_decompress(&src);
+    memorySource(&src, data, len);
+    (void) jpeg_read_header(&src, TRUE);
+
+    info.width = src.image_width;
+    info.height = src.image_height;
+    info.mcuWidth = src.max_h_samp_factor * DCTSIZE;
+    info.mcuHeight = src.max_v_samp_factor * DCTSIZE;
+
+    jpeg_destroy_decompress(&src);
+    return true;
+}
+
+// Work out the region of the source kept by plan, and how it's rotated.
+// Any sequence of right angle rotations and crops is equivalent to a
+// single crop of the source followed by a single rotation.
+static bool
+planGeometry(const trans::Plan & plan, const SourceInfo & info,
+             Geometry & g, std::string & oError)
+{
+    const trans::Transformation * rotate = trans::get("rotate");
+    const trans::Transformation * crop = trans::get("crop");
+
+    g.x0 = g.y0 = 0;
+    g.x1 = info.width;
+    g.y1 = info.height;
+    g.turns = 0;
+
+    for (unsigned int i = 0; i < plan.size(); i++) {
+        const trans::Step & s = plan[i];
+        if (s.t == rotate) {
+            if (fmod(s.args.number, 90.0) != 0.0) {
+                std::stringstream ss;
+                ss << "rotation by " << s.args.number
+                   << " degrees isn't a right angle";
+                oError = ss.str();
+                return false;
+            }
+            long q = ((long) (s.args.number / 90.0)) % 4;
+            if (q < 0) q += 4;
+            g.turns = (g.turns + q) % 4;
+        } else if (s.t == crop) {
+            // current dimensions
+            bool odd = (g.turns % 2) == 1;
+            unsigned long cw = odd ? g.y1 - g.y0 : g.x1 - g.x0;
+            unsigned long ch = odd ? g.x1 - g.x0 : g.y1 - g.y0;
+
+            // the rectangle as cropTransform computes it, relative to the
+            // dimensions of the source, and clipped as CropImage() does
+            const double * c = s.args.crop;
+            unsigned long rw = (unsigned long) (info.width * (c[2] - c[0]));
+            unsigned long rh = (unsigned long) (info.height * (c[3] - c[1]));
+            unsigned long rx = (unsigned long) (info.width * c[0]);
+            unsigned long ry = (unsigned long) (info.height * c[1]);
+            if (rw == 0 || rh == 0 || rx >= cw || ry >= ch) {
+                oError = "crop rectangle lies outside the image";
+                return false;
+            }
+            if (rx + rw > cw) rw = cw - rx;
+            if (ry + rh > ch) rh = ch - ry;
+
+            // and back into source coordinates
+            switch (g.turns) {
+                case 0:
+                    g.x0 += rx;
+                    g.y0 += ry;
+                    g.x1 = g.x0 + rw;
+                    g.y1 = g.y0 + rh;
+                    break;
+                case 1:
+                    g.x0 += ry;
+                    g.x1 = g.x0 + rh;
+                    g.y1 -= rx;
+                    g.y0 = g.y1 - rw;
+                    break;
+                case 2:
+                    g.x1 -= rx;
+                    g.x0 = g.x1 - rw;
+                    g.y1 -= ry;
+                    g.y0 = g.y1 - rh;
+                    break;
+                case 3:
+                    g.x1 -= ry;
+                    g.x0 = g.x1 - rh;
+                    g.y0 += rx;
+                    g.y1 = g.y0 + rw;
+                    break;
+            }
+        } else {
+            oError.append(s.t->name);
+            oError.append(" can't be performed losslessly");
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// the edge of the kept region at lo (leading) must fall on an MCU
+// boundary, widen it if allowed
+static bool
+alignLeading(unsigned int & lo, unsigned int mcu, bool snap)
+{
+    if (lo % mcu == 0) return true;
+    if (!snap) return false;
+    lo -= lo % mcu;
+    return true;
+}
+
+// the edge of the kept region at hi (trailing) must fall on an MCU
+// boundary, widen it if allowed, or trim a partial MCU at the edge of
+// the image
+static bool
+alignTrailing(unsigned int lo, unsigned int & hi, unsigned int limit,
+              unsigned int mcu, bool snap)
+{
+    if (hi % mcu == 0) return true;
+    if (!snap) return false;
+    unsigned int up = hi + (mcu - hi % mcu);
+    hi = (up <= limit) ? up : hi - hi % mcu;
+    return hi > lo;
+}
+
+// Blocks in the result which are taken from the source are those at the
+// top left of the result, so the source edges which end up there must be
+// MCU aligned.  The right and bottom edges of the result may contain
+// partial blocks.
+static bool
+alignGeometry(Geometry & g, const SourceInfo & info, bool snap)
+{
+    bool ok = true;
+    switch (g.turns) {
+        case 0:
+            ok = (alignLeading(g.x0, info.mcuWidth, snap) &&
+                  alignLeading(g.y0, info.mcuHeight, snap));
+            break;
+        case 1:
+            ok = (alignLeading(g.x0, info.mcuWidth, snap) &&
+                  alignTrailing(g.y0, g.y1, info.height, info.mcuHeight,
+                                snap));
+            break;
+        case 2:
+            ok = (alignTrailing(g.x0, g.x1, info.width, info.mcuWidth,
+                                snap) &&
+                  alignTrailing(g.y0, g.y1, info.height, info.mcuHeight,
+                                snap));
+            break;
+        case 3:
+            ok = (alignTrailing(g.x0, g.x1, info.width, info.mcuWidth,
+                                snap) &&
+                  alignLeading(g.y0, info.mcuHeight, snap));
+            break;
+    }
+    return ok;
+}
+
+// copy one block of coefficients, rotating it by turns
+static void
+rotateBlock(JCOEFPTR dst, const JCOEF * src, unsigned int turns)
+{
+    // coefficients are in natural order, row (vertical frequency) major.
+    // transposing a block transposes its coefficients, and mirroring it
+    // negates the odd frequencies in that direction.
+    int i, j;
+    switch (turns) {
+        case 0:
+            memcpy(dst, src, sizeof(JCOEF) * DCTSIZE2);
+            break;
+        case 1:
+            // transpose, then mirror horizontally
+            for (i = 0; i < DCTSIZE; i++) {
+                for (j = 0; j < DCTSIZE; j++) {
+                    JCOEF v = src[i * DCTSIZE + j];
+                    dst[j * DCTSIZE + i] = (i & 1) ? -v : v;
+                }
+            }
+            break;
+        case 2:
+            // mirror both ways
+            for (i = 0; i < DCTSIZE; i++) {
+                for (j = 0; j < DCTSIZE; j++) {
+                    JCOEF v = src[i * DCTSIZE + j];
+                    dst[i * DCTSIZE + j] = ((i + j) & 1) ? -v : v;
+                }
+            }
+            break;
+        case 3:
+            // transpose, then mirror vertically
+            for (i = 0; i < DCTSIZE; i++) {
+                for (j = 0; j < DCTSIZE; j++) {
+                    JCOEF v = src[i * DCTSIZE + j];
+                    dst[j * DCTSIZE + i] = (j & 1) ? -v : v;
+                }
+            }
+            break;
+    }
+}
+
+// the number of blocks a component of the given sampling occupies in an
+// image of pixels, padded out to whole MCUs as libjpeg allocates them
+static JDIMENSION
+componentBlocks(JDIMENSION pixels, int samp, int maxSamp)
+{
+    JDIMENSION samples = (JDIMENSION)
+        ((pixels * (long) samp + maxSamp - 1) / maxSamp);
+    JDIMENSION blocks = (samples + DCTSIZE - 1) / DCTSIZE;
+    return ((blocks + samp - 1) / samp) * samp;
+}
+
+// Rearrange the coefficients of data according to g, writing a JPEG to
+// file if it's non-NULL, otherwise appending it to buffer.  When exact
+// is true, images whose decoding would smooth blocks using their
+// neighbours (progressive images missing some scans) are refused.
+// Nothing but plain old data lives on the stack here, as libjpeg errors
+// longjmp() out.  On failure, message is populated.
+static bool
+transcode(const void * data, size_t len, const Geometry & g,
+          FILE * file, std::string * buffer, bool exact, char * message)
+{
+    struct jpeg_decompress_struct src;
+    struct jpeg_compress_struct dst;
+    ErrorManager err;
+    // zeroed, so that either may be destroyed before it's created
+    memset(&src, 0, sizeof(src));
+    memset(&dst, 0, sizeof(dst));
+    initErrorManager(err);
+    src.err = &err.pub;
+    dst.err = &err.pub;
+
+    if (setjmp(err.jump)) {
+        strcpy(message, err.message);
+        jpeg_destroy_compress(&dst);
+        jpeg_destroy_decompress(&src);
+        return false;
+    }
+
+    jpeg_create_decompress(&src);
+    jpeg_create_compress(&dst);
+    memorySource(&src, data, len);
+
+    // keep comments and application markers (EXIF, ICC profiles...)
+    jpeg_save_markers(&src, JPEG_COM, 0xFFFF);
+    for (int m = 0; m < 16; m++) {
+        jpeg_save_markers(&src, JPEG_APP0 + m, 0xFFFF);
+    }
+
+    (void) jpeg_read_header(&src, TRUE);
+
+    bool odd = (g.turns % 2) == 1;
+    JDIMENSION width = odd ? g.y1 - g.y0 : g.x1 - g.x0;
+    JDIMENSION height = odd ? g.x1 - g.x0 : g.y1 - g.y0;
+    int maxH = odd ? src.max_v_samp_factor : src.max_h_samp_factor;
+    int maxV = odd ? src.max_h_samp_factor : src.max_v_samp_factor;
+
+    // coefficient arrays for the result, which must be requested before
+    // the source's are read (and all are realized)
+    jvirt_barray_ptr dstCoefs[MAX_COMPONENTS];
+    int ci;
+    for (ci = 0; ci < src.num_components; ci++) {
+        jpeg_component_info * comp = src.comp_info + ci;
+        int h = odd ? comp->v_samp_factor : comp->h_samp_factor;
+        int v = odd ? comp->h_samp_factor : comp->v_samp_factor;
+        dstCoefs[ci] = (*src.mem->request_virt_barray)(
+            (j_common_ptr) &src, JPOOL_IMAGE, FALSE,
+            componentBlocks(width, h, maxH),
+            componentBlocks(height, v, maxV), (JDIMENSION) v);
+    }
+
+    jvirt_barray_ptr * srcCoefs = jpeg_read_coefficients(&src);
+
+    if (exact && src.progressive_mode) {
+        // libjpeg smooths blocks whose low frequency coefficients
+        // weren't all received, which would depend on blocks we drop
+        for (ci = 0; ci < src.num_components; ci++) {
+            for (int k = 0; k < 6; k++) {
+                if (src.coef_bits[ci][k] != 0) {
+                    strcpy(message, "progressive image is incomplete");
+                    jpeg_destroy_compress(&dst);
+                    jpeg_destroy_decompress(&src);
+                    return false;
+                }
+            }
+        }
+    }
+
+    jpeg_copy_critical_parameters(&src, &dst);
+    dst.image_width = width;
+    dst.image_height = height;
+    if (odd) {
+        for (ci = 0; ci < dst.num_components; ci++) {
+            jpeg_component_info * comp = dst.comp_info + ci;
+            int t = comp->h_samp_factor;
+            comp->h_samp_factor = comp->v_samp_factor;
+            comp->v_samp_factor = t;
+        }
+        for (int q = 0; q < NUM_QUANT_TBLS; q++) {
+            JQUANT_TBL * qt = dst.quant_tbl_ptrs[q];
+            if (qt == NULL) continue;
+            for (int i = 0; i < DCTSIZE; i++) {
+                for (int j = i + 1; j < DCTSIZE; j++) {
+                    UINT16 t = qt->quantval[i * DCTSIZE + j];
+                    qt->quantval[i * DCTSIZE + j] =
+                        qt->quantval[j * DCTSIZE + i];
+                    qt->quantval[j * DCTSIZE + i] = t;
+                }
+            }
+        }
+    }
+
+    if (file) jpeg_stdio_dest(&dst, file);
+    else memoryDestination(&dst, buffer);
+    jpeg_write_coefficients(&dst, dstCoefs);
+
+    // markers follow the JFIF (and Adobe) headers libjpeg writes itself
+    for (jpeg_saved_marker_ptr m = src.marker_list; m; m = m->next) {
+        if (dst.write_JFIF_header && m->marker == JPEG_APP0 &&
+            m->data_length >= 5 && !memcmp(m->data, "JFIF", 5))
+        {
+            continue;
+        }
+        if (dst.write_Adobe_marker && m->marker == JPEG_APP0 + 14 &&
+            m->data_length >= 5 && !memcmp(m->data, "Adobe", 5))
+        {
+            continue;
+        }
+        jpeg_write_marker(&dst, m->marker, m->data, m->data_length);
+    }
+
+    // now move the blocks
+    for (ci = 0; ci < src.num_components; ci++) {
+        jpeg_component_info * sc = src.comp_info + ci;
+        jpeg_component_info * dc = dst.comp_info + ci;
+
+        // the kept region's edges in source blocks of this component,
+        // only the aligned edges are used.  bw and bh are the pixels
+        // covered by a block of this component.
+        JDIMENSION bw = DCTSIZE * src.max_h_samp_factor / sc->h_samp_factor;
+        JDIMENSION bh = DCTSIZE * src.max_v_samp_factor / sc->v_samp_factor;
+        long bx0 = g.x0 / bw, bx1 = g.x1 / bw;
+        long by0 = g.y0 / bh, by1 = g.y1 / bh;
+
+        // extent of the source arrays
+        long srcCols = ((sc->width_in_blocks + sc->h_samp_factor - 1) /
+                        sc->h_samp_factor) * sc->h_samp_factor;
+        long srcRows = ((sc->height_in_blocks + sc->v_samp_factor - 1) /
+                        sc->v_samp_factor) * sc->v_samp_factor;
+
+        JDIMENSION dstCols = componentBlocks(width, dc->h_samp_factor, maxH);
+        JDIMENSION dstRows = componentBlocks(height, dc->v_samp_factor, maxV);
+
+        for (JDIMENSION dy = 0; dy < dstRows; dy += dc->v_samp_factor) {
+            JBLOCKARRAY rows = (*src.mem->access_virt_barray)(
+                (j_common_ptr) &src, dstCoefs[ci], dy,
+                (JDIMENSION) dc->v_samp_factor, TRUE);
+            for (int r = 0; r < dc->v_samp_factor; r++) {
+                for (JDIMENSION dx = 0; dx < dstCols; dx++) {
+                    long sx = 0, sy = 0;
+                    switch (g.turns) {
+                        case 0: sx = bx0 + dx; sy = by0 + dy + r; break;
+                        case 1: sx = bx0 + dy + r; sy = by1 - 1 - dx; break;
+                        case 2: sx = bx1 - 1 - dx; sy = by1 - 1 - dy - r;
+                            break;
+                        case 3: sx = bx1 - 1 - dy - r; sy = by0 + dx; break;
+                    }
+                    JCOEFPTR d = rows[r][dx];
+                    if (sx < 0 || sy < 0 || sx >= srcCols || sy >= srcRows)
+                    {
+                        // beyond the source, in the padding of the result
+                        memset(d, 0, sizeof(JBLOCK));
+                        continue;
+                    }
+                    JBLOCKARRAY s = (*src.mem->access_virt_barray)(
+                        (j_common_ptr) &src, srcCoefs[ci], (JDIMENSION) sy,
+                        1, FALSE);
+                    rotateBlock(d, s[0][sx], g.turns);
+                }
+            }
+        }
+    }
+
+    jpeg_finish_compress(&dst);
+    jpeg_destroy_compress(&dst);
+    (void) jpeg_finish_decompress(&src);
+    jpeg_destroy_decompress(&src);
+
+    return true;
+}
+
+bool
+lossless::transformJPEG(const void * data, size_t len,
+                        const trans::Plan & plan, bool snap,
+                        const std::string & outPath,
+                        unsigned int & x, unsigned int & y,
+                        unsigned int & orig_x, unsigned int & orig_y,
+                        std::string & oError)
+{
+    char message[JMSG_LENGTH_MAX];
+
+    SourceInfo info;
+    if (!readSourceInfo(data, len, info, message)) {
+        oError.append(message);
+        return false;
+    }
+
+    Geometry g;
+    if (!planGeometry(plan, info, g, oError)) return false;
+    if (!alignGeometry(g, info, snap)) {
+        oError.append("crop isn't aligned to MCU boundaries");
+        return false;
+    }
+
+    g_bpCoreFunctions->log(
+        BP_INFO, "lossless JPEG transform: keeping (%u,%u)-(%u,%u) of "
+        "%ux%u, then %u quarter turns", g.x0, g.y0, g.x1, g.y1,
+        info.width, info.height, g.turns);
+
+    FILE * f = ft::fopen_binary_write(outPath);
+    if (f == NULL) {
+        oError.append("couldn't open output file");
+        return false;
+    }
+
+    bool ok = transcode(data, len, g, f, NULL, false, message);
+    if (fclose(f) != 0) ok = false;
+    if (!ok) {
+        oError.append(message);
+        (void) ft::remove(outPath);
+        return false;
+    }
+
+    orig_x = info.width;
+    orig_y = info.height;
+    x = (g.turns % 2) ? g.y1 - g.y0 : g.x1 - g.x0;
+    y = (g.turns % 2) ? g.x1 - g.x0 : g.y1 - g.y0;
+
+    return true;
+}
+
+bool
+lossless::extractRegion(const void * data, size_t len,
+                        unsigned int x0, unsigned int y0,
+                        unsigned int x1, unsigned int y1,
+                        std::string & out,
+                        unsigned int & rx, unsigned int & ry,
+                        std::string & oError)
+{
+    char message[JMSG_LENGTH_MAX];
+
+    SourceInfo info;
+    if (!readSourceInfo(data, len, info, message)) {
+        oError.append(message);
+        return false;
+    }
+    if (x0 >= x1 || y0 >= y1 || x1 > info.width || y1 > info.height) {
+        oError.append("region lies outside the image");
+        return false;
+    }
+
+    // whole MCUs, and one more on each side where there is one
+    Geometry g;
+    g.turns = 0;
+    g.x0 = x0 - x0 % info.mcuWidth;
+    g.y0 = y0 - y0 % info.mcuHeight;
+    g.x0 = (g.x0 >= info.mcuWidth) ? g.x0 - info.mcuWidth : 0;
+    g.y0 = (g.y0 >= info.mcuHeight) ? g.y0 - info.mcuHeight : 0;
+    g.x1 = x1 + (info.mcuWidth - x1 % info.mcuWidth) % info.mcuWidth;
+    g.y1 = y1 + (info.mcuHeight - y1 % info.mcuHeight) % info.mcuHeight;
+    g.x1 = (g.x1 + info.mcuWidth < info.width) ? g.x1 + info.mcuWidth
+                                                 : info.width;
+    g.y1 = (g.y1 + info.mcuHeight < info.height) ? g.y1 + info.mcuHeight
+                                                   : info.height;
+
+    out.clear();
+    if (!transcode(data, len, g, NULL, &out, true, message)) {
+        oError.append(message);
+        out.clear();
+        return false;
+    }
+
+    rx = g.x0;
+    ry = g.y0;
+    return true;
+}
@@ -0,0 +1,93 @@
+/*
+ * Copyright 2009, Yahoo!
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ * 
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ * 
+ *  3. Neither the name of Yahoo! nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Lossless right angle rotation and cropping of JPEG images, in the
+ * manner of jpegtran.  Rather than decoding, transforming pixels and
+ * encoding again, the quantized DCT coefficients are rearranged, so the
+ * result suffers no further loss and costs little more than the I/O.
+ * The same machinery extracts regions of an image, so that only the
+ * part which is kept by a crop need be decoded.
+ */
+
+#ifndef __LOSSLESSJPEG_HH__
+#define __LOSSLESSJPEG_HH__
+
+#include "Transformations.hh"
+
+#include <string>
+
+namespace lossless {
+    /**
+     *  Perform plan upon the JPEG image in data, writing a JPEG to
+     *  outPath.  Only plans consisting entirely of right angle rotations
+     *  and crops are possible.  Coefficients can only be moved a whole
+     *  block (or MCU) at a time, so crop edges which don't fall on MCU
+     *  boundaries are widened to the enclosing boundary when snap is
+     *  true, and cause failure otherwise.  Partial MCUs on the edges of
+     *  the image which would end up at the top or left of the result are
+     *  trimmed when snap is true.
+     *
+     *  x, y - the dimensions of the resulting image
+     *  orig_x, orig_y - the dimensions of the source image
+     *  \returns false if the plan can't be performed losslessly, with
+     *            a description of why in oError.  In this case nothing
+     *            is left at outPath.
+     */
+    bool transformJPEG(const void * data, size_t len,
+                       const trans::Plan & plan, bool snap,
+                       const std::string & outPath,
+                       unsigned int & x, unsigned int & y,
+                       unsigned int & orig_x, unsigned int & orig_y,
+                       std::string & oError);
+
+    /**
+     *  Extract the part of the JPEG in data which covers the rectangle
+     *  x0,y0 - x1,y1 (exclusive) into a new JPEG in out, without
+     *  decoding.  The region is widened to MCU boundaries and then by
+     *  one more MCU on each side, as chroma upsampling looks at
+     *  neighbouring samples.  Decoding out yields exactly the pixels
+     *  within the rectangle that decoding the whole of data would.
+     *
+     *  rx, ry - the offset of the extracted region within the source
+     *  \returns false if the region can't be extracted, with a
+     *            description of why in oError
+     */
+    bool extractRegion(const void * data, size_t len,
+                       unsigned int x0, unsigned int y0,
+                       unsigned int x1, unsigned int y1,
+                       std::string & out,
+                       unsigned int & rx, unsigned int & ry,
+                       std::string & oError);
+};
+
+#endif
@@ -0,0 +1,239 @@
+/*
+ * Copyright 2009, Yahoo!
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ * 
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ * 
+ *  3. Neither the name of Yahoo! nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "PixelKernels.hh"
+
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define PK_HAVE_SSE2 1
+#include <emmintrin.h>
+#endif
+
+// AVX2 code is compiled for a target that may not support it, so it
+// requires per function target attributes and runtime detection
+#if defined(PK_HAVE_SSE2) && \
+    ((defined(__GNUC__) && \
+      (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))) || \
+     defined(__clang__) || (defined(_MSC_VER) && _MSC_VER >= 1700))
+#define PK_HAVE_AVX2 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define PK_TARGET_AVX2
+#else
+#define PK_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+// Modified version of algorithm from:
+//     http://blogs.techrepublic.com.com/howdoi/?p=120
+//
+// Changed the factors to 
+//   (1) make filter less yellow and
+//   (2) make filter less bright
+// Original factors
+//   r = (r * .393 + g *.769 + b * .189);
+//   g = (r * .349 + g *.686 + b * .168);
+//   b = (r * .272 + g *.534 + b * .131);
+//
+// The vector versions must match this exactly: products and sums are
+// computed in double precision, in this order, then rounded to float,
+// clamped, and truncated to a Quantum.
+#define SEPIA_RR 0.373
+#define SEPIA_RG 0.731
+#define SEPIA_RB 0.180
+#define SEPIA_GR 0.298
+#define SEPIA_GG 0.586
+#define SEPIA_GB 0.143
+#define SEPIA_BR 0.219
+#define SEPIA_BG 0.431
+#define SEPIA_BB 0.105
+
+static void sepiaScalar(PixelPacket * pixels, long npixels)
+{
+    for (long i = 0; i < npixels; i++) {
+        float r1 = (float)pixels[i].red;
+        float g1 = (float)pixels[i].green;
+        float b1 = (float)pixels[i].blue;
+
+        float r2 = (r1 * SEPIA_RR + g1 * SEPIA_RG + b1 * SEPIA_RB);
+        float g2 = (r1 * SEPIA_GR + g1 * SEPIA_GG + b1 * SEPIA_GB);
+        float b2 = (r1 * SEPIA_BR + g1 * SEPIA_BG + b1 * SEPIA_BB);
+
+        if (r2 > MaxRGB) r2 = MaxRGB;
+        if (g2 > MaxRGB) g2 = MaxRGB;
+        if (b2 > MaxRGB) b2 = MaxRGB;
+
+        pixels[i].red   = r2;
+        pixels[i].green = g2;
+        pixels[i].blue  = b2;
+    }
+}
+
+#ifdef PK_HAVE_SSE2
+// two pixels at a time, the width of a vector of doubles
+static void sepiaSSE2(PixelPacket * pixels, long npixels)
+{
+    const __m128 max = _mm_set1_ps((float) MaxRGB);
+    long i = 0;
+    for (; i + 2 <= npixels; i += 2) {
+        PixelPacket * p = pixels + i;
+        __m128d r = _mm_set_pd(p[1].red, p[0].red);
+        __m128d g = _mm_set_pd(p[1].green, p[0].green);
+        __m128d b = _mm_set_pd(p[1].blue, p[0].blue);
+
+#define SEPIA_SSE2_CHANNEL(kr, kg, kb)                                  \
+        _mm_cvttps_epi32(_mm_min_ps(_mm_cvtpd_ps(                       \
+            _mm_add_pd(_mm_add_pd(_mm_mul_pd(r, _mm_set1_pd(kr)),       \
+                                  _mm_mul_pd(g, _mm_set1_pd(kg))),      \
+                       _mm_mul_pd(b, _mm_set1_pd(kb)))), max))
+
+        int r2[4], g2[4], b2[4];
+        _mm_storeu_si128((__m128i *) r2,
+                         SEPIA_SSE2_CHANNEL(SEPIA_RR, SEPIA_RG, SEPIA_RB));
+        _mm_storeu_si128((__m128i *) g2,
+                         SEPIA_SSE2_CHANNEL(SEPIA_GR, SEPIA_GG, SEPIA_GB));
+        _mm_storeu_si128((__m128i *) b2,
+                         SEPIA_SSE2_CHANNEL(SEPIA_BR, SEPIA_BG, SEPIA_BB));
+#undef SEPIA_SSE2_CHANNEL
+
+        for (int j = 0; j < 2; j++) {
+            p[j].red   = (Quantum) r2[j];
+            p[j].green = (Quantum) g2[j];
+            p[j].blue  = (Quantum) b2[j];
+        }
+    }
+    sepiaScalar(pixels + i, npixels - i);
+}
+#endif
+
+#ifdef PK_HAVE_AVX2
+// four pixels at a time
+PK_TARGET_AVX2
+static void sepiaAVX2(PixelPacket * pixels, long npixels)
+{
+    const __m128 max = _mm_set1_ps((float) MaxRGB);
+    long i = 0;
+    for (; i + 4 <= npixels; i += 4) {
+        PixelPacket * p = pixels + i;
+        __m256d r = _mm256_set_pd(p[3].red, p[2].red, p[1].red, p[0].red);
+        __m256d g = _mm256_set_pd(p[3].green, p[2].green,
+                                  p[1].green, p[0].green);
+        __m256d b = _mm256_set_pd(p[3].blue, p[2].blue,
+                                  p[1].blue, p[0].blue);
+
+#define SEPIA_AVX2_CHANNEL(kr, kg, kb)                                  \
+        _mm_cvttps_epi32(_mm_min_ps(_mm256_cvtpd_ps(                    \
+            _mm256_add_pd(                                              \
+                _mm256_add_pd(_mm256_mul_pd(r, _mm256_set1_pd(kr)),     \
+                              _mm256_mul_pd(g, _mm256_set1_pd(kg))),    \
+                _mm256_mul_pd(b, _mm256_set1_pd(kb)))), max))
+
+        int r2[4], g2[4], b2[4];
+        _mm_storeu_si128((__m128i *) r2,
+                         SEPIA_AVX2_CHANNEL(SEPIA_RR, SEPIA_RG, SEPIA_RB));
+        _mm_storeu_si128((__m128i *) g2,
+                         SEPIA_AVX2_CHANNEL(SEPIA_GR, SEPIA_GG, SEPIA_GB));
+        _mm_storeu_si128((__m128i *) b2,
+                         SEPIA_AVX2_CHANNEL(SEPIA_BR, SEPIA_BG, SEPIA_BB));
+#undef SEPIA_AVX2_CHANNEL
+
+        for (int j = 0; j < 4; j++) {
+            p[j].red   = (Quantum) r2[j];
+            p[j].green = (Quantum) g2[j];
+            p[j].blue  = (Quantum) b2[j];
+        }
+    }
+    sepiaScalar(pixels + i, npixels - i);
+}
+
+// does both the processor and the OS (which must save ymm registers)
+// support AVX2?
+static bool haveAVX2()
+{
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) return false;
+    __cpuid(info, 1);
+    // OSXSAVE and AVX
+    if ((info[2] & (1 << 27)) == 0 || (info[2] & (1 << 28)) == 0) {
+        return false;
+    }
+    if ((_xgetbv(0) & 0x6) != 0x6) return false;
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") != 0;
+#endif
+}
+#endif
+
+typedef void (*SepiaFunc)(PixelPacket * pixels, long npixels);
+
+// chosen on first use.  racing threads will all pick the same
+// implementation, so this needs no lock.
+static SepiaFunc s_sepia = NULL;
+static const char * s_implementation = NULL;
+
+static void selectImplementation()
+{
+    SepiaFunc f = sepiaScalar;
+    const char * name = "scalar";
+#ifdef PK_HAVE_SSE2
+    f = sepiaSSE2;
+    name = "sse2";
+#endif
+#ifdef PK_HAVE_AVX2
+    if (haveAVX2()) {
+        f = sepiaAVX2;
+        name = "avx2";
+    }
+#endif
+    s_implementation = name;
+    s_sepia = f;
+}
+
+void
+kernels::sepia(PixelPacket * pixels, long npixels)
+{
+    if (!s_sepia) selectImplementation();
+    s_sepia(pixels, npixels);
+}
+
+const char *
+kernels::implementation()
+{
+    if (!s_implementation) selectImplementation();
+    return s_implementation;
+}
@@ -0,0 +1,109 @@
+/*
+ * Copyright 2009, Yahoo!
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ * 
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ * 
+ *  3. Neither the name of Yahoo! nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "PlanCache.hh"
+
+imageproc::PlanCache::PlanCache(unsigned int capacity)
+    : m_capacity(capacity), m_hits(0), m_misses(0)
+{
+}
+
+void
+imageproc::PlanCache::setCapacity(unsigned int capacity)
+{
+    bp::sync::Lock l(m_lock);
+    m_capacity = capacity;
+    evict();
+}
+
+bool
+imageproc::PlanCache::lookup(const std::string & key, trans::Plan & plan)
+{
+    bp::sync::Lock l(m_lock);
+
+    EntryMap::iterator it = m_entries.find(key);
+    if (it == m_entries.end()) {
+        m_misses++;
+        return false;
+    }
+
+    // move to the front of the line
+    m_lru.splice(m_lru.begin(), m_lru, it->second.lru);
+    plan = it->second.plan;
+    m_hits++;
+
+    return true;
+}
+
+void
+imageproc::PlanCache::insert(const std::string & key,
+                             const trans::Plan & plan)
+{
+    bp::sync::Lock l(m_lock);
+
+    if (m_capacity == 0) return;
+
+    // two identical requests may race to insert, the later one wins
+    EntryMap::iterator it = m_entries.find(key);
+    if (it != m_entries.end()) {
+        m_lru.erase(it->second.lru);
+        m_entries.erase(it);
+    }
+
+    m_lru.push_front(key);
+    Entry & e = m_entries[key];
+    e.plan = plan;
+    e.lru = m_lru.begin();
+
+    evict();
+}
+
+imageproc::PlanCache::Stats
+imageproc::PlanCache::stats()
+{
+    bp::sync::Lock l(m_lock);
+    Stats s;
+    s.hits = m_hits;
+    s.misses = m_misses;
+    s.entries = m_entries.size();
+    s.capacity = m_capacity;
+    return s;
+}
+
+void
+imageproc::PlanCache::evict()
+{
+    while (m_entries.size() > m_capacity && !m_lru.empty()) {
+        m_entries.erase(m_lru.back());
+        m_lru.pop_back();
+    }
+}
@@ -0,0 +1,99 @@
+/*
+ * Copyright 2009, Yahoo!
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ * 
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ * 
+ *  3. Neither the name of Yahoo! nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * A bounded, least recently used cache of compiled action plans, keyed
+ * by the canonical form of the actions they were compiled from.  Clients
+ * tend to send the same few pipelines over and over, and a hit skips
+ * parsing and validating the actions entirely.
+ */
+
+#ifndef __PLANCACHE_HH__
+#define __PLANCACHE_HH__
+
+#include "Transformations.hh"
+#include "util/bpsync.hh"
+
+#include <list>
+#include <map>
+#include <string>
+
+namespace imageproc {
+
+    class PlanCache {
+      public:
+        struct Stats {
+            Stats() : hits(0), misses(0), entries(0), capacity(0) { }
+            unsigned long long hits;
+            unsigned long long misses;
+            unsigned int entries;
+            unsigned int capacity;
+        };
+
+        /** a cache which will hold up to capacity plans, zero disables
+         *  caching */
+        PlanCache(unsigned int capacity);
+
+        /** change capacity, evicting as required */
+        void setCapacity(unsigned int capacity);
+
+        /** look up key, populating plan and counting a hit or miss.
+         *  \returns true on a hit */
+        bool lookup(const std::string & key, trans::Plan & plan);
+
+        /** add a successfully compiled plan */
+        void insert(const std::string & key, const trans::Plan & plan);
+
+        Stats stats();
+
+      private:
+        typedef std::list<std::string> LRUList;
+        struct Entry {
+            trans::Plan plan;
+            LRUList::iterator lru;
+        };
+        typedef std::map<std::string, Entry> EntryMap;
+
+        // drop least recently used entries until we're within capacity
+        void evict();
+
+        bp::sync::Mutex m_lock;
+        EntryMap m_entries;
+        // most recently used at the front
+        LRUList m_lru;
+        unsigned int m_capacity;
+        unsigned long long m_hits;
+        unsigned long long m_misses;
+    };
+};
+
+#endif
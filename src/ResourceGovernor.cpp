@@ -0,0 +1,214 @@
+/*
+ * Copyright 2009, Yahoo!
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ * 
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ * 
+ *  3. Neither the name of Yahoo! nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "ResourceGovernor.hh"
+#include "service.hh"
+
+#include <magick/api.h>
+
+#include <sstream>
+
+// the resources whose limits we manage, and their slots in m_defaults
+static const ResourceType s_types[] = {
+    MemoryResource, MapResource, DiskResource, PixelsResource
+};
+
+static unsigned int
+slot(int type)
+{
+    for (unsigned int i = 0; i < sizeof(s_types) / sizeof(s_types[0]); i++) {
+        if (s_types[i] == type) return i;
+    }
+    return 0;
+}
+
+void
+imageproc::ResourceGovernor::Ticket::release()
+{
+    if (m_governor) m_governor->release(*this);
+}
+
+imageproc::ResourceGovernor::ResourceGovernor()
+    : m_haveDefaults(false), m_reserved(0), m_spilling(false),
+      m_admitted(0), m_spilled(0), m_rejected(0), m_peak(0)
+{
+    for (unsigned int i = 0; i < 4; i++) m_defaults[i] = 0;
+}
+
+void
+imageproc::ResourceGovernor::applyLimit(int type, unsigned long long limit)
+{
+    if (limit == 0) limit = m_defaults[slot(type)];
+    (void) SetMagickResourceLimit((ResourceType) type, limit);
+}
+
+void
+imageproc::ResourceGovernor::applyMemoryLimit()
+{
+    if (!m_spilling) {
+        applyLimit(MemoryResource, m_limits.memory);
+        return;
+    }
+
+    // GraphicsMagick can't be told where one image's pixel cache goes,
+    // only how much heap all of them may use.  So while a request is
+    // spilling, the heap is limited to what admitted requests reserved.
+    // Their caches still fit, and the spilling request's, which reserved
+    // nothing, go to files
+    unsigned long long limit = m_reserved;
+    if (m_limits.memory > 0 && limit > m_limits.memory) {
+        limit = m_limits.memory;
+    }
+    (void) SetMagickResourceLimit(MemoryResource, limit > 0 ? limit : 1);
+}
+
+void
+imageproc::ResourceGovernor::setLimits(const ResourceLimits & limits)
+{
+    bp::sync::Lock l(m_lock);
+
+    if (!m_haveDefaults) {
+        for (unsigned int i = 0; i < 4; i++) {
+            m_defaults[i] = GetMagickResourceLimit(s_types[i]);
+        }
+        m_haveDefaults = true;
+    }
+
+    m_limits = limits;
+    applyLimit(MapResource, m_limits.map);
+    applyLimit(DiskResource, m_limits.disk);
+    applyLimit(PixelsResource, m_limits.pixels);
+    applyMemoryLimit();
+
+    g_bpCoreFunctions->log(
+        BP_INFO, "resource limits (bytes, zero unlimited): memory %llu, "
+        "map %llu, disk %llu, per request memory %llu; pixels %llu, per "
+        "request pixels %llu", m_limits.memory, m_limits.map,
+        m_limits.disk, m_limits.requestMemory, m_limits.pixels,
+        m_limits.requestPixels);
+}
+
+imageproc::ResourceLimits
+imageproc::ResourceGovernor::limits()
+{
+    bp::sync::Lock l(m_lock);
+    return m_limits;
+}
+
+bool
+imageproc::ResourceGovernor::admit(unsigned long long pixels,
+                                   Ticket & ticket, std::string & oError)
+{
+    ticket.release();
+
+    bp::sync::Lock l(m_lock);
+
+    if (m_limits.requestPixels > 0 && pixels > m_limits.requestPixels) {
+        m_rejected++;
+        std::stringstream ss;
+        ss << "image too large (" << pixels << " pixels, the limit is "
+           << m_limits.requestPixels << ")";
+        oError.append(ss.str());
+        return false;
+    }
+
+    // a stage holds both its input and its output
+    unsigned long long need = pixels * sizeof(PixelPacket) * 2;
+
+    ticket.m_governor = this;
+    ticket.m_peak = 0;
+    m_admitted++;
+
+    if (m_limits.requestMemory == 0 || need <= m_limits.requestMemory) {
+        // a request within its own limit waits for room on the heap
+        // rather than spilling.  One alone is always admitted
+        while (m_limits.memory > 0 && m_reserved > 0 &&
+               m_reserved + need > m_limits.memory)
+        {
+            m_changed.wait(&m_lock);
+        }
+        ticket.m_reserved = need;
+        ticket.m_spilled = false;
+        m_reserved += need;
+        applyMemoryLimit();
+        return true;
+    }
+
+    // one spilled request at a time.  This bounds the disk and page
+    // cache used
+    while (m_spilling) m_changed.wait(&m_lock);
+    m_spilling = true;
+    m_spilled++;
+    ticket.m_reserved = 0;
+    ticket.m_spilled = true;
+    applyMemoryLimit();
+
+    g_bpCoreFunctions->log(
+        BP_INFO, "request needs ~%llu bytes of pixel cache, spilling to "
+        "disk", need);
+
+    return true;
+}
+
+void
+imageproc::ResourceGovernor::release(Ticket & ticket)
+{
+    bp::sync::Lock l(m_lock);
+
+    if (ticket.m_spilled) m_spilling = false;
+    else m_reserved -= ticket.m_reserved;
+    applyMemoryLimit();
+    m_changed.broadcast();
+
+    if (ticket.m_peak > m_peak) m_peak = ticket.m_peak;
+
+    ticket.m_governor = NULL;
+    ticket.m_reserved = 0;
+}
+
+imageproc::ResourceGovernor::Stats
+imageproc::ResourceGovernor::stats()
+{
+    bp::sync::Lock l(m_lock);
+    Stats s;
+    s.admitted = m_admitted;
+    s.spilled = m_spilled;
+    s.rejected = m_rejected;
+    s.reserved = m_reserved;
+    s.peak = m_peak;
+    s.memory = GetMagickResource(MemoryResource);
+    s.map = GetMagickResource(MapResource);
+    s.disk = GetMagickResource(DiskResource);
+    s.limits = m_limits;
+    return s;
+}
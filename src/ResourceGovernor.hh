@@ -0,0 +1,171 @@
+/*
+ * Copyright 2009, Yahoo!
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ * 
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ * 
+ *  3. Neither the name of Yahoo! nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * Ceilings upon the memory, memory mapped files and disk used to hold
+ * decoded pixels, both process wide and per request.  Process wide
+ * limits are handed to GraphicsMagick, which moves pixel caches from
+ * the heap to memory mapped files and then plain files as each budget is
+ * exhausted.  Requests are admitted against the in RAM budget before
+ * their input is decoded, and wait until they fit.  Those too large for
+ * the per request limit spill instead: they run one at a time, with
+ * their pixel caches on disk in GraphicsMagick's temp dir, which
+ * imageproc::init() points at a directory of the service's own.
+ */
+
+#ifndef __RESOURCEGOVERNOR_HH__
+#define __RESOURCEGOVERNOR_HH__
+
+#include "util/bpsync.hh"
+
+#include <string>
+
+namespace imageproc {
+
+    /** resource ceilings, zero is unlimited */
+    struct ResourceLimits {
+        ResourceLimits() : memory(0), map(0), disk(0), pixels(0),
+                           requestMemory(0), requestPixels(0) { }
+        // process wide bytes of pixel cache on the heap, in memory
+        // mapped files, and in files
+        unsigned long long memory;
+        unsigned long long map;
+        unsigned long long disk;
+        // pixels in any one image
+        unsigned long long pixels;
+        // bytes of pixel cache a single request may hold on the heap
+        // before it spills
+        unsigned long long requestMemory;
+        // pixels a single request may decode, summed over frames
+        unsigned long long requestPixels;
+    };
+
+    class ResourceGovernor {
+      public:
+        struct Stats {
+            Stats() : admitted(0), spilled(0), rejected(0), reserved(0),
+                      peak(0), memory(0), map(0), disk(0) { }
+            unsigned long long admitted;
+            unsigned long long spilled;
+            unsigned long long rejected;
+            // estimated bytes of pixel cache held by admitted requests
+            unsigned long long reserved;
+            // the largest peak of any request
+            unsigned long long peak;
+            // bytes of pixel cache GraphicsMagick currently holds
+            unsigned long long memory;
+            unsigned long long map;
+            unsigned long long disk;
+            ResourceLimits limits;
+        };
+
+        /** a request's claim upon the budget, held from admission until
+         *  it completes.  Released on destruction. */
+        class Ticket {
+          public:
+            Ticket() : m_governor(NULL), m_reserved(0), m_peak(0),
+                       m_spilled(false) { }
+            ~Ticket() { release(); }
+
+            /** note that bytes of pixel cache are in use at once */
+            void observe(unsigned long long bytes) {
+                if (bytes > m_peak) m_peak = bytes;
+            }
+
+            /** the most pixel cache observed in use at once */
+            unsigned long long peak() const { return m_peak; }
+
+            /** is the request's pixel cache on disk? */
+            bool spilled() const { return m_spilled; }
+
+            void release();
+
+          private:
+            friend class ResourceGovernor;
+            ResourceGovernor * m_governor;
+            unsigned long long m_reserved;
+            unsigned long long m_peak;
+            bool m_spilled;
+
+            Ticket(const Ticket &);
+            Ticket & operator=(const Ticket &);
+        };
+
+        /** a governor which imposes no limits */
+        ResourceGovernor();
+
+        /** change limits.  Process wide limits are passed on to
+         *  GraphicsMagick, which must have been initialized */
+        void setLimits(const ResourceLimits & limits);
+
+        ResourceLimits limits();
+
+        /** admit a request which will decode pixels (summed over
+         *  frames).  If it mustn't run, populates oError and returns
+         *  false.  A request within the per request memory limit waits
+         *  until it fits in the in RAM budget.  One beyond it spills: it
+         *  waits for any other spilled request to finish, and then its
+         *  new pixel caches go to files until ticket is released. */
+        bool admit(unsigned long long pixels, Ticket & ticket,
+                   std::string & oError);
+
+        Stats stats();
+
+      private:
+        void release(Ticket & ticket);
+
+        // pass a limit to GraphicsMagick, zero restores its default
+        void applyLimit(int type, unsigned long long limit);
+
+        // pass the heap limit to GraphicsMagick, which is narrowed while
+        // a request spills.  m_lock must be held
+        void applyMemoryLimit();
+
+        bp::sync::Mutex m_lock;
+        // signalled when a request is released
+        bp::sync::Condition m_changed;
+        ResourceLimits m_limits;
+        // GraphicsMagick's own limits, captured when first changed
+        bool m_haveDefaults;
+        unsigned long long m_defaults[4];
+        unsigned long long m_reserved;
+        // is a request spilling?
+        bool m_spilling;
+        unsigned long long m_admitted;
+        unsigned long long m_spilled;
+        unsigned long long m_rejected;
+        unsigned long long m_peak;
+    };
+};
+
+#endif
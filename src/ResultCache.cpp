@@ -0,0 +1,169 @@
+/*
+ * Copyright 2009, Yahoo!
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ * 
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ * 
+ *  3. Neither the name of Yahoo! nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "ResultCache.hh"
+
+#include <sstream>
+#include <time.h>
+
+// how many input hashes we remember before starting over
+#define MAX_REMEMBERED_HASHES 4096
+
+imageproc::ResultCache::ResultCache(size_t capacity)
+    : m_bytes(0), m_capacity(capacity), m_hits(0), m_misses(0)
+{
+}
+
+void
+imageproc::ResultCache::setCapacity(size_t capacity)
+{
+    bp::sync::Lock l(m_lock);
+    m_capacity = capacity;
+    evict();
+}
+
+bool
+imageproc::ResultCache::lookup(const std::string & key, Result & result)
+{
+    bp::sync::Lock l(m_lock);
+
+    EntryMap::iterator it = m_entries.find(key);
+    if (it == m_entries.end()) {
+        m_misses++;
+        return false;
+    }
+
+    // move to the front of the line
+    m_lru.splice(m_lru.begin(), m_lru, it->second.lru);
+    result = it->second.result;
+    m_hits++;
+
+    return true;
+}
+
+void
+imageproc::ResultCache::insert(const std::string & key,
+                               const Result & result)
+{
+    bp::sync::Lock l(m_lock);
+
+    size_t sz = key.size() + result.data.size();
+    if (sz > m_capacity) return;
+
+    // two identical requests may race to insert, the later one wins
+    EntryMap::iterator it = m_entries.find(key);
+    if (it != m_entries.end()) {
+        m_bytes -= (it->first.size() + it->second.result.data.size());
+        m_lru.erase(it->second.lru);
+        m_entries.erase(it);
+    }
+
+    m_lru.push_front(key);
+    Entry & e = m_entries[key];
+    e.result = result;
+    e.lru = m_lru.begin();
+    m_bytes += sz;
+
+    evict();
+}
+
+imageproc::ResultCache::Stats
+imageproc::ResultCache::stats()
+{
+    bp::sync::Lock l(m_lock);
+    Stats s;
+    s.hits = m_hits;
+    s.misses = m_misses;
+    s.entries = m_entries.size();
+    s.bytes = m_bytes;
+    s.capacity = m_capacity;
+    return s;
+}
+
+void
+imageproc::ResultCache::evict()
+{
+    while (m_bytes > m_capacity && !m_lru.empty()) {
+        EntryMap::iterator it = m_entries.find(m_lru.back());
+        m_bytes -= (it->first.size() + it->second.result.data.size());
+        m_entries.erase(it);
+        m_lru.pop_back();
+    }
+}
+
+std::string
+imageproc::ResultCache::fingerprint(const std::string & path,
+                                    const void * data, size_t len,
+                                    long long mtime)
+{
+    bool known = false;
+    unsigned long long h = 0;
+
+    // mtime has a resolution of a second, so a file hashed in the same
+    // second it was written may yet change without mtime moving
+    if (mtime >= 0) {
+        bp::sync::Lock l(m_lock);
+        HashMap::const_iterator it = m_hashes.find(path);
+        if (it != m_hashes.end() && it->second.len == len &&
+            it->second.mtime == mtime && mtime < it->second.hashedAt)
+        {
+            known = true;
+            h = it->second.hash;
+        }
+    }
+
+    if (!known) {
+        long long hashedAt = (long long) time(NULL);
+
+        // 64 bit FNV-1a
+        h = 14695981039346656037ULL;
+        const unsigned char * p = (const unsigned char *) data;
+        for (size_t i = 0; i < len; i++) {
+            h ^= p[i];
+            h *= 1099511628211ULL;
+        }
+
+        if (mtime >= 0) {
+            bp::sync::Lock l(m_lock);
+            if (m_hashes.size() >= MAX_REMEMBERED_HASHES) m_hashes.clear();
+            Hashed & e = m_hashes[path];
+            e.len = len;
+            e.mtime = mtime;
+            e.hashedAt = hashedAt;
+            e.hash = h;
+        }
+    }
+
+    std::stringstream ss;
+    ss << len << ":" << mtime << ":" << std::hex << h;
+    return ss.str();
+}
@@ -0,0 +1,128 @@
+/*
+ * Copyright 2009, Yahoo!
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ * 
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ * 
+ *  3. Neither the name of Yahoo! nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * A bounded, least recently used cache of transformation results, keyed
+ * by a fingerprint of the input image and a canonical form of the
+ * requested output.  Capacity is expressed in bytes of encoded output.
+ */
+
+#ifndef __RESULTCACHE_HH__
+#define __RESULTCACHE_HH__
+
+#include "util/bpsync.hh"
+
+#include <list>
+#include <map>
+#include <string>
+
+namespace imageproc {
+
+    class ResultCache {
+      public:
+        /** a previously produced output image */
+        struct Result {
+            Result() : x(0), y(0), orig_x(0), orig_y(0) { }
+            // the encoded output image
+            std::string data;
+            unsigned int x, y;
+            unsigned int orig_x, orig_y;
+        };
+
+        struct Stats {
+            Stats() : hits(0), misses(0), entries(0), bytes(0),
+                      capacity(0) { }
+            unsigned long long hits;
+            unsigned long long misses;
+            unsigned int entries;
+            size_t bytes;
+            size_t capacity;
+        };
+
+        /** a cache which will hold up to capacity bytes of results,
+         *  zero disables caching */
+        ResultCache(size_t capacity);
+
+        /** change capacity, evicting as required */
+        void setCapacity(size_t capacity);
+
+        /** look up key, populating result and counting a hit or miss.
+         *  \returns true on a hit */
+        bool lookup(const std::string & key, Result & result);
+
+        /** add a result.  results larger than capacity are ignored */
+        void insert(const std::string & key, const Result & result);
+
+        Stats stats();
+
+        /** fingerprint the contents (data, len) of the input file at
+         *  path.  size and mtime are cheap checks, a hash of the contents
+         *  catches the rest.  The hash is remembered per path and reused
+         *  while the size and mtime are unchanged, unless the file was
+         *  modified within the second it was last hashed. */
+        std::string fingerprint(const std::string & path,
+                                const void * data, size_t len,
+                                long long mtime);
+
+      private:
+        typedef std::list<std::string> LRUList;
+        struct Entry {
+            Result result;
+            LRUList::iterator lru;
+        };
+        typedef std::map<std::string, Entry> EntryMap;
+
+        // drop least recently used entries until we're within capacity
+        void evict();
+
+        // hashes of recently seen inputs, by path
+        struct Hashed {
+            size_t len;
+            long long mtime;
+            long long hashedAt;
+            unsigned long long hash;
+        };
+        typedef std::map<std::string, Hashed> HashMap;
+        HashMap m_hashes;
+
+        bp::sync::Mutex m_lock;
+        EntryMap m_entries;
+        // most recently used at the front
+        LRUList m_lru;
+        size_t m_bytes;
+        size_t m_capacity;
+        unsigned long long m_hits;
+        unsigned long long m_misses;
+    };
+};
+
+#endif
@@ -0,0 +1,198 @@
+/*
+ * Copyright 2009, Yahoo!
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ * 
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ * 
+ *  3. Neither the name of Yahoo! nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "TileExecutor.hh"
+#include "util/bpstealpool.hh"
+
+#include <assert.h>
+#include <string.h>
+
+// bands are no shorter than this, or halo overhead dominates
+#define MIN_BAND_ROWS 64
+
+// how many bands each thread should have, so that uneven bands balance
+#define BANDS_PER_THREAD 4
+
+// shared by all requests, so that concurrent requests don't run more
+// filters than there are processors
+static bp::thread::StealingPool s_pool;
+
+void
+tiles::init()
+{
+    unsigned int n = bp::thread::Thread::numProcessors();
+    if (n > 1) (void) s_pool.start(n);
+}
+
+void
+tiles::shutdown()
+{
+    s_pool.stop();
+}
+
+void
+tiles::each(void (*func)(void *), void ** cookies, unsigned int n)
+{
+    s_pool.run(func, cookies, n);
+}
+
+// a band of the image, filtered on a pool thread
+struct Band {
+    const trans::Transformation * t;
+    const trans::Args * args;
+    int quality;
+    // the band and its halo, and its first row within the image
+    Image * in;
+    unsigned long top;
+    // the rows of the result this band provides
+    unsigned long y0, y1;
+    // the filtered band, NULL on error
+    Image * out;
+    std::string error;
+};
+
+static void
+filterBand(void * cookie)
+{
+    Band * b = (Band *) cookie;
+    b->out = b->t->transform(b->in, *b->args, b->quality, b->error);
+}
+
+// copy rows y0 to y1 of the result from the band that computed them
+static bool
+stitchBand(Image * result, const Band & b, ExceptionInfo * exception)
+{
+    unsigned long columns = result->columns;
+    for (unsigned long y = b.y0; y < b.y1; y++) {
+        const PixelPacket * src =
+            AcquireImagePixels(b.out, 0, (long) (y - b.top), columns, 1,
+                               exception);
+        if (!src) return false;
+        const IndexPacket * srcIndexes = GetIndexes(b.out);
+
+        PixelPacket * dst = SetImagePixels(result, 0, (long) y, columns, 1);
+        if (!dst) return false;
+        IndexPacket * dstIndexes = GetIndexes(result);
+
+        memcpy(dst, src, columns * sizeof(PixelPacket));
+        if (srcIndexes && dstIndexes) {
+            memcpy(dstIndexes, srcIndexes, columns * sizeof(IndexPacket));
+        }
+        if (!SyncImagePixels(result)) return false;
+    }
+    return true;
+}
+
+Image *
+tiles::apply(const trans::Transformation * t, const Image * inImage,
+             const trans::Args & args, int quality, std::string & oError)
+{
+    assert(t->halo > 0);
+
+    unsigned long columns = inImage->columns, rows = inImage->rows;
+    unsigned int threads = s_pool.size();
+    unsigned long bandRows = rows / (threads * BANDS_PER_THREAD + 1) + 1;
+    if (bandRows < MIN_BAND_ROWS) bandRows = MIN_BAND_ROWS;
+    if (bandRows < 4 * t->halo) bandRows = 4 * t->halo;
+
+    if (threads < 2 || rows < 2 * bandRows || s_pool.onWorker()) {
+        return t->transform(inImage, args, quality, oError);
+    }
+
+    ExceptionInfo exception;
+    GetExceptionInfo(&exception);
+
+    // cut the bands here, as reading pixels of the same image from
+    // several threads at once isn't safe
+    std::vector<Band> bands;
+    bool ok = true;
+    for (unsigned long y0 = 0; ok && y0 < rows; y0 += bandRows) {
+        Band b;
+        b.t = t;
+        b.args = &args;
+        b.quality = quality;
+        b.y0 = y0;
+        b.y1 = (y0 + bandRows < rows) ? y0 + bandRows : rows;
+        b.top = (y0 > t->halo) ? y0 - t->halo : 0;
+        unsigned long bottom =
+            (b.y1 + t->halo < rows) ? b.y1 + t->halo : rows;
+
+        RectangleInfo ri;
+        ri.x = 0;
+        ri.y = (long) b.top;
+        ri.width = columns;
+        ri.height = bottom - b.top;
+        b.in = CropImage(inImage, &ri, &exception);
+        b.out = NULL;
+        if (!b.in) ok = false;
+        else bands.push_back(b);
+    }
+
+    if (ok) {
+        std::vector<void *> cookies;
+        for (unsigned int i = 0; i < bands.size(); i++) {
+            cookies.push_back(&bands[i]);
+        }
+        s_pool.run(filterBand, &cookies[0], cookies.size());
+    }
+
+    for (unsigned int i = 0; ok && i < bands.size(); i++) {
+        if (!bands[i].out) {
+            oError.append(bands[i].error);
+            ok = false;
+        }
+    }
+
+    // the result has whatever attributes the filter gives its output
+    Image * result = NULL;
+    if (ok) {
+        result = CloneImage(bands[0].out, columns, rows, 1, &exception);
+        if (result) result->page = inImage->page;
+    }
+    for (unsigned int i = 0; result && i < bands.size(); i++) {
+        if (!stitchBand(result, bands[i], &exception)) {
+            DestroyImage(result);
+            result = NULL;
+        }
+    }
+    if (!result && oError.empty()) {
+        oError.append("couldn't ").append(t->name).append(" image");
+    }
+
+    for (unsigned int i = 0; i < bands.size(); i++) {
+        DestroyImage(bands[i].in);
+        if (bands[i].out) DestroyImage(bands[i].out);
+    }
+    DestroyExceptionInfo(&exception);
+
+    return result;
+}
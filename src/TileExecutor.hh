@@ -0,0 +1,75 @@
+/*
+ * Copyright 2009, Yahoo!
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ * 
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ * 
+ *  3. Neither the name of Yahoo! nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Parallel execution of neighbourhood filters.  The image is split into
+ * horizontal bands, each extended by a halo of the rows around it which
+ * the filter reads, and the bands are filtered independently on a pool
+ * of threads shared by every request.  The interior of each filtered
+ * band is then stitched into the result.
+ */
+
+#ifndef __TILEEXECUTOR_HH__
+#define __TILEEXECUTOR_HH__
+
+#include "Transformations.hh"
+
+#include <string>
+
+namespace tiles {
+    /** start the pool of threads, one per processor */
+    void init();
+
+    /** stop the pool of threads */
+    void shutdown();
+
+    /** invoke func once for each of n cookies on the shared pool of
+     *  threads, and block until all have returned.  Called from one of
+     *  the pool's threads, the work is performed on that thread. */
+    void each(void (*func)(void *), void ** cookies, unsigned int n);
+
+    /**
+     *  Perform t upon inImage a band at a time, in parallel.  t must
+     *  compute each output pixel from input pixels no more than t->halo
+     *  rows away, and treat the edges of its input as the edges of the
+     *  image, so that the result is identical to t->transform(inImage).
+     *  Small images, all images when there's a single processor, and
+     *  images transformed on one of the pool's threads (the frames of
+     *  an animation) are passed to t->transform() whole.
+     *  Returns NULL on error, with oError populated.
+     */
+    Image * apply(const trans::Transformation * t, const Image * inImage,
+                  const trans::Args & args, int quality,
+                  std::string & oError);
+};
+
+#endif
@@ -1,28 +1,86 @@
 #include "Transformations.hh"
 #include "service.hh"
+#include "PixelKernels.hh"
+#include "util/bpsync.hh"
+#include "util/bpthread.hh"
 
+#include <algorithm>
+#include <map>
 #include <sstream>
 
 #include <assert.h>
+#include <math.h>
 
 #ifdef WIN32
 #define strcasecmp _stricmp
 #endif
 
-static Image * noopTransform(const Image * inImage,
-                             const bp::Object * args,
-                             int quality, std::string &oError)
+// allow GraphicsMagick to spread a pixel iteration across rows, for
+// workers which are safe to run concurrently on distinct rows.  GM does
+// this with OpenMP, and only when it's built with OpenMP; otherwise
+// max_threads is ignored and rows are iterated on the calling thread.
+// Each iteration in progress (across all requests) gets an equal share
+// of the processors, so that concurrent requests don't oversubscribe.
+// Held for the duration of the iteration.
+class RowThreads {
+  public:
+    RowThreads() {
+        bp::sync::Lock l(s_lock);
+        s_active++;
+        m_threads = bp::thread::Thread::numProcessors() / s_active;
+        if (m_threads < 1) m_threads = 1;
+    }
+    ~RowThreads() {
+        bp::sync::Lock l(s_lock);
+        s_active--;
+    }
+
+    const PixelIteratorOptions * options(PixelIteratorOptions & options,
+                                         ExceptionInfo * exception) const {
+        InitializePixelIteratorOptions(&options, exception);
+        options.max_threads = (int) m_threads;
+        return &options;
+    }
+
+  private:
+    unsigned int m_threads;
+    static bp::sync::Mutex s_lock;
+    static unsigned int s_active;
+};
+
+bp::sync::Mutex RowThreads::s_lock;
+unsigned int RowThreads::s_active = 0;
+
+// parse a single optional numeric argument, which defaults to dflt
+static bool parseOptionalNumber(const char * funcName,
+                                const bp::Object * args, double dflt,
+                                trans::Args & parsed, std::string & oError)
 {
-    ExceptionInfo exception;
-    GetExceptionInfo(&exception);
-    Image * i = CloneImage(inImage, 0, 0, 1, &exception);
-    DestroyExceptionInfo(&exception);
-    return i;
+    parsed.number = dflt;
+    if (args != NULL) {
+        if (args->type() == BPTDouble) {
+            parsed.number = (double) *args;
+        } else if (args->type() == BPTInteger) {
+            parsed.number = (double)((long long)(*args));
+        } else {
+            oError.append(funcName);
+            oError.append(" accepts a single optional numeric argument");
+            return false;
+        }
+    }
+    return true;
+}
+
+static Image * noopModify(Image * image,
+                          const trans::Args & args,
+                          int quality, std::string &oError)
+{
+    return image;
 }
 
 
 static Image * blurTransform(const Image * inImage,
-                             const bp::Object * args,
+                             const trans::Args & args,
                              int quality, std::string &oError)
 {
     ExceptionInfo exception;
@@ -33,7 +91,7 @@ static Image * blurTransform(const Image * inImage,
 }
 
 static Image * sharpenTransform(const Image * inImage,
-                             const bp::Object * args,
+                             const trans::Args & args,
                              int quality, std::string &oError)
 {
     ExceptionInfo exception;
@@ -44,7 +102,7 @@ static Image * sharpenTransform(const Image * inImage,
 }
 
 static Image * unsharpenTransform(const Image * inImage,
-                             const bp::Object * args,
+                             const trans::Args & args,
                              int quality, std::string &oError)
 {
     ExceptionInfo exception;
@@ -56,7 +114,7 @@ static Image * unsharpenTransform(const Image * inImage,
 
 
 static Image * despeckleTransform(const Image * inImage,
-                                  const bp::Object * args,
+                                  const trans::Args & args,
                                   int quality, std::string &oError)
 {
     ExceptionInfo exception;
@@ -68,7 +126,7 @@ static Image * despeckleTransform(const Image * inImage,
 
 
 static Image * enhanceTransform(const Image * inImage,
-                                const bp::Object * args,
+                                const trans::Args & args,
                                 int quality, std::string &oError)
 {
     ExceptionInfo exception;
@@ -79,60 +137,134 @@ static Image * enhanceTransform(const Image * inImage,
 }
 
 
-static Image * solarizeTransform(const Image * inImage,
-                                 const bp::Object * args,
-                                 int quality, std::string &oError)
+// per sample equivalent of SolarizeImage(i, 1.0) on a true color image
+static Quantum solarizeMap(Quantum value)
 {
-    ExceptionInfo exception;
-    GetExceptionInfo(&exception);
-    Image * i = CloneImage(inImage, 0, 0, 1, &exception);
-    if (!i) {
-        oError.append("couldn't clone image :/");        
-    } else if (!SolarizeImage(i, 1.0)) {
+    const double threshold = 1.0;
+    return (value > threshold) ? MaxRGB - value : value;
+}
+
+static Image * solarizeModify(Image * i,
+                              const trans::Args & args,
+                              int quality, std::string &oError)
+{
+    if (!SolarizeImage(i, 1.0)) {
         oError.append("error during solarization occured");
         DestroyImage(i);
         i = NULL;
     }
-    DestroyExceptionInfo(&exception);
     return i;
 }
 
-static Image * contrastTransform(const Image * inImage,
-                                 const bp::Object * args,
-                                 int quality, std::string &oError)
+// immutable data for contrastWorker
+typedef struct {
+    int sign;
+    int passes;
+} ContrastArgs;
+
+// ContrastImage() repeated, one pixel at a time.  Contrast() round trips
+// through HSL, so passes can't be composed into a per channel table
+// without changing output.  Instead every pass is applied to a pixel
+// while it's in a register, and runs of identical pixels (common in
+// flat regions and synthetic images) reuse the previous result.
+static void contrastPixels(const ContrastArgs * ca, PixelPacket * pixels,
+                           long npixels)
 {
-    int contrast = 1;
-    
+    PixelPacket in, out;
+    bool haveLast = false;
+    for (long i = 0; i < npixels; i++) {
+        if (haveLast && pixels[i].red == in.red &&
+            pixels[i].green == in.green && pixels[i].blue == in.blue)
+        {
+            pixels[i].red = out.red;
+            pixels[i].green = out.green;
+            pixels[i].blue = out.blue;
+            continue;
+        }
+        in = pixels[i];
+        for (int p = 0; p < ca->passes; p++) {
+            Contrast(ca->sign, &pixels[i].red, &pixels[i].green,
+                     &pixels[i].blue);
+        }
+        out = pixels[i];
+        haveLast = true;
+    }
+}
+
+static MagickPassFail contrastWorker(
+	void *mutable_data,         /* User provided mutable data */
+	const void *immutable_data, /* User provided immutable data */
+	Image *image,               /* Modify image */
+	PixelPacket *pixels,        /* Pixel row */
+	IndexPacket *indexes,       /* Pixel row indexes */
+	const long npixels,         /* Number of pixels in row */
+	ExceptionInfo *exception)   /* Exception report */
+{
+    contrastPixels((const ContrastArgs *) immutable_data, pixels, npixels);
+	return MagickPass;
+}
+
+static bool parseContrastArgs(const bp::Object * args, trans::Args & parsed,
+                              std::string & oError)
+{
+    parsed.number = 1;
     if (args) {
         if (args->type() != BPTInteger) {
             oError.append("contrast takes a single numeric argument between "
                           "-10 and 10");
-            return NULL;
+            return false;
         }
-        contrast = (int) ((long long) *args);
+        parsed.number = (double) ((long long) *args);
     }
-    
+    return true;
+}
+
+static Image * contrastModify(Image * i,
+                              const trans::Args & args,
+                              int quality, std::string &oError)
+{
+    int contrast = (int) args.number;
+
+    ContrastArgs ca;
+    ca.sign = 1;
+    if (contrast < 0) {
+        ca.sign = -1;
+        contrast *= -1;
+    }
+    if (contrast > 10) contrast = 10;
+    ca.passes = contrast;
 
+    // equivalent to calling ContrastImage() ca.passes times, but with a
+    // single sweep over the pixels
     ExceptionInfo exception;
     GetExceptionInfo(&exception);
-    Image * i = CloneImage(inImage, 0, 0, 1, &exception);
-    if (!i) {
-        oError.append("couldn't clone image :/");        
+    MagickPassFail status = MagickPass;
+    if (ca.passes == 0) {
+        // nothing to do
+    } else if (i->storage_class == PseudoClass) {
+        contrastPixels(&ca, i->colormap, (long) i->colors);
+        status = SyncImage(i);
     } else {
-        int sharpen = 1;
-        if (contrast < 0) {
-            sharpen = 0;
-            contrast *= -1;
-        }
-        if (contrast > 10) contrast = 10;
-        for (int x = 0; x < contrast; x++) {
-            if (!ContrastImage(i, sharpen)) {
-                oError.append("error during contrast occured");
-                DestroyImage(i);
-                i = NULL;
-                break;
-            }
-        }
+        PixelIteratorOptions options;
+        RowThreads rt;
+        status = PixelIterateMonoModify(
+            contrastWorker,
+            rt.options(options, &exception),
+            NULL, // const char *description
+            NULL, // void *mutable_data
+            &ca, // const void *immutable_data
+            0, // const long x
+            0, // const long y
+            i->columns, // const unsigned long columns, 
+            i->rows, // const unsigned long rows, 
+            i,
+            &exception);
+    }
+
+    if (status == MagickFail) {
+        oError.append("error during contrast occured");
+        DestroyImage(i);
+        i = NULL;
     }
     
     DestroyExceptionInfo(&exception);
@@ -142,7 +274,7 @@ static Image * contrastTransform(const Image * inImage,
 
 
 static Image * oilpaintTransform(const Image * inImage,
-                                 const bp::Object * args,
+                                 const trans::Args & args,
                                  int quality, std::string &oError)
 {
     ExceptionInfo exception;
@@ -153,22 +285,18 @@ static Image * oilpaintTransform(const Image * inImage,
 }
 
 
+static bool parseRotateArgs(const bp::Object * args, trans::Args & parsed,
+                            std::string & oError)
+{
+    return parseOptionalNumber("rotate", args, 90.0, parsed, oError);
+}
+
 static Image * rotateTransform(const Image * inImage,
-                               const bp::Object * args,
+                               const trans::Args & args,
                                int quality, std::string &oError)
 {
-    double degrees = 90;
-    if (args != NULL) {
-        if (args->type() == BPTDouble) {
-            degrees = (double) *args;
-        } else if (args->type() == BPTInteger) {
-            degrees = (double)((long long)(*args));
-        } else {
-            oError.append("rotate accepts a single optional numeric argument");
-            return NULL;
-        }
-    }
-    
+    double degrees = args.number;
+
     ExceptionInfo exception;
     GetExceptionInfo(&exception);
     Image * i = RotateImage( inImage, degrees, &exception );
@@ -177,22 +305,18 @@ static Image * rotateTransform(const Image * inImage,
 }
 
 
+static bool parseSwirlArgs(const bp::Object * args, trans::Args & parsed,
+                           std::string & oError)
+{
+    return parseOptionalNumber("swirl", args, 90.0, parsed, oError);
+}
+
 static Image * swirlTransform(const Image * inImage,
-                              const bp::Object * args,
+                              const trans::Args & args,
                               int quality, std::string &oError)
 {
-    double degrees = 90;
-    if (args != NULL) {
-        if (args->type() == BPTDouble) {
-            degrees = (double) *args;
-        } else if (args->type() == BPTInteger) {
-            degrees = (double)((long long)(*args));
-        } else {
-            oError.append("swirl accepts a single optional numeric argument");
-            return NULL;
-        }
-    }
-    
+    double degrees = args.number;
+
     ExceptionInfo exception;
     GetExceptionInfo(&exception);
     Image * i = SwirlImage( inImage, degrees, &exception );
@@ -202,16 +326,14 @@ static Image * swirlTransform(const Image * inImage,
 
 
 static bool
-extractScalingDimensions(const char * funcName,
-                         const Image * inImage,                         
-                         const bp::Object * args,
-                         unsigned int &x,
-                         unsigned int &y,                         
-                         std::string &oError)
+parseScalingArgs(const char * funcName,
+                 const bp::Object * args,
+                 int &maxwidth,
+                 int &maxheight,
+                 std::string &oError)
 {
-    x = y = 0;
-    int maxwidth = -1;
-    int maxheight = -1;
+    maxwidth = -1;
+    maxheight = -1;
     
     assert(args != NULL);
     
@@ -219,7 +341,7 @@ extractScalingDimensions(const char * funcName,
         oError.append(funcName);
         oError.append(" accepts an object containing one or more "
                       "of the properties: maxwidth, maxheight");
-        return NULL;
+        return false;
     }
 
     bp::Map::Iterator i(*((const bp::Map *) args));
@@ -233,26 +355,31 @@ extractScalingDimensions(const char * funcName,
             std::stringstream ss;
             ss << "invalid argument to " << funcName << ": " << k;
             oError = ss.str();
-            return NULL;
+            return false;
         }
 
         if (v->type() != BPTInteger) {
             std::stringstream ss;
             ss << k << " requires an integer argument";
             oError = ss.str();
-            return NULL;
+            return false;
         }
 
         *num = (int)((long long) *v);
     }
 
-    // wow.  parsing arguments is lame.  but we did it. maxheight and
-    // maxwidth now contain values that we should constrain to
-    
-    // first we'll determine the size of the input
-    x = inImage->columns;
-    y = inImage->rows;
-    unsigned int origx = x, origy = y;
+    return true;
+}
+
+// given the size of an input image and the constraints parsed by
+// parseScalingArgs, compute the dimensions of the scaled image
+static void
+computeScaledSize(unsigned long columns, unsigned long rows,
+                  int maxwidth, int maxheight,
+                  unsigned int &x, unsigned int &y)
+{
+    x = columns;
+    y = rows;
     if (maxwidth <= 0) maxwidth = x;
     if (maxheight <= 0) maxheight = y;
     
@@ -271,28 +398,42 @@ extractScalingDimensions(const char * funcName,
         x *= scale;
         y *= scale;
     }
+}
+
+static bool parseScaleArgs(const bp::Object * args, trans::Args & parsed,
+                           std::string & oError)
+{
+    return parseScalingArgs("scale", args, parsed.maxwidth,
+                            parsed.maxheight, oError);
+}
+
+static bool parseThumbnailArgs(const bp::Object * args, trans::Args & parsed,
+                               std::string & oError)
+{
+    return parseScalingArgs("thumbnail", args, parsed.maxwidth,
+                            parsed.maxheight, oError);
+}
+
+static void
+extractScalingDimensions(const Image * inImage,                         
+                         const trans::Args & args,
+                         unsigned int &x,
+                         unsigned int &y)
+{
+    // maxheight and maxwidth contain values that we should constrain to
+    computeScaledSize(inImage->columns, inImage->rows,
+                      args.maxwidth, args.maxheight, x, y);
 
     // log about it
     g_bpCoreFunctions->log(
         BP_INFO,
         "scaling parameters [mw: %d | mh: %d]: "
-        "from (%lu, %lu) to (%lu, %lu)",
-        maxwidth, maxheight, origx, origy, x, y);
-
-    return true;
+        "from (%lu, %lu) to (%u, %u)",
+        args.maxwidth, args.maxheight, inImage->columns, inImage->rows, x, y);
 }
 
-static Image * scaleTransform(const Image * inImage,
-                              const bp::Object * args,
-                              int quality, std::string &oError)
+static Image * scaleTo(const Image * inImage, unsigned int x, unsigned int y)
 {
-    unsigned int x = 0, y = 0;
-    
-    if (!extractScalingDimensions("scale", inImage, args, x, y, oError))
-    {
-        return NULL;
-    }
-    
     ExceptionInfo exception;
     GetExceptionInfo(&exception);
     Image * img = ResizeImage(inImage, x, y, LanczosFilter, 1.0, &exception);
@@ -301,17 +442,9 @@ static Image * scaleTransform(const Image * inImage,
     return img;
 }
 
-static Image * thumbnailTransform(const Image * inImage,
-                                   const bp::Object * args,
-                                   int quality, std::string &oError)
+static Image * thumbnailTo(const Image * inImage,
+                           unsigned int x, unsigned int y)
 {
-    unsigned int x = 0, y = 0;
-    
-    if (!extractScalingDimensions("thumbnail", inImage, args, x, y, oError))
-    {
-        return NULL;
-    }
-    
     ExceptionInfo exception;
     GetExceptionInfo(&exception);
     Image * img = ThumbnailImage(inImage, x, y, &exception);
@@ -320,21 +453,37 @@ static Image * thumbnailTransform(const Image * inImage,
     return img;
 }
 
+static Image * scaleTransform(const Image * inImage,
+                              const trans::Args & args,
+                              int quality, std::string &oError)
+{
+    unsigned int x = 0, y = 0;
+    extractScalingDimensions(inImage, args, x, y);
+    return scaleTo(inImage, x, y);
+}
 
+static Image * thumbnailTransform(const Image * inImage,
+                                   const trans::Args & args,
+                                   int quality, std::string &oError)
+{
+    unsigned int x = 0, y = 0;
+    extractScalingDimensions(inImage, args, x, y);
+    return thumbnailTo(inImage, x, y);
+}
 
-static Image * cropTransform(const Image * inImage,
-                             const bp::Object * args,
-                             int quality, std::string &oError)
+
+
+static bool parseCropArgs(const bp::Object * args, trans::Args & parsed,
+                          std::string & oError)
 {
-    // first we'll validate and extract parameters
-    double cropParams[4];
+    double * cropParams = parsed.crop;
     assert(args != NULL);
     
     if (!args || args->type() != BPTList ||
         ((const bp::List *) args)->size() != 4)
     {
         oError.append("crop accepts an array of four floating point numbers");
-        return NULL;
+        return false;
     }
 
     const bp::List * l = (const bp::List *) args;
@@ -343,7 +492,7 @@ static Image * cropTransform(const Image * inImage,
         if  (l->value(i)->type() != BPTDouble) {
             oError.append("crop accepts an array of four "
                           "floating point numbers");
-            return NULL;
+            return false;
         }
 
         cropParams[i] = (double) *(l->value(i));
@@ -355,23 +504,38 @@ static Image * cropTransform(const Image * inImage,
     if (cropParams[0] >= cropParams[2] || cropParams[1] >= cropParams[3]) {
         oError.append("meaningless crop parameters (x1/y1 may not be greater"
                       " than x2/y2)");
-        return NULL;
+        return false;
     }
-    
 
-    // cropParams now contains x1, y1, x2, y2 in relative cordinates,
-    // with origin at top left of image.  We'll use that information to
-    // populate a RectangleInfo structure
+    return true;
+}
 
-    // extract existing image size
-    unsigned int x = inImage->magick_columns;
-    unsigned int y = inImage->magick_rows;
+// the rectangle kept by a crop of an image originally x by y
+static RectangleInfo cropRectangle(const trans::Args & args,
+                                   unsigned int x, unsigned int y)
+{
+    const double * cropParams = args.crop;
 
+    // cropParams contains x1, y1, x2, y2 in relative cordinates,
+    // with origin at top left of image.  We'll use that information to
+    // populate a RectangleInfo structure
     RectangleInfo ri;
     ri.height = y * (cropParams[3] - cropParams[1]);
     ri.width = x * (cropParams[2] - cropParams[0]);
     ri.x = x * cropParams[0];
     ri.y = y * cropParams[1];
+    return ri;
+}
+
+static Image * cropTransform(const Image * inImage,
+                             const trans::Args & args,
+                             int quality, std::string &oError)
+{
+    // extract existing image size
+    unsigned int x = inImage->magick_columns;
+    unsigned int y = inImage->magick_rows;
+
+    RectangleInfo ri = cropRectangle(args, x, y);
 
     g_bpCoreFunctions->log(
         BP_INFO,
@@ -387,121 +551,91 @@ static Image * cropTransform(const Image * inImage,
 }
 
 
-static Image * equalizeTransform(const Image * inImage,
-                                  const bp::Object * args,
-                                  int quality, std::string &oError)
+static Image * equalizeModify(Image * i,
+                              const trans::Args & args,
+                              int quality, std::string &oError)
 {
-    ExceptionInfo exception;
-    GetExceptionInfo(&exception);
-    Image * i = CloneImage(inImage, 0, 0, 1, &exception);
-    if (!i) {
-        oError.append("couldn't clone image :/");        
-    } else if (!EqualizeImage(i)) {
+    if (!EqualizeImage(i)) {
         oError.append("error occured during equalization");
         DestroyImage(i);
         i = NULL;
     }
-    DestroyExceptionInfo(&exception);
     return i;
 }
 
-static Image * normalizeTransform(const Image * inImage,
-                                  const bp::Object * args,
-                                  int quality, std::string &oError)
+static Image * normalizeModify(Image * i,
+                               const trans::Args & args,
+                               int quality, std::string &oError)
 {
-    ExceptionInfo exception;
-    GetExceptionInfo(&exception);
-    Image * i = CloneImage(inImage, 0, 0, 1, &exception);
-    if (!i) {
-        oError.append("couldn't clone image :/");        
-    } else if (!NormalizeImage(i)) {
+    if (!NormalizeImage(i)) {
         oError.append("error occured during normalization");
         DestroyImage(i);
         i = NULL;
     }
-    DestroyExceptionInfo(&exception);
     return i;
 }
 
 
-static Image * ditherTransform(const Image * inImage,
-                               const bp::Object * args,
-                               int quality, std::string &oError)
+static Image * ditherModify(Image * i,
+                            const trans::Args & args,
+                            int quality, std::string &oError)
 {
-    ExceptionInfo exception;
-    GetExceptionInfo(&exception);
-    Image * i = CloneImage(inImage, 0, 0, 1, &exception);
-    if (!i) {
-        oError.append("couldn't clone image :/");        
-    } else if (!OrderedDitherImage(i)) {
+    if (!OrderedDitherImage(i)) {
         oError.append("error occured during ditherizasification");
         DestroyImage(i);
         i = NULL;
     }
-    DestroyExceptionInfo(&exception);
     return i;
 }
 
 
-static Image * grayscaleTransform(const Image * inImage,
-                                  const bp::Object * args,
-                                  int quality, std::string &oError)
+// quantizing dithers, so the result depends on the neighboring pixels
+// and scaling first merely gives a similar one
+static Image * grayscaleModify(Image * i,
+                               const trans::Args & args,
+                               int quality, std::string &oError)
 {
-    ExceptionInfo exception;
     QuantizeInfo qi;
-    GetExceptionInfo(&exception);
     GetQuantizeInfo(&qi);
 
     qi.colorspace = GRAYColorspace;
 
-    Image * i = CloneImage(inImage, 0, 0, 1, &exception);
-    if (!i) {
-        oError.append("couldn't clone image :/");        
-    } else if (!QuantizeImage(&qi, i)) {
+    if (!QuantizeImage(&qi, i)) {
         oError.append("error during grayscale quantize phase occured");
         DestroyImage(i);
         i = NULL;
     }
-
-//    DestroyQuantizeInfo(&qi);
-    DestroyExceptionInfo(&exception);
     return i;
 }
 
-static Image * psychedelicTransform(const Image * inImage,
-                                    const bp::Object * args,
-                                    int quality, std::string &oError)
+static Image * psychedelicModify(Image * i,
+                                 const trans::Args & args,
+                                 int quality, std::string &oError)
 {
-    ExceptionInfo exception;
-    GetExceptionInfo(&exception);
-    Image * i = CloneImage(inImage, 0, 0, 1, &exception);
-    if (!i) {
-        oError.append("couldn't clone image :/");        
-    } else if (!CycleColormapImage(i, 8)) {
+    if (!CycleColormapImage(i, 8)) {
         oError.append("error during psychedlic occured");
         DestroyImage(i);
         i = NULL;
     }
-    DestroyExceptionInfo(&exception);
     return i;
 }
 
 
-static Image * negateTransform(const Image * inImage,
-                               const bp::Object * args,
-                               int quality, std::string &oError)
+// per sample equivalent of NegateImage(i, 0) on a true color image
+static Quantum negateMap(Quantum value)
 {
-    ExceptionInfo exception;
-    GetExceptionInfo(&exception);
-    Image * i = CloneImage(inImage, 0, 0, 1, &exception);
-    if (!i) {
-        oError.append("couldn't clone image :/");        
-    } else if (!NegateImage(i, 0)) {
+    return MaxRGB - value;
+}
+
+static Image * negateModify(Image * i,
+                            const trans::Args & args,
+                            int quality, std::string &oError)
+{
+    if (!NegateImage(i, 0)) {
         oError.append("error during negate occured");
         DestroyImage(i);
         i = NULL;
     }
-    DestroyExceptionInfo(&exception);
     return i;
 }
 
@@ -515,76 +649,45 @@ static MagickPassFail sepiaWorker(
 	const long npixels,         /* Number of pixels in row */
 	ExceptionInfo *exception)   /* Exception report */
 {
-	// Modified version of algorithm from:
-	//     http://blogs.techrepublic.com.com/howdoi/?p=120
-	//
-  	for (long i=0; i < npixels; i++) {
-		float r1 = (float)pixels[i].red;
-		float g1 = (float)pixels[i].green;
-		float b1 = (float)pixels[i].blue;
-
-		// Changed the factors to 
-		//   (1) make filter less yellow and
-		//   (2) make filter less bright
-		float r2 = (r1 * 0.373 + g1 * 0.731 + b1 * 0.180);
-		float g2 = (r1 * 0.298 + g1 * 0.586 + b1 * 0.143);
-		float b2 = (r1 * 0.219 + g1 * 0.431 + b1 * 0.105);
-
-		// Original factors
-		// float r2 = (r1 * .393 + g1 *.769 + b1 * .189);
-		// float g2 = (r1 * .349 + g1 *.686 + b1 * .168);
-		// float b2 = (r1 * .272 + g1 *.534 + b1 * .131);
-
-		if (r2 > MaxRGB) r2 = MaxRGB;
-		if (g2 > MaxRGB) g2 = MaxRGB;
-		if (b2 > MaxRGB) b2 = MaxRGB;
-
-		pixels[i].red   = r2;
-		pixels[i].green = g2;
-		pixels[i].blue  = b2;
-	}
-  
+    kernels::sepia(pixels, npixels);
 	return MagickPass;
 }
 
-static Image * sepiaTransform(const Image * inImage,
-                              const bp::Object * args,
-                              int quality, std::string &oError)
+static Image * sepiaModify(Image * i,
+                           const trans::Args & args,
+                           int quality, std::string &oError)
 {
 	MagickPassFail status=MagickPass;
     ExceptionInfo exception;
     GetExceptionInfo(&exception);
-    Image * i = CloneImage(inImage, 0, 0, 1, &exception);
 
-    if (!i) {
-        oError.append("couldn't clone image :/");        
-	} else {
-		status=PixelIterateMonoModify(
-			sepiaWorker,
-			NULL, // const PixelIteratorOptions *options
-			NULL, // const char *description
-			NULL, // void *mutable_data
-			NULL, // const void *immutable_data
-			0, // const long x
-			0, // const long y
-			i->columns, // const unsigned long columns, 
-			i->rows, // const unsigned long rows, 
-			i,
-			&exception);
+	PixelIteratorOptions options;
+	RowThreads rt;
+	status=PixelIterateMonoModify(
+		sepiaWorker,
+		rt.options(options, &exception),
+		NULL, // const char *description
+		NULL, // void *mutable_data
+		NULL, // const void *immutable_data
+		0, // const long x
+		0, // const long y
+		i->columns, // const unsigned long columns, 
+		i->rows, // const unsigned long rows, 
+		i,
+		&exception);
 		
-		if (status == MagickFail) {
-        	oError.append("error during sepia quanitzation occured");
-        	DestroyImage(i);
-        	i = NULL;
-		} else {
-			// Remove contrast.  Could blow up the highlights on certain pictures.
-			// Let the user add contrast if required.
-			/*
-			// Add some little contrast to sepia toned image.  Looks much better with contrast.
-			i = contrastTransform(i, NULL, 100, oError);
-			*/
-
-		}
+	if (status == MagickFail) {
+       	oError.append("error during sepia quanitzation occured");
+       	DestroyImage(i);
+       	i = NULL;
+	} else {
+		// Remove contrast.  Could blow up the highlights on certain pictures.
+		// Let the user add contrast if required.
+		/*
+		// Add some little contrast to sepia toned image.  Looks much better with contrast.
+		i = contrastModify(i, args, 100, oError);
+		*/
+
 	}
 
     DestroyExceptionInfo(&exception);
@@ -592,190 +695,205 @@ static Image * sepiaTransform(const Image * inImage,
 }
 
 
-static Image * thresholdTransform(const Image * inImage,
-                                  const bp::Object * args,
-                                  int quality, std::string &oError)
+static bool parseThresholdArgs(const bp::Object * args, trans::Args & parsed,
+                               std::string & oError)
 {
-    double threshold = 128.0;
-    if (args != NULL) {
-        if (args->type() == BPTDouble) {
-            threshold = (double) *args;
-        } else if (args->type() == BPTInteger) {
-            threshold = (double)((long long)(*args));
-        } else {
-            oError.append("threshold accepts a single optional numeric argument");
-            return NULL;
-        }
+    if (!parseOptionalNumber("threshold", args, 128.0, parsed, oError)) {
+        return false;
     }
-    if (threshold < 0.0) threshold = 0.0;
-    if (threshold > 256.0) threshold = 256.0;
+    if (parsed.number < 0.0) parsed.number = 0.0;
+    if (parsed.number > 256.0) parsed.number = 256.0;
+    return true;
+}
 
-    ExceptionInfo exception;
-    GetExceptionInfo(&exception);
+static Image * thresholdModify(Image * i,
+                               const trans::Args & args,
+                               int quality, std::string &oError)
+{
+    double threshold = args.number;
 
-    Image * i = CloneImage(inImage, 0, 0, 1, &exception);
-    if ( !ThresholdImage( i, threshold ) )
-    {
-        DestroyImage(i);        
+    if (!ThresholdImage(i, threshold)) {
+        DestroyImage(i);
         i = NULL;
     }
-    DestroyExceptionInfo(&exception);
     return i;
 }
 
 
 
-static Image * blackThresholdTransform(const Image * inImage,
-                                       const bp::Object * args,
-                                       int quality, std::string &oError)
+static bool parseBlackThresholdArgs(const bp::Object * args,
+                                    trans::Args & parsed,
+                                    std::string & oError)
 {
-    double threshold = 50.0;
-    if (args != NULL) {
-        if (args->type() == BPTDouble) {
-            threshold = (double) *args;
-        } else if (args->type() == BPTInteger) {
-            threshold = (double)((long long)(*args));
-        } else {
-            oError.append("black_threshold accepts a single optional numeric argument");
-            return NULL;
-        }
+    if (!parseOptionalNumber("black_threshold", args, 50.0, parsed, oError)) {
+        return false;
     }
-    if (threshold < 0.0) threshold = 0.0;
-    if (threshold > 100.0) threshold = 100.0;
+    if (parsed.number < 0.0) parsed.number = 0.0;
+    if (parsed.number > 100.0) parsed.number = 100.0;
+    return true;
+}
+
+static Image * blackThresholdModify(Image * i,
+                                    const trans::Args & args,
+                                    int quality, std::string &oError)
+{
+    double threshold = args.number;
 
     char thresholdString[10];
     sprintf(thresholdString, "%d%%", (int) threshold);
-    
-    ExceptionInfo exception;
-    GetExceptionInfo(&exception);
 
-    Image * i = CloneImage(inImage, 0, 0, 1, &exception);
-    if (!BlackThresholdImage( i, thresholdString ))
-    {
-        DestroyImage(i);        
+    if (!BlackThresholdImage(i, thresholdString)) {
+        DestroyImage(i);
         i = NULL;
     }
-    DestroyExceptionInfo(&exception);
     return i;
 }
 
 
 
+// rows read around each output pixel by the neighbourhood filters, with
+// room to spare.  GraphicsMagick's blur, sharpen, unsharp mask, oil paint
+// and enhance kernels reach at most 2 pixels with the arguments we use.
+// Despeckle makes 16 hull passes, each of which reaches 2 pixels.
+#define KERNEL_HALO 8
+#define DESPECKLE_HALO 40
+
 static trans::Transformation s_transMap[] = {
     {
-        "contrast", true, false, contrastTransform,
+        "contrast", true, false, parseContrastArgs, NULL,
         "adjust the image's contrast, accepts an optional numeric argument "
-        "between -10 and 10"
+        "between -10 and 10",
+        NULL, NULL, trans::ApproxCommutes, 0, contrastModify
     },    
     {
-        "black_threshold", true, false, blackThresholdTransform,
+        "black_threshold", true, false,
+        parseBlackThresholdArgs, NULL,
         "Given a threshold (in terms of percentage from 0-100), color all "
-        "pixels which fall under that threshold black."
+        "pixels which fall under that threshold black.",
+        NULL, NULL, trans::KeepsOrder, 0, blackThresholdModify
     },
     {
-        "blur", false, false, blurTransform,
-        "blur (or 'smooth') an image"
+        "blur", false, false, NULL, blurTransform,
+        "blur (or 'smooth') an image",
+        NULL, NULL, trans::ApproxCommutes, KERNEL_HALO
     },    
     {
-        "crop", true, true, cropTransform,
+        "crop", true, true, parseCropArgs, cropTransform,
         "select a subset of an image, accepts an array of four floating point "
         "numbers: x1,y1,x2,y2 which are between 0.0 and 1.0 and are relative "
         "coordinates to the upper left hand corner of the image"
     },    
     {
-        "despeckle", false, false, despeckleTransform,
+        "despeckle", false, false, NULL, despeckleTransform,
         "reduces the speckle noise in an image while perserving the edges of "
-        "the original image, accepts no arguments"
+        "the original image, accepts no arguments",
+        NULL, NULL, trans::ApproxCommutes, DESPECKLE_HALO
     },
     {
-        "dither", false, false, ditherTransform,
-        "Uses the ordered dithering technique of reducing color images to monochrome using positional information to retain as much information as possible."
+        "dither", false, false, NULL, NULL,
+        "Uses the ordered dithering technique of reducing color images to monochrome using positional information to retain as much information as possible.",
+        NULL, NULL, trans::KeepsOrder, 0, ditherModify
     },
     {
-        "enhance", false, false, enhanceTransform,
+        "enhance", false, false, NULL, enhanceTransform,
         "Applies a digital filter that improves the quality of a noisy image, "
-        "accepts no arguments "
+        "accepts no arguments ",
+        NULL, NULL, trans::ApproxCommutes, KERNEL_HALO
     },    
     {
-        "equalize", false, false, equalizeTransform,
-        "Applies a histogram equalization to the image."
+        "equalize", false, false, NULL, NULL,
+        "Applies a histogram equalization to the image.",
+        NULL, NULL, trans::ApproxCommutes, 0, equalizeModify
     },
 
     {
-        "grayscale", false, false, grayscaleTransform,
-        "remove the color from an image, accepts no arguments"
+        "grayscale", false, false, NULL, NULL,
+        "remove the color from an image, accepts no arguments",
+        NULL, NULL, trans::ApproxCommutes, 0, grayscaleModify
     },    
     {
-        "greyscale", true, true, grayscaleTransform,
-        "an alias for 'grayscale'"
+        "greyscale", true, true, NULL, NULL,
+        "an alias for 'grayscale'",
+        NULL, NULL, trans::ApproxCommutes, 0, grayscaleModify
     },    
     {
-        "negate", false, false, negateTransform,
-        "negate the colors of the image, accepts no arguments"
+        "negate", false, false, NULL, NULL,
+        "negate the colors of the image, accepts no arguments",
+        NULL, negateMap, trans::Commutes, 0, negateModify
     },
     {
-        "noop", false, false, noopTransform,
-        "do nothing.  may be applied multiple times.  still does nothing."
+        "noop", false, false, NULL, NULL,
+        "do nothing.  may be applied multiple times.  still does nothing.",
+        NULL, NULL, trans::Commutes, 0, noopModify
     },
     {
-        "normalize", false, false, normalizeTransform,
-        "Enhances the contrast of a color image by adjusting the pixels color to span the entire range of colors available."
+        "normalize", false, false, NULL, NULL,
+        "Enhances the contrast of a color image by adjusting the pixels color to span the entire range of colors available.",
+        NULL, NULL, trans::ApproxCommutes, 0, normalizeModify
     },
     {
-        "oilpaint", false, false, oilpaintTransform,
+        "oilpaint", false, false, NULL, oilpaintTransform,
         "an effect that will make the image look like an oil painting, "
-        "accepts no arguments"
+        "accepts no arguments",
+        NULL, NULL, trans::ApproxCommutes, KERNEL_HALO
     },    
     {
-        "psychedelic", false, false, psychedelicTransform,
+        "psychedelic", false, false, NULL, NULL,
         "trip out an image.  takes no arguments.  may be applied multiple "
-        "times."
+        "times.",
+        NULL, NULL, trans::KeepsOrder, 0, psychedelicModify
     },
     {
-        "rotate", true, false, rotateTransform,
+        "rotate", true, false, parseRotateArgs, rotateTransform,
         "rotate an image by some number of degrees, takes a single numeric "
         "argument"
     },
     {
-        "scale", true, true, scaleTransform,
+        "scale", true, true, parseScaleArgs, scaleTransform,
         "downscale an image preserving aspect ratio.  you may provide the "
         "integer arguments maxwidth and/or maxheight which limit the image "
         "in the specified direction.  units are pixels."
     },    
     {
-        "sepia", false, false, sepiaTransform,
-        "sepia tone an image.  no arguments."
+        "sepia", false, false, NULL, NULL,
+        "sepia tone an image.  no arguments.",
+        kernels::sepia, NULL, trans::ApproxCommutes, 0, sepiaModify
     },    
     {
-        "sharpen", false, false, sharpenTransform,
-        "sharpen an image"
+        "sharpen", false, false, NULL, sharpenTransform,
+        "sharpen an image",
+        NULL, NULL, trans::ApproxCommutes, KERNEL_HALO
     },    
     {
-        "solarize", false, false, solarizeTransform,
-        "solarize an image.  no arguments"
+        "solarize", false, false, NULL, NULL,
+        "solarize an image.  no arguments",
+        NULL, solarizeMap, trans::ApproxCommutes, 0, solarizeModify
     },
     {
-        "swirl", true, true, swirlTransform,
+        "swirl", true, true, parseSwirlArgs, swirlTransform,
         "swirl an image.  optionally a numeric argument specifies the degrees "
-        "to swirl, default is 90 degrees."
+        "to swirl, default is 90 degrees.",
+        NULL, NULL, trans::ApproxCommutes
     },
     {
-        "threshold", true, false, thresholdTransform,
+        "threshold", true, false, parseThresholdArgs, NULL,
         "given a numeric threshold collapse pixels of intensity greater than "
         "the threshold to white, and those less than to black.  Result is a "
         "two color image.  Accepts a single numeric arg from 0-256, default "
-        "is 128."
+        "is 128.",
+        NULL, NULL, trans::KeepsOrder, 0, thresholdModify
     },
     {
-        "thumbnail", true, true, thumbnailTransform,
+        "thumbnail", true, true, parseThumbnailArgs, thumbnailTransform,
         "An alternate version of 'scale' optimized for fast thumnailing, "
         "combine with a relatively high 'quality' argument (75-85) for "
         "the best balance between speed and quality.  Accepts the same "
         "arguments as 'scale'."
     },    
     {
-        "unsharpen", false, false, unsharpenTransform,
-        "unsharpen an image"
+        "unsharpen", false, false, NULL, unsharpenTransform,
+        "unsharpen an image",
+        NULL, NULL, trans::ApproxCommutes, KERNEL_HALO
     }
 };
 
@@ -791,15 +909,468 @@ trans::get(unsigned int i)
     return s_transMap + i;
 }
 
-#ifdef WIN32
-#define strcasecmp _stricmp
-#endif
+// transformations are looked up by name for every action of every
+// request, so they're indexed in a small open addressed hash table keyed
+// by the case folded name
+#define NAME_INDEX_SIZE 64
+
+static unsigned int
+hashName(const char * name)
+{
+    // FNV-1a
+    unsigned int h = 2166136261U;
+    for (; *name; name++) {
+        h ^= (unsigned char) tolower(*name);
+        h *= 16777619U;
+    }
+    return h;
+}
+
+class NameIndex {
+  public:
+    NameIndex() {
+        assert(trans::num() < NAME_INDEX_SIZE / 2);
+        for (unsigned int i = 0; i < NAME_INDEX_SIZE; i++) m_slots[i] = NULL;
+        for (unsigned int i = 0; i < trans::num(); i++) {
+            const trans::Transformation * t = trans::get(i);
+            unsigned int h = hashName(t->name) % NAME_INDEX_SIZE;
+            while (m_slots[h]) h = (h + 1) % NAME_INDEX_SIZE;
+            m_slots[h] = t;
+        }
+    }
+
+    const trans::Transformation * find(const char * name) const {
+        unsigned int h = hashName(name) % NAME_INDEX_SIZE;
+        while (m_slots[h]) {
+            if (!strcasecmp(name, m_slots[h]->name)) return m_slots[h];
+            h = (h + 1) % NAME_INDEX_SIZE;
+        }
+        return NULL;
+    }
+
+  private:
+    const trans::Transformation * m_slots[NAME_INDEX_SIZE];
+};
+
+// s_transMap is statically initialized, so it's populated before this is
+// constructed
+static const NameIndex s_nameIndex;
 
 const trans::Transformation *
 trans::get(const std::string & name)
 {
-    for (unsigned int i = 0; i < num(); i++) {
-        if (!strcasecmp(name.c_str(), get(i)->name)) return get(i);
+    return s_nameIndex.find(name.c_str());
+}
+
+// resolve and validate action i of actions
+static bool
+compileAction(const bp::List & actions, unsigned int i,
+              trans::Step & step, std::string & oError)
+{
+    const bp::Object * o = actions.value(i);
+
+    std::string command;
+    const bp::Object * args = NULL;
+        
+    // o may either be a string transformation: i.e. "solarize"
+    // or a may transform: i.e. { "crop": { .25, .75, .25, .75 } }
+    // first we'll extract the command
+    if (o->type() == BPTString) {
+        command = (std::string)(*o);            
+    } else  if (o->type() == BPTMap) {
+        const bp::Map * m = (const bp::Map *) o;
+        if (m->size() != 1) {
+            std::stringstream ss;
+            ss << "transform " << i << " is malformed.  An action is  "
+               << "an object with a single property which is the action "
+               << "name";
+            oError = ss.str();
+            return false;
+        }
+        bp::Map::Iterator it(*m);
+        command.append(it.nextKey());
+        args = m->get(command.c_str());
+        assert(args != NULL);
+    } else {
+        std::stringstream ss;
+        ss << "transform " << i << " is malformed.  An action is  "
+           << "either a string or an object with a single property which "
+           << "is the name of an action to perform";
+        oError = ss.str();
+        return false;
+    }
+
+    g_bpCoreFunctions->log(
+        BP_INFO, "transform [%s] with%s args",
+        command.c_str(), (args ? "" : "out"));
+
+    // does the command exist?
+    const trans::Transformation * t = trans::get(command);
+    if (t == NULL) {
+        std::stringstream ss;
+        ss << "no such transformation: " << command;
+        oError = ss.str();
+        return false;
+    }
+
+    // are the arguments correct?
+    if (t->requiresArgs && !args) {
+        oError.append(command);
+        oError.append(" missing required argument");
+        return false;
+    }
+
+    if (!t->acceptsArgs && args) {        
+        oError.append(command);
+        oError.append(" doesn't accept arguments");
+        return false;
     }
-    return NULL;
-}
\ No newline at end of file
+
+    step.t = t;
+    step.args.present = (args != NULL);
+    if (t->parse && !t->parse(args, step.args, oError)) return false;
+
+    return true;
+}
+
+// is step a rotation by a multiple of 90 degrees?  RotateImage()
+// performs these as exact, tiled integral rotations without
+// interpolation or any change to the canvas beyond swapping its sides
+static bool
+isRightRotation(const trans::Step & step)
+{
+    return (step.t->transform == rotateTransform &&
+            fmod(step.args.number, 90.0) == 0.0);
+}
+
+// Fold each run of consecutive right angle rotations into a single
+// rotation, and drop those which amount to a multiple of 360 degrees.
+// Any other rotation grows the canvas to fit the rotated image, so a
+// run containing one isn't equivalent to its sum and is left alone.
+// The folded angle is the sum modulo 360, with its sign, just as a lone
+// rotation keeps the angle it was given; RotateImage() reaches the same
+// exact result from any equivalent right angle.
+static void
+foldRotations(trans::Plan & plan)
+{
+    trans::Plan folded;
+    folded.reserve(plan.size());
+    for (unsigned int i = 0; i < plan.size(); ) {
+        if (!isRightRotation(plan[i])) {
+            folded.push_back(plan[i++]);
+            continue;
+        }
+
+        trans::Step step = plan[i];
+        unsigned int j = i + 1;
+        for (; j < plan.size() && isRightRotation(plan[j]); j++) {
+            step.args.number += plan[j].args.number;
+        }
+
+        double degrees = fmod(step.args.number, 360.0);
+        if (degrees == 0.0) {
+            g_bpCoreFunctions->log(
+                BP_INFO, "dropping %u rotation(s) totalling %g degrees",
+                j - i, step.args.number);
+        } else {
+            if (j - i > 1) {
+                g_bpCoreFunctions->log(
+                    BP_INFO, "folded %u rotations into %g degrees",
+                    j - i, degrees);
+                step.args.number = degrees;
+            }
+            folded.push_back(step);
+        }
+        i = j;
+    }
+
+    // any action leaves a single frame, so don't let an animation
+    // through whole just because its rotations cancelled out
+    if (folded.empty() && !plan.empty()) {
+        trans::Step noop;
+        noop.t = trans::get("noop");
+        folded.push_back(noop);
+    }
+
+    plan.swap(folded);
+}
+
+bool
+trans::compile(const bp::List & actions, Plan & plan, std::string & oError)
+{
+    g_bpCoreFunctions->log(
+        BP_INFO, "%lu transformation actions specified",
+        (unsigned long) actions.size());
+
+    plan.clear();
+    plan.reserve(actions.size());
+    for (unsigned int i = 0; i < actions.size(); i++) {
+        Step step;
+        if (!compileAction(actions, i, step, oError)) {
+            plan.clear();
+            return false;
+        }
+        plan.push_back(step);
+    }
+
+    foldRotations(plan);
+
+    return true;
+}
+
+bool
+trans::beginsWithDownscale(const Plan & plan)
+{
+    if (plan.empty()) return false;
+
+    const Transformation * t = plan[0].t;
+    return (t->transform == scaleTransform ||
+            t->transform == thumbnailTransform);
+}
+
+const trans::Transformation *
+trans::leadingDownscale(const Plan & plan,
+                        unsigned long columns, unsigned long rows,
+                        unsigned int & x, unsigned int & y)
+{
+    x = y = 0;
+    if (!beginsWithDownscale(plan)) return NULL;
+
+    const Transformation * t = plan[0].t;
+    computeScaledSize(columns, rows, plan[0].args.maxwidth,
+                      plan[0].args.maxheight, x, y);
+
+    return t;
+}
+
+unsigned int
+trans::optimize(Plan & plan, Optimization level)
+{
+    unsigned int moves = 0;
+    if (level == NoOptimization) return moves;
+
+    for (unsigned int i = 1; i < plan.size(); i++) {
+        const Transformation * t = plan[i].t;
+        if (t->transform != scaleTransform &&
+            t->transform != thumbnailTransform)
+        {
+            continue;
+        }
+
+        // bubble the downscale toward the front past all that commute
+        for (unsigned int j = i; j > 0; j--) {
+            Commutation c = plan[j - 1].t->downscale;
+            if (c == KeepsOrder ||
+                (c == ApproxCommutes && level != FastOptimization))
+            {
+                break;
+            }
+            g_bpCoreFunctions->log(
+                BP_INFO, "optimizer: moved %s (action %u) ahead of %s%s",
+                t->name, i, plan[j - 1].t->name,
+                (c == ApproxCommutes ? " (approximately commutes)" : ""));
+            std::swap(plan[j - 1], plan[j]);
+            moves++;
+        }
+    }
+
+    return moves;
+}
+
+bool
+trans::leadingCrop(const Plan & plan,
+                   unsigned long columns, unsigned long rows,
+                   RectangleInfo & ri)
+{
+    if (plan.empty() || plan[0].t->transform != cropTransform) return false;
+
+    ri = cropRectangle(plan[0].args, columns, rows);
+    return (ri.width > 0 && ri.height > 0 &&
+            (unsigned long) ri.x < columns && (unsigned long) ri.y < rows);
+}
+
+Image *
+trans::downscale(const Transformation * t, const Image * inImage,
+                 unsigned int x, unsigned int y)
+{
+    assert(t != NULL);
+    if (t->transform == thumbnailTransform) return thumbnailTo(inImage, x, y);
+    return scaleTo(inImage, x, y);
+}
+
+static void
+appendCanonicalString(std::stringstream & ss, const char * str)
+{
+    ss << '"';
+    for (; str && *str; str++) {
+        char c = (char) tolower(*str);
+        if (c == '"' || c == '\\') ss << '\\';
+        ss << c;
+    }
+    ss << '"';
+}
+
+static void
+appendCanonical(std::stringstream & ss, const bp::Object * o)
+{
+    if (o == NULL) {
+        ss << "null";
+        return;
+    }
+
+    switch (o->type()) {
+        case BPTBoolean:
+            ss << (((bool) *o) ? "true" : "false");
+            break;
+        case BPTInteger:
+            ss << (long long) *o;
+            break;
+        case BPTDouble: {
+            // always include a decimal point, 5.0 mustn't look like 5
+            char buf[64];
+            sprintf(buf, "%.17g", (double) *o);
+            ss << buf;
+            if (!strpbrk(buf, ".eEnN")) ss << ".0";
+            break;
+        }
+        case BPTString:
+        case BPTPath:
+            appendCanonicalString(ss, ((std::string) *o).c_str());
+            break;
+        case BPTMap: {
+            // sort (lower cased) keys.  keys differing only in case are
+            // all kept, so that distinct maps never look the same
+            std::multimap<std::string, const char *> keys;
+            bp::Map::Iterator i(*((const bp::Map *) o));
+            const char * k;
+            while (NULL != (k = i.nextKey())) {
+                std::string lk(k);
+                for (size_t j = 0; j < lk.size(); j++) {
+                    lk[j] = (char) tolower(lk[j]);
+                }
+                keys.insert(std::make_pair(lk, k));
+            }
+            ss << '{';
+            std::multimap<std::string, const char *>::const_iterator it;
+            for (it = keys.begin(); it != keys.end(); it++) {
+                if (it != keys.begin()) ss << ',';
+                appendCanonicalString(ss, it->first.c_str());
+                ss << ':';
+                appendCanonical(ss, o->get(it->second));
+            }
+            ss << '}';
+            break;
+        }
+        case BPTList: {
+            const bp::List * l = (const bp::List *) o;
+            ss << '[';
+            for (unsigned int i = 0; i < l->size(); i++) {
+                if (i) ss << ',';
+                appendCanonical(ss, l->value(i));
+            }
+            ss << ']';
+            break;
+        }
+        default:
+            ss << "null";
+            break;
+    }
+}
+
+std::string
+trans::canonicalForm(const bp::Object * o)
+{
+    std::stringstream ss;
+    appendCanonical(ss, o);
+    return ss.str();
+}
+
+bool
+trans::canStreamRows(const Image * inImage)
+{
+    return (inImage->storage_class == DirectClass &&
+            inImage->colorspace == RGBColorspace);
+}
+
+trans::RowStage
+trans::composeChannelMaps(const ChannelMap * maps, unsigned int n)
+{
+    RowStage stage;
+    stage.lut.resize((size_t) MaxRGB + 1);
+    for (size_t v = 0; v <= MaxRGB; v++) {
+        Quantum q = (Quantum) v;
+        for (unsigned int m = 0; m < n; m++) q = maps[m](q);
+        stage.lut[v] = q;
+    }
+    return stage;
+}
+
+static MagickPassFail streamRowsWorker(
+	void *mutable_data,         /* User provided mutable data */
+	const void *immutable_data, /* User provided immutable data */
+	Image *image,               /* Modify image */
+	PixelPacket *pixels,        /* Pixel row */
+	IndexPacket *indexes,       /* Pixel row indexes */
+	const long npixels,         /* Number of pixels in row */
+	ExceptionInfo *exception)   /* Exception report */
+{
+    const std::vector<trans::RowStage> & stages =
+        *((const std::vector<trans::RowStage> *) immutable_data);
+    for (unsigned int s = 0; s < stages.size(); s++) {
+        if (stages[s].kernel) {
+            stages[s].kernel(pixels, npixels);
+            continue;
+        }
+        const Quantum * lut = &(stages[s].lut[0]);
+        for (long i = 0; i < npixels; i++) {
+            pixels[i].red   = lut[pixels[i].red];
+            pixels[i].green = lut[pixels[i].green];
+            pixels[i].blue  = lut[pixels[i].blue];
+        }
+    }
+	return MagickPass;
+}
+
+Image *
+trans::streamRows(Image * i,
+                  const std::vector<RowStage> & stages,
+                  std::string & oError)
+{
+    ExceptionInfo exception;
+    GetExceptionInfo(&exception);
+
+    PixelIteratorOptions options;
+    RowThreads rt;
+    MagickPassFail status = PixelIterateMonoModify(
+        streamRowsWorker,
+        rt.options(options, &exception),
+        NULL, // const char *description
+        NULL, // void *mutable_data
+        &stages, // const void *immutable_data
+        0, // const long x
+        0, // const long y
+        i->columns, // const unsigned long columns, 
+        i->rows, // const unsigned long rows, 
+        i,
+        &exception);
+
+    if (status == MagickFail) {
+        oError.append("error while streaming rows");
+        DestroyImage(i);
+        i = NULL;
+    }
+
+    DestroyExceptionInfo(&exception);
+    return i;
+}
+
+Image *
+trans::apply(const Transformation * t, Image * image, const Args & args,
+             int quality, std::string & oError)
+{
+    if (t->modify) return t->modify(image, args, quality, oError);
+
+    Image * i = t->transform(image, args, quality, oError);
+    DestroyImage(image);
+    return i;
+}
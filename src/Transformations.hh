@@ -8,16 +8,86 @@
 #include "service.hh"
 #include "bptypeutil.hh"
 
+#include <vector>
+
 #include <magick/api.h>
     
 namespace trans {
+    /**
+     *  The arguments to a transformation, parsed and validated before
+     *  any image is read.  Which members are meaningful depends on the
+     *  transformation.
+     */
+    struct Args {
+        Args() : present(false), number(0.0), maxwidth(-1), maxheight(-1)
+        {
+            crop[0] = crop[1] = crop[2] = crop[3] = 0.0;
+        }
+        // were arguments supplied?
+        bool present;
+        // a single numeric argument, or its default
+        double number;
+        // scale and thumbnail limits, -1 if unconstrained
+        int maxwidth, maxheight;
+        // crop rectangle x1, y1, x2, y2 relative to the upper left
+        double crop[4];
+    };
+
+    /**
+     *  Transformations which take arguments supply a parser, which
+     *  validates args (NULL if none were supplied) and populates parsed.
+     *  Returns false and populates oError if args are invalid.
+     */
+    typedef bool (*ArgsParser)(const bp::Object * args, Args & parsed,
+                               std::string & oError);
+
     /**
      *  All image processing phases conform to this signature:
      */
     typedef Image * (*TransformationFunc)(const Image * inImage,
-                                          const bp::Object * args,
+                                          const Args & args,
                                           int quality, std::string &oError);
 
+    /**
+     *  Transformations which would otherwise begin by copying their input
+     *  instead take ownership of the image they're handed, and modify it
+     *  in place.  Returns the result (usually image itself), or NULL on
+     *  error with oError populated.  Either way image belongs to the
+     *  transformation, which destroys it if it isn't returned.
+     */
+    typedef Image * (*ModifyFunc)(Image * image, const Args & args,
+                                  int quality, std::string &oError);
+
+    /**
+     *  Transformations which compute each output pixel from the same
+     *  input pixel alone may also supply a row kernel, which modifies
+     *  a row of pixels in place.  Runs of row local transformations are
+     *  streamed through the image together, one row at a time, rather
+     *  than each producing a whole intermediate image.
+     */
+    typedef void (*RowKernel)(PixelPacket * pixels, long npixels);
+
+    /**
+     *  Point operations which map each red, green and blue sample through
+     *  the same function may supply it as a channel map.  Runs of channel
+     *  maps are composed into a single lookup table.
+     */
+    typedef Quantum (*ChannelMap)(Quantum value);
+
+    /**
+     *  How a transformation relates to a downscale which follows it.
+     *  Only transformations which preserve the dimensions of the image
+     *  may commute.
+     */
+    typedef enum {
+        // may not be reordered
+        KeepsOrder = 0,
+        // the result is the same either way, apart from rounding
+        Commutes,
+        // the result is similar either way
+        ApproxCommutes
+    } Commutation;
+
     typedef struct {
         // the name of the transformation (as a client would specify it)
         const char * name;
@@ -25,15 +95,157 @@ namespace trans {
         bool acceptsArgs;
         // does this require arguments?
         bool requiresArgs;
-        // the function that actually performs work 
+        // parses arguments, NULL if they're ignored
+        ArgsParser parse;
+        // the function that actually performs work, NULL if modify is
+        // supplied instead
         TransformationFunc transform;
         // documentation
         const char * doc;
+        // row local equivalent of transform, NULL for most
+        RowKernel rowKernel;
+        // per sample equivalent of transform, NULL for most
+        ChannelMap channelMap;
+        // may a following downscale be moved ahead of this?
+        Commutation downscale;
+        // for neighbourhood filters which may be applied to bands of the
+        // image independently, the distance in pixels beyond which input
+        // pixels don't affect an output pixel.  0 if it can't be banded
+        unsigned int halo;
+        // performs work upon an image the caller gives up, NULL if
+        // transform is supplied instead
+        ModifyFunc modify;
     } Transformation;
 
     unsigned int num();
     const Transformation * get(unsigned int);
     const Transformation * get(const std::string & name);
+
+    /** a transformation and its parsed arguments */
+    struct Step {
+        Step() : t(NULL) { }
+        const Transformation * t;
+        Args args;
+    };
+
+    /** a list of actions, resolved and validated */
+    typedef std::vector<Step> Plan;
+
+    /**
+     *  Compile a list of actions into a plan.  Fails, populating oError,
+     *  if any action is malformed, unknown, or has invalid arguments.
+     *  Consecutive right angle rotations are folded into one, and those
+     *  which sum to a multiple of 360 degrees are dropped.
+     */
+    bool compile(const bp::List & actions, Plan & plan,
+                 std::string & oError);
+
+    /** how aggressively optimize() may rewrite a plan */
+    typedef enum {
+        NoOptimization = 0,
+        // only where the result is the same, apart from rounding
+        SafeOptimization,
+        // also where the result is merely similar.  JPEGs may also be
+        // decoded at reduced size for downscales moved to the front
+        FastOptimization
+    } Optimization;
+
+    /**
+     *  Move downscales (scale and thumbnail) as early in a plan as level
+     *  allows, so that the steps they're moved ahead of process output
+     *  rather than input pixels.  Each rewrite is logged.  Returns the
+     *  number of steps downscales were moved ahead of.
+     */
+    unsigned int optimize(Plan & plan, Optimization level);
+
+    /**
+     *  Generate a canonical string representation of an action list (or
+     *  any argument), suitable for use as a cache key.  Map keys are
+     *  sorted, and because action names, argument names and string
+     *  arguments are all matched case insensitively, strings are folded
+     *  to lower case.  Integers and doubles are kept distinct, as some
+     *  actions accept only one or the other.
+     */
+    std::string canonicalForm(const bp::Object * o);
+
+    /**
+     *  Can row kernels be applied to this image?  Only true color RGB
+     *  images may be modified a row at a time, colormapped images must
+     *  use the whole image transformation.
+     */
+    bool canStreamRows(const Image * inImage);
+
+    /**
+     *  A stage of a streamed row pass.  Either a row kernel, or a lookup
+     *  table of MaxRGB + 1 entries through which red, green and blue
+     *  samples are mapped.
+     */
+    struct RowStage {
+        RowStage() : kernel(NULL) { }
+        RowKernel kernel;
+        std::vector<Quantum> lut;
+    };
+
+    /**
+     *  Build a lookup table stage equivalent to applying n channel maps
+     *  in order.
+     */
+    RowStage composeChannelMaps(const ChannelMap * maps, unsigned int n);
+
+    /**
+     *  Apply stages, in order, to image in place in a single pass.  Each
+     *  row is run through every stage while it's still in cache.  Takes
+     *  ownership of image, returning it, or NULL on error with oError
+     *  populated.
+     */
+    Image * streamRows(Image * image,
+                       const std::vector<RowStage> & stages,
+                       std::string & oError);
+
+    /**
+     *  Perform t upon image, which the caller gives up.  Modified in
+     *  place where t allows, otherwise replaced by (and destroyed after
+     *  producing) a new image.  Returns NULL on error, with oError
+     *  populated.
+     */
+    Image * apply(const Transformation * t, Image * image,
+                  const Args & args, int quality, std::string & oError);
+
+    /**
+     *  Whether the first step of a plan is a downscale (scale or
+     *  thumbnail).  Downscales are never moved ahead of one another, so
+     *  one which begins a plan still begins it after optimize().
+     */
+    bool beginsWithDownscale(const Plan & plan);
+
+    /**
+     *  If the first step of a plan is a downscale (scale or thumbnail),
+     *  determine the dimensions it will produce when applied to an image
+     *  of columns x rows.  Returns the downscale, or NULL if the plan
+     *  doesn't begin with one.
+     */
+    const Transformation * leadingDownscale(const Plan & plan,
+                                            unsigned long columns,
+                                            unsigned long rows,
+                                            unsigned int & x,
+                                            unsigned int & y);
+
+    /**
+     *  If the first step of a plan is a crop, determine the rectangle it
+     *  will keep of an image of columns x rows, before clipping to the
+     *  image.  Returns false if the plan doesn't begin with one, or if
+     *  the rectangle is empty or begins outside the image.
+     */
+    bool leadingCrop(const Plan & plan,
+                     unsigned long columns, unsigned long rows,
+                     RectangleInfo & ri);
+
+    /**
+     *  Perform a downscale returned from leadingDownscale(), producing
+     *  an image of exactly x by y.
+     */
+    Image * downscale(const Transformation * t, const Image * inImage,
+                      unsigned int x, unsigned int y);
 };
 
 #endif
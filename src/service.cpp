@@ -35,6 +35,7 @@
 #include "bpurlutil.hh"
 #include "bpservicedescription.hh"
 
+#include "util/bppool.hh"
 #include "util/bpsync.hh"
 #include "util/bpthread.hh"
 #include "util/fileutil.hh"
@@ -44,12 +45,18 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 #include <fstream>
 
 #include <iostream>
 #include <list>
 #include <sstream>
+#include <vector>
+
+#ifdef WIN32
+#define strcasecmp _stricmp
+#endif
 
 const BPCFunctionTable * g_bpCoreFunctions = NULL;
 
@@ -57,6 +64,10 @@ struct SessionData {
     std::string tempDir;
 };
 
+// transformations run on a pool of worker threads, so that one slow
+// request doesn't hold up every other session
+static bp::thread::Pool s_workers;
+
 
 static int
 BPPAllocate(void ** instance, unsigned int, const BPElement * context)
@@ -88,82 +99,316 @@ BPPDestroy(void * instance)
 static void
 BPPShutdown(void)
 {
+    // let in flight transformations complete
+    s_workers.stop();
+
     // shutdown the GraphicsMagick engine.  vroom.
     imageproc::shutdown();
 }
 
-static void
-BPPInvoke(void * instance, const char * funcName,
-          unsigned int tid, const BPElement * elem)
+// extract the path of the 'file' argument, posting an error and returning
+// an empty string if it's unusable
+static std::string
+fileArgument(unsigned int tid, const bp::Object * args)
 {
-    assert(instance != NULL);
-    SessionData * sd = (SessionData *) instance;
+    std::string url = (*(args->get("file")));
+    std::string path = bp::urlutil::pathFromURL(url);
 
-    // confirm that they invoked the only function we got
-    if (0 != strcmp(funcName, "transform"))
+    if (path.empty())
     {
-        g_bpCoreFunctions->log(BP_ERROR, "invalid function invoked!");
+        g_bpCoreFunctions->log(
+            BP_ERROR, "can't parse file:// url: %s", url.c_str());
         g_bpCoreFunctions->postError(
-            tid, "bp.internalError",
-            "unknown function invoked");
-        return;
+            tid, "bp.fileAccessError", "invalid file URI");
     }
 
-    // XXX: we need to get a little thready here
-    
-    bp::Object * args = NULL;
-    if (elem) args = bp::Object::build(elem);
+    return path;
+}
 
-    // first we'll get the input file into a string
-    std::string url = (*(args->get("file")));
-    std::string path = bp::urlutil::pathFromURL(url);
+static void
+probe(unsigned int tid, const bp::Object * args)
+{
+    std::string path = fileArgument(tid, args);
+    if (path.empty()) return;
 
-    if (path.empty())
+    std::string err;
+    imageproc::ImageSummary summary;
+    if (!imageproc::ProbeImage(path, summary, err))
     {
+        if (err.empty()) err.append("unknown");
         g_bpCoreFunctions->log(
-            BP_ERROR, "can't parse file:// url: %s", url.c_str());
+            BP_ERROR, "couldn't probe image: %s", err.c_str());
         g_bpCoreFunctions->postError(
-            tid, "bp.fileAccessError", "invalid file URI");
-        if (args) delete args;
+            tid, "bp.probeFailed", err.c_str());
         return;
-    } 
-    
+    }
+
+    bp::Map m;
+    m.add("format", new bp::String(summary.format));
+    m.add("width", new bp::Integer(summary.width));
+    m.add("height", new bp::Integer(summary.height));
+    m.add("frames", new bp::Integer(summary.frames));
+    m.add("depth", new bp::Integer(summary.depth));
+    m.add("orientation", new bp::Integer(summary.orientation));
+    g_bpCoreFunctions->postResults(tid, m.elemPtr());
+}
+
+static void
+stats(unsigned int tid)
+{
+    bp::Map m;
+
+    bp::Map * workers = new bp::Map;
+    workers->add("threads", new bp::Integer(s_workers.size()));
+    workers->add("queued", new bp::Integer(s_workers.pending()));
+    m.add("workers", workers);
+
+    imageproc::ResultCache::Stats rs = imageproc::resultCacheStats();
+    bp::Map * results = new bp::Map;
+    results->add("hits", new bp::Integer(rs.hits));
+    results->add("misses", new bp::Integer(rs.misses));
+    results->add("entries", new bp::Integer(rs.entries));
+    results->add("bytes", new bp::Integer(rs.bytes));
+    results->add("capacity", new bp::Integer(rs.capacity));
+    m.add("resultCache", results);
+
+    imageproc::PlanCache::Stats ps = imageproc::planCacheStats();
+    bp::Map * plans = new bp::Map;
+    plans->add("hits", new bp::Integer(ps.hits));
+    plans->add("misses", new bp::Integer(ps.misses));
+    plans->add("entries", new bp::Integer(ps.entries));
+    plans->add("capacity", new bp::Integer(ps.capacity));
+    m.add("planCache", plans);
+
+    imageproc::ResourceGovernor::Stats gs = imageproc::resourceStats();
+    bp::Map * resources = new bp::Map;
+    resources->add("admitted", new bp::Integer(gs.admitted));
+    resources->add("spilled", new bp::Integer(gs.spilled));
+    resources->add("rejected", new bp::Integer(gs.rejected));
+    resources->add("reserved", new bp::Integer(gs.reserved));
+    resources->add("peak", new bp::Integer(gs.peak));
+    resources->add("memory", new bp::Integer(gs.memory));
+    resources->add("map", new bp::Integer(gs.map));
+    resources->add("disk", new bp::Integer(gs.disk));
+    bp::Map * limits = new bp::Map;
+    limits->add("memory", new bp::Integer(gs.limits.memory));
+    limits->add("map", new bp::Integer(gs.limits.map));
+    limits->add("disk", new bp::Integer(gs.limits.disk));
+    limits->add("pixels", new bp::Integer(gs.limits.pixels));
+    limits->add("requestMemory", new bp::Integer(gs.limits.requestMemory));
+    limits->add("requestPixels", new bp::Integer(gs.limits.requestPixels));
+    resources->add("limits", limits);
+    m.add("resources", resources);
+
+    bp::mem::BufferPool::Stats bs = imageproc::bufferPoolStats();
+    bp::Map * buffers = new bp::Map;
+    buffers->add("hits", new bp::Integer(bs.hits));
+    buffers->add("misses", new bp::Integer(bs.misses));
+    buffers->add("retained", new bp::Integer(bs.retained));
+    buffers->add("outstanding", new bp::Integer(bs.outstanding));
+    buffers->add("trimmed", new bp::Integer(bs.trimmed));
+    buffers->add("capacity", new bp::Integer(bs.capacity));
+    m.add("bufferPool", buffers);
+
+    g_bpCoreFunctions->postResults(tid, m.elemPtr());
+}
+
+// extract format, quality, actions and optimization from the arguments to
+// a transform (or one output of transformMany), posting an error and
+// returning false if they're unusable.  actions will be NULL if absent
+static bool
+outputArguments(unsigned int tid, const bp::Object * args,
+                imageproc::Type & format, int & quality,
+                const bp::List * & actions,
+                trans::Optimization & optimize)
+{
     // now let's figure out the output format
-    imageproc::Type t = imageproc::UNKNOWN;
+    format = imageproc::UNKNOWN;
     if (args->has("format")) {
-        t = imageproc::pathToType(*(args->get("format")));
+        format = imageproc::pathToType(*(args->get("format")));
 
-        if (t == imageproc::UNKNOWN)
+        if (format == imageproc::UNKNOWN)
         {
             g_bpCoreFunctions->log(
                 BP_ERROR, "can't determine output format");
             g_bpCoreFunctions->postError(
                 tid, "bp.invalidArguments", "can't determine output format");
-            if (args) delete args;
-            return;
+            return false;
         } 
     }
 
     // extract quality argument
-    int quality = IA_DEFAULT_QUALITY;
+    quality = IA_DEFAULT_QUALITY;
     if (args->has("quality", BPTInteger)) {
         quality = (int)
             (long long)*((const bp::Integer *)(args->get("quality")));
     }
 
     // finally, let's pull out the list of transformation actions
-    bp::List emptyList;
-    bp::List * lPtr = &emptyList;
+    actions = NULL;
+    if (args->has("actions", BPTList)) {
+        actions = (const bp::List *) args->get("actions");
+    } else if (args->has("actions")) {
+        g_bpCoreFunctions->postError(
+            tid, "bp.invalidArguments", "actions must be an array");
+        return false;
+    }
+
+    // and whether they may be reordered
+    optimize = trans::NoOptimization;
+    if (args->has("optimize")) {
+        std::string level;
+        if (args->has("optimize", BPTString)) {
+            level = (std::string) *(args->get("optimize"));
+        }
+        if (!strcasecmp(level.c_str(), "safe")) {
+            optimize = trans::SafeOptimization;
+        } else if (!strcasecmp(level.c_str(), "fast")) {
+            optimize = trans::FastOptimization;
+        } else {
+            g_bpCoreFunctions->postError(
+                tid, "bp.invalidArguments",
+                "optimize must be 'safe' or 'fast'");
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// describe where the time went in producing an image
+static bp::Map *
+timingsMap(const imageproc::Timings & t)
+{
+    bp::Map * m = new bp::Map;
+    m->add("read", new bp::Double(t.read));
+    m->add("lossless", new bp::Double(t.lossless));
+    m->add("decode", new bp::Double(t.decode));
+    bp::List * actions = new bp::List;
+    for (unsigned int i = 0; i < t.actions.size(); i++) {
+        bp::Map * a = new bp::Map;
+        a->add("name", new bp::String(t.actions[i].name));
+        a->add("ms", new bp::Double(t.actions[i].ms));
+        actions->append(a);
+    }
+    m->add("actions", actions);
+    m->add("encode", new bp::Double(t.encode));
+    m->add("total", new bp::Double(t.total));
+    m->add("inputBytes", new bp::Integer(t.inputBytes));
+    m->add("outputBytes", new bp::Integer(t.outputBytes));
+    m->add("inputPixels", new bp::Integer(t.inputPixels));
+    m->add("outputPixels", new bp::Integer(t.outputPixels));
+    m->add("cached", new bp::Bool(t.cached));
+    return m;
+}
+
+// does the client want timings?
+static bool
+timingsArgument(const bp::Object * args)
+{
+    return (args->has("timings", BPTBoolean) &&
+            *((const bp::Bool *) args->get("timings")));
+}
+
+static void
+transformMany(const std::string & tempDir, unsigned int tid,
+              const bp::Object * args)
+{
+    std::string path = fileArgument(tid, args);
+    if (path.empty()) return;
+
+    if (!args->has("outputs", BPTList)) {
+        g_bpCoreFunctions->postError(
+            tid, "bp.invalidArguments", "outputs must be an array");
+        return;
+    }
+
+    const bp::List * l = (const bp::List *) args->get("outputs");
+    std::vector<imageproc::OutputSpec> outputs(l->size());
+    for (unsigned int i = 0; i < l->size(); i++) {
+        if (l->value(i)->type() != BPTMap) {
+            g_bpCoreFunctions->postError(
+                tid, "bp.invalidArguments",
+                "each output must be an object");
+            return;
+        }
+        if (!outputArguments(tid, l->value(i), outputs[i].format,
+                             outputs[i].quality, outputs[i].actions,
+                             outputs[i].optimize))
+        {
+            return;
+        }
+    }
+
+    bool timings = timingsArgument(args);
+
+    std::string err;
+    std::vector<imageproc::OutputResult> results;
+    if (!imageproc::ChangeImageMulti(path, tempDir, outputs, results, err))
+    {
+        if (err.empty()) err.append("unknown");
+        g_bpCoreFunctions->log(
+            BP_ERROR, "couldn't transform image: %s", err.c_str());
+        g_bpCoreFunctions->postError(
+            tid, "bp.transformFailed", err.c_str());
+        return;
+    }
+
+    bp::List rl;
+    for (unsigned int i = 0; i < results.size(); i++) {
+        const imageproc::OutputResult & r = results[i];
+        bp::Map * m = new bp::Map;
+        if (r.path.empty()) {
+            m->add("error", new bp::String(r.error));
+        } else {
+            m->add("file", new bp::Path(r.path));
+            m->add("width", new bp::Integer(r.x));
+            m->add("height", new bp::Integer(r.y));
+            m->add("orig_width", new bp::Integer(r.orig_x));
+            m->add("orig_height", new bp::Integer(r.orig_y));
+            m->add("peak_memory", new bp::Integer(r.usage.peak));
+            m->add("spilled", new bp::Bool(r.usage.spilled));
+            if (timings) m->add("timings", timingsMap(r.timings));
+        }
+        rl.append(m);
+    }
+    g_bpCoreFunctions->postResults(tid, rl.elemPtr());
+}
+
+static void
+transform(const std::string & tempDir, unsigned int tid,
+          const bp::Object * args)
+{
+    // first we'll get the input file into a string
+    std::string path = fileArgument(tid, args);
+    if (path.empty()) return;
     
-    if (args->has("actions")) lPtr = (bp::List *) args->get("actions");
+    imageproc::Type t = imageproc::UNKNOWN;
+    int quality = IA_DEFAULT_QUALITY;
+    const bp::List * lPtr = NULL;
+    trans::Optimization optimize = trans::NoOptimization;
+    if (!outputArguments(tid, args, t, quality, lPtr, optimize)) return;
+
+    // no actions is just a format conversion
+    bp::List emptyList;
+    if (!lPtr) lPtr = &emptyList;
+
+    // may rotations and crops of JPEG images skip decoding?
+    bool lossless = false;
+    if (args->has("lossless", BPTBoolean)) {
+        lossless = *((const bp::Bool *) args->get("lossless"));
+    }
 
     std::string err;
 
 
     unsigned int x, y, orig_x, orig_y;
+    imageproc::ResourceUsage usage;
+    imageproc::Timings timings;
     std::string rez =
-        imageproc::ChangeImage(path, sd->tempDir, t, *lPtr, quality,
-                               x, y, orig_x, orig_y, err);
+        imageproc::ChangeImage(path, tempDir, t, *lPtr, quality, lossless,
+                               optimize, x, y, orig_x, orig_y, usage,
+                               timings, err);
     
     if (rez.empty())
     {
@@ -183,13 +428,69 @@ BPPInvoke(void * instance, const char * funcName,
         m.add("height", new bp::Integer(y));
         m.add("orig_width", new bp::Integer(orig_x));
         m.add("orig_height", new bp::Integer(orig_y));
+        m.add("peak_memory", new bp::Integer(usage.peak));
+        m.add("spilled", new bp::Bool(usage.spilled));
+        if (timingsArgument(args)) m.add("timings", timingsMap(timings));
         g_bpCoreFunctions->postResults(tid, m.elemPtr());
     }
-    
+}
+
+// a transformation waiting for a worker thread.  Everything the
+// worker needs is copied, as the session may go away before it runs.
+struct TransformJob {
+    // transform or transformMany
+    void (*func)(const std::string &, unsigned int, const bp::Object *);
+    unsigned int tid;
+    std::string tempDir;
+    bp::Object * args;
+};
+
+static void
+runTransformJob(void * cookie)
+{
+    TransformJob * job = (TransformJob *) cookie;
+    job->func(job->tempDir, job->tid, job->args);
+    if (job->args) delete job->args;
+    delete job;
+}
+
+static void
+BPPInvoke(void * instance, const char * funcName,
+          unsigned int tid, const BPElement * elem)
+{
+    assert(instance != NULL);
+    SessionData * sd = (SessionData *) instance;
+
+    bp::Object * args = NULL;
+    if (elem) args = bp::Object::build(elem);
+
+    if (!strcmp(funcName, "transform") ||
+        !strcmp(funcName, "transformMany"))
+    {
+        TransformJob * job = new TransformJob;
+        job->func = (!strcmp(funcName, "transform") ? transform
+                                                     : transformMany);
+        job->tid = tid;
+        job->tempDir = sd->tempDir;
+        job->args = args;
+        args = NULL;
+        // if the pool isn't available, do the work on this thread
+        if (!s_workers.post(runTransformJob, (void *) job)) {
+            runTransformJob((void *) job);
+        }
+    } else if (!strcmp(funcName, "probe")) {
+        probe(tid, args);
+    } else if (!strcmp(funcName, "stats")) {
+        stats(tid);
+    } else {
+        g_bpCoreFunctions->log(BP_ERROR, "invalid function invoked!");
+        g_bpCoreFunctions->postError(
+            tid, "bp.internalError",
+            "unknown function invoked");
+    }
+
     if (args) delete args;
     args = NULL;
-
-    return;
 }
 
 const BPCoreletDefinition *
@@ -203,8 +504,8 @@ BPPInitialize(const BPCFunctionTable * bpCoreFunctions,
         s_initd = true;
         s_desc.setName("ImageAlter");
         s_desc.setMajorVersion(4);
-        s_desc.setMinorVersion(0);
-        s_desc.setMicroVersion(5);
+        s_desc.setMinorVersion(2);
+        s_desc.setMicroVersion(0);
         s_desc.setDocString("Implements client side Image manipulation");
 
         // let's add functions, start with 'transform'
@@ -213,7 +514,8 @@ BPPInitialize(const BPCFunctionTable * bpCoreFunctions,
         // arguments 
         std::list<bp::service::Argument> as;
 
-        bp::service::Argument file, actions, format, quality;
+        bp::service::Argument file, actions, format, quality, lossless,
+            optimize, timings;
         file.setName("file");
         file.setRequired(true);
         file.setType(bp::service::Argument::Path);
@@ -265,6 +567,48 @@ BPPInitialize(const BPCFunctionTable * bpCoreFunctions,
         actions.setDocString(ss.str().c_str());
         as.push_back(actions);
 
+        lossless.setName("lossless");
+        lossless.setRequired(false);
+        lossless.setType(bp::service::Argument::Boolean);
+        lossless.setDocString("When true, and both the input and output "
+                              "are JPEG images, rotations by multiples of "
+                              "90 degrees and crops are performed without "
+                              "decoding, so no quality is lost.  Crops are "
+                              "widened to the nearest 8 or 16 pixel "
+                              "boundary, and partial blocks at the image "
+                              "edge may be trimmed (default: false)");
+        as.push_back(lossless);
+
+        optimize.setName("optimize");
+        optimize.setRequired(false);
+        optimize.setType(bp::service::Argument::String);
+        optimize.setDocString("Allow scale and thumbnail actions to be "
+                              "moved ahead of earlier actions, so that "
+                              "those work on fewer pixels.  'safe' moves "
+                              "them only ahead of actions which give the "
+                              "same result either way (i.e. negate), "
+                              "'fast' also ahead of filters and color "
+                              "adjustments which give a similar result "
+                              "(i.e. sharpen, blur, sepia, contrast, "
+                              "grayscale), and "
+                              "lets JPEGs be decoded at reduced size for "
+                              "a downscale moved to the front, which "
+                              "gives slightly different pixels (as it "
+                              "always does for actions which begin with "
+                              "a downscale).  Default is to perform "
+                              "actions in the order given.");
+        as.push_back(optimize);
+
+        timings.setName("timings");
+        timings.setRequired(false);
+        timings.setType(bp::service::Argument::Boolean);
+        timings.setDocString("When true, the result includes a 'timings' "
+                             "object giving the milliseconds spent "
+                             "reading, decoding, on each action, and "
+                             "encoding and writing the output, along with "
+                             "the bytes and pixels in and out.");
+        as.push_back(timings);
+
         bp::service::Function f;
         f.setName("transform");
         f.setDocString("Perform a set of transformations on an input image");
@@ -272,6 +616,62 @@ BPPInitialize(const BPCFunctionTable * bpCoreFunctions,
 
         fs.push_back(f);
 
+        // 'transformMany' takes a file and a list of outputs, each of
+        // which has the same format, quality and actions as transform
+        as.clear();
+        as.push_back(file);
+
+        bp::service::Argument outputs;
+        outputs.setName("outputs");
+        outputs.setRequired(true);
+        outputs.setType(bp::service::Argument::List);
+        outputs.setDocString("An array of outputs to generate.  Each is an "
+                             "object which may contain 'format', "
+                             "'quality', 'actions' and 'optimize' "
+                             "properties, as accepted by transform.");
+        as.push_back(outputs);
+        as.push_back(timings);
+
+        f.setName("transformMany");
+        f.setDocString("Generate several images from one input, which is "
+                       "read only once.  Outputs that are a single scale "
+                       "or thumbnail are each generated from the next "
+                       "larger one.  Returns an array with a result per "
+                       "output, in order, each like that of transform, or "
+                       "an object with an 'error' property if that output "
+                       "couldn't be generated.");
+        f.setArguments(as);
+
+        fs.push_back(f);
+
+        // now 'probe', which takes only a file
+        as.clear();
+        as.push_back(file);
+
+        f.setName("probe");
+        f.setDocString("Quickly describe an image without decoding it.  "
+                       "Returns its format, width, height, number of "
+                       "frames, bit depth, and EXIF orientation (1-8).");
+        f.setArguments(as);
+
+        fs.push_back(f);
+
+        // and 'stats', which takes nothing
+        as.clear();
+
+        f.setName("stats");
+        f.setDocString("Report on the internal state of the service: "
+                       "worker threads and queued transformations, "
+                       "hits, misses and utilization of the result "
+                       "and plan caches, requests admitted, spilled "
+                       "and rejected by the resource governor along "
+                       "with its limits and the memory, map and disk "
+                       "in use, and hits, misses, retained and "
+                       "outstanding bytes of the pixel buffer pool.");
+        f.setArguments(as);
+
+        fs.push_back(f);
+
         s_desc.setFunctions(fs);
     }
     
@@ -280,6 +680,16 @@ BPPInitialize(const BPCFunctionTable * bpCoreFunctions,
     // initialize the GraphicsMagick engine.  vroom.
     imageproc::init();
 
+    // now that the engine is initialized, spin up workers
+    {
+        unsigned int n = bp::thread::Thread::numProcessors();
+        if (n > IA_MAX_WORKERS) n = IA_MAX_WORKERS;
+        if (s_workers.start(n)) {
+            g_bpCoreFunctions->log(
+                BP_INFO, "%u worker threads started", s_workers.size());
+        }
+    }
+
     return s_desc.toBPCoreletDefinition();
 }
 
@@ -8,6 +8,50 @@
 
 #define IA_DEFAULT_QUALITY 75
 
+// the maximum number of transformations that may run concurrently.  the
+// worker pool is sized to the lesser of this and the number of processors
+#define IA_MAX_WORKERS 8
+
+// bytes of encoded output held in memory to satisfy repeated identical
+// transform requests without decoding (zero disables)
+#define IA_RESULT_CACHE_BYTES (32 * 1024 * 1024)
+
+// compiled action lists retained, so that repeated pipelines needn't be
+// parsed and validated again (zero disables)
+#define IA_PLAN_CACHE_ENTRIES 256
+
+// bytes of decoded pixels (at 16 bits a sample, 8 bytes a pixel) held on
+// the heap by all requests together.  beyond this GraphicsMagick moves
+// pixel caches to memory mapped files, and beyond IA_MAP_BYTES to plain
+// files, up to IA_DISK_BYTES (zero is unlimited).  sized so that every
+// worker may hold a 32 megapixel photo, twice over as a stage holds both
+// its input and its output
+#define IA_MEMORY_BYTES (IA_MAX_WORKERS * 32ULL * 1024 * 1024 * 8 * 2)
+#define IA_MAP_BYTES (2048ULL * 1024 * 1024)
+#define IA_DISK_BYTES (8192ULL * 1024 * 1024)
+
+// pixels in any one image that GraphicsMagick will allocate (zero is
+// unlimited)
+#define IA_PIXELS (256ULL * 1024 * 1024)
+
+// a single request may hold an equal share of IA_MEMORY_BYTES among the
+// workers on the heap.  larger requests run one at a time with their
+// pixels on disk, in IA_SPILL_DIR within the system's temp dir
+#define IA_SPILL_DIR "ImageAlter-spill"
+
+// pixels a single request may decode, summed over frames.  larger
+// requests fail (zero is unlimited)
+#define IA_REQUEST_PIXELS (512ULL * 1024 * 1024)
+
+// allocations of at least IA_BUFFER_POOL_MIN_BYTES (decoded pixels,
+// mostly) are drawn from a pool, which retains up to IA_BUFFER_POOL_BYTES
+// of freed buffers for reuse.  retained buffers are returned to the
+// system after IA_BUFFER_POOL_IDLE_MS without an allocation (zero
+// disables retention)
+#define IA_BUFFER_POOL_BYTES (256 * 1024 * 1024)
+#define IA_BUFFER_POOL_MIN_BYTES (1024 * 1024)
+#define IA_BUFFER_POOL_IDLE_MS 10000
+
 extern const BPCFunctionTable * g_bpCoreFunctions;
 
 #endif
@@ -0,0 +1,738 @@
+/*
+ * Copyright 2009, Yahoo!
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ * 
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ * 
+ *  3. Neither the name of Yahoo! nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * ImageAlterBatch - converts many images at once, outside of BrowserPlus.
+ *
+ * Every image in the input directories (recursively), or named in a list
+ * file, is transformed by the same actions into the output directory,
+ * where the input's layout is mirrored.  Images are converted by a
+ * number of worker threads, each admitted only when the pixels it's
+ * expected to decode fit within a memory budget shared by all of them.
+ * The budget is also the service's own ceiling upon pixel caches held
+ * in memory, so a single input too large for it spills to disk.
+ *
+ * Results are written to a temporary directory within the output and
+ * moved into place once complete, so an output file is never partial.
+ * Each completed (or failed) input is then appended to a journal, and a
+ * run that's interrupted may be resumed by running it again: inputs in
+ * the journal are skipped.
+ */
+
+#include "service.hh"
+#include "bptypeutil.hh"
+
+#include "util/bpjson.hh"
+#include "util/bpsync.hh"
+#include "util/bpthread.hh"
+#include "util/bptime.hh"
+#include "util/fileutil.hh"
+
+#include "ImageProcessor.hh"
+#include "Transformations.hh"
+#include "ToolSupport.hh"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <set>
+#include <sstream>
+#include <vector>
+
+#ifdef WIN32
+#define strcasecmp _stricmp
+#endif
+
+// entries in the output directory which belong to us, and are never
+// taken for input
+#define BATCH_PREFIX ".ImageAlterBatch"
+
+// an image to convert
+struct Job {
+    // where to read it
+    std::string path;
+    // where to write it, relative to the output directory, with the
+    // input's extension.  Also identifies it in the journal
+    std::string key;
+};
+
+struct Options {
+    Options() : threads(0), memory(IA_MEMORY_BYTES), format(NULL),
+                quality(IA_DEFAULT_QUALITY), lossless(false),
+                optimize(trans::NoOptimization), retry(false),
+                progress(5), verbose(false) { }
+    unsigned int threads;
+    unsigned long long memory;
+    std::string actions;
+    std::string formatName;
+    imageproc::Type format;
+    unsigned int quality;
+    bool lossless;
+    trans::Optimization optimize;
+    std::string output;
+    std::string journal;
+    std::string list;
+    std::string root;
+    bool retry;
+    unsigned int progress;
+    bool verbose;
+    std::vector<std::string> inputs;
+};
+
+static Options s_opts;
+static bp::List * s_actions = NULL;
+static std::string s_tempDir;
+
+// protects everything below, and is signaled when the queue or the
+// memory in flight changes, or a worker exits
+static bp::sync::Mutex s_lock;
+static bp::sync::Condition s_changed;
+
+static std::deque<Job> s_queue;
+static unsigned int s_queueLimit = 0;
+// no more jobs will be queued
+static bool s_exhausted = false;
+static unsigned int s_activeWorkers = 0;
+// estimated bytes of pixels held by conversions under way
+static unsigned long long s_inFlight = 0;
+
+// keys of inputs which needn't be converted again
+static std::set<std::string> s_finished;
+static FILE * s_journal = NULL;
+
+static unsigned long long s_converted = 0;
+static unsigned long long s_failed = 0;
+static unsigned long long s_skipped = 0;
+static unsigned long long s_bytesIn = 0;
+static unsigned long long s_bytesOut = 0;
+
+static bp::time::Stopwatch s_clock;
+static double s_lastProgress = 0.0;
+
+static void
+batchPostResults(unsigned int, const BPElement *)
+{
+}
+
+static void
+batchPostError(unsigned int, const char *, const char *)
+{
+}
+
+static void
+batchLog(unsigned int level, const char * fmt, ...)
+{
+    if (!s_opts.verbose && level != BP_ERROR) return;
+
+    va_list ap;
+    va_start(ap, fmt);
+    fprintf(stderr, "[%u] ", level);
+    vfprintf(stderr, fmt, ap);
+    fprintf(stderr, "\n");
+    va_end(ap);
+}
+
+// report progress, if it's time.  s_lock must be held
+static void
+progress(bool force)
+{
+    double now = s_clock.elapsedMS();
+    if (!force && (!s_opts.progress ||
+                   now - s_lastProgress < s_opts.progress * 1000.0))
+    {
+        return;
+    }
+    s_lastProgress = now;
+
+    double secs = now / 1000.0;
+    char line[256];
+    sprintf(line, "%8.1fs %10llu converted %8llu failed %10llu skipped "
+            "%8.1f/s %8.1f MB/s in, %llu MB in flight",
+            secs, s_converted, s_failed, s_skipped,
+            (secs > 0.0 ? s_converted / secs : 0.0),
+            (secs > 0.0 ? s_bytesIn / secs / (1024 * 1024) : 0.0),
+            s_inFlight / (1024 * 1024));
+    std::cerr << line << std::endl;
+}
+
+// read the journal of an earlier run, so that what it finished may be
+// skipped.  Lines are "ok<TAB>key" or "failed<TAB>key<TAB>error".  A
+// line without a newline was cut short by a crash, and is ignored
+static bool
+loadJournal(const std::string & path)
+{
+    FILE * f = fopen(path.c_str(), "rb");
+    if (!f) return true;
+
+    std::string line;
+    int c;
+    while ((c = fgetc(f)) != EOF) {
+        if (c != '\n') {
+            line += (char) c;
+            continue;
+        }
+        size_t tab = line.find('\t');
+        if (tab != std::string::npos) {
+            std::string status = line.substr(0, tab);
+            std::string key = line.substr(tab + 1);
+            size_t end = key.find('\t');
+            if (end != std::string::npos) key.erase(end);
+            if (status == "ok") {
+                s_finished.insert(key);
+            } else if (status == "failed") {
+                if (s_opts.retry) s_finished.erase(key);
+                else s_finished.insert(key);
+            }
+        }
+        line.clear();
+    }
+    fclose(f);
+    return true;
+}
+
+// note the outcome of a job in the journal.  s_lock must be held
+static void
+record(const Job & job, bool ok, const std::string & error)
+{
+    if (ok) s_converted++;
+    else s_failed++;
+
+    if (!s_journal) return;
+    if (ok) {
+        fprintf(s_journal, "ok\t%s\n", job.key.c_str());
+    } else {
+        std::string e(error);
+        for (size_t i = 0; i < e.size(); i++) {
+            if (e[i] == '\n' || e[i] == '\r' || e[i] == '\t') e[i] = ' ';
+        }
+        fprintf(s_journal, "failed\t%s\t%s\n", job.key.c_str(), e.c_str());
+    }
+    // a crash may lose work under way, but not work that's recorded
+    fflush(s_journal);
+}
+
+// wait until need bytes fit within the memory budget, and claim them.
+// A job is always admitted when nothing else is in flight, however
+// large it is
+static void
+reserve(unsigned long long need)
+{
+    bp::sync::Lock l(s_lock);
+    while (s_inFlight > 0 && s_inFlight + need > s_opts.memory) {
+        s_changed.wait(&s_lock);
+    }
+    s_inFlight += need;
+}
+
+static void
+release(unsigned long long need)
+{
+    bp::sync::Lock l(s_lock);
+    s_inFlight -= need;
+    s_changed.broadcast();
+}
+
+// create the directories leading to key within the output directory
+static bool
+makeParents(const std::string & key)
+{
+    size_t sep = 0;
+    while ((sep = key.find_first_of("/\\", sep)) != std::string::npos) {
+        if (sep > 0 &&
+            !ft::mkdir(ft::pathAppend(s_opts.output, key.substr(0, sep)),
+                       false))
+        {
+            return false;
+        }
+        sep++;
+    }
+    return true;
+}
+
+// where the output of a job goes
+static std::string
+destination(const Job & job)
+{
+    std::string key = job.key;
+    if (s_opts.format != imageproc::UNKNOWN) {
+        size_t dot = key.rfind('.');
+        size_t sep = key.find_last_of("/\\");
+        if (dot != std::string::npos &&
+            (sep == std::string::npos || dot > sep))
+        {
+            key.erase(dot);
+        }
+        key += "." + imageproc::typeToExt(s_opts.format);
+    }
+    return ft::pathAppend(s_opts.output, key);
+}
+
+// remove a result left in the temporary directory, and the directory
+// ft::getPath() created for it
+static void
+discard(const std::string & path)
+{
+    (void) ft::remove(path);
+    (void) ft::remove(tools::dirName(path));
+}
+
+static bool
+convert(const Job & job, std::string & oError)
+{
+    // estimate the pixels to be held, as the decoded input and a
+    // result of the same size
+    imageproc::ImageSummary summary;
+    if (!imageproc::ProbeImage(job.path, summary, oError)) return false;
+    unsigned long long need = (unsigned long long) summary.width *
+        summary.height * (summary.frames ? summary.frames : 1) *
+        sizeof(PixelPacket) * 2;
+
+    reserve(need);
+    unsigned int x, y, orig_x, orig_y;
+    imageproc::ResourceUsage usage;
+    imageproc::Timings timings;
+    std::string rez =
+        imageproc::ChangeImage(job.path, s_tempDir, s_opts.format,
+                               *s_actions, (int) s_opts.quality,
+                               s_opts.lossless, s_opts.optimize,
+                               x, y, orig_x, orig_y, usage, timings,
+                               oError);
+    release(need);
+    if (rez.empty()) {
+        if (oError.empty()) oError.append("unknown");
+        return false;
+    }
+
+    std::string dest = destination(job);
+    if (!makeParents(job.key) || !ft::rename(rez, dest)) {
+        discard(rez);
+        oError.append("can't move result to ");
+        oError.append(dest);
+        return false;
+    }
+    (void) ft::remove(tools::dirName(rez));
+
+    bp::sync::Lock l(s_lock);
+    s_bytesIn += timings.inputBytes;
+    s_bytesOut += timings.outputBytes;
+    return true;
+}
+
+static void *
+worker(void *)
+{
+    for (;;) {
+        Job job;
+        {
+            bp::sync::Lock l(s_lock);
+            while (s_queue.empty() && !s_exhausted) {
+                s_changed.wait(&s_lock);
+            }
+            if (s_queue.empty()) break;
+            job = s_queue.front();
+            s_queue.pop_front();
+            s_changed.broadcast();
+        }
+
+        std::string err;
+        bool ok = convert(job, err);
+        if (!ok && s_opts.verbose) {
+            std::cerr << job.path << ": " << err << std::endl;
+        }
+
+        bp::sync::Lock l(s_lock);
+        record(job, ok, err);
+    }
+
+    bp::sync::Lock l(s_lock);
+    s_activeWorkers--;
+    s_changed.broadcast();
+    return NULL;
+}
+
+// queue a job, unless an earlier run finished it, waiting for room
+static void
+enqueue(const std::string & path, const std::string & key)
+{
+    bp::sync::Lock l(s_lock);
+    if (s_finished.count(key)) {
+        s_skipped++;
+        progress(false);
+        return;
+    }
+    while (s_queue.size() >= s_queueLimit) {
+        (void) s_changed.timeWait(&s_lock, 1000);
+        progress(false);
+    }
+    Job job;
+    job.path = path;
+    job.key = key;
+    s_queue.push_back(job);
+    s_changed.broadcast();
+}
+
+// queue every image beneath dir, whose path relative to the input
+// directory is rel
+static void
+walk(const std::string & dir, const std::string & rel,
+     const std::string & outputDir)
+{
+    std::vector<std::string> names;
+    if (!ft::readDirectory(dir, names)) {
+        std::cerr << "can't read directory " << dir << std::endl;
+        return;
+    }
+    for (unsigned int i = 0; i < names.size(); i++) {
+        if (names[i].compare(0, strlen(BATCH_PREFIX), BATCH_PREFIX) == 0) {
+            continue;
+        }
+        std::string p = ft::pathAppend(dir, names[i]);
+        std::string k = (rel.empty() ? names[i]
+                         : ft::pathAppend(rel, names[i]));
+        if (ft::isDirectory(p)) {
+            // don't descend into our own output
+            if (tools::absolutePath(p) != outputDir) walk(p, k, outputDir);
+        } else if (imageproc::pathToType(names[i]) != imageproc::UNKNOWN) {
+            enqueue(p, k);
+        }
+    }
+}
+
+// does key climb out of the directory it's relative to?
+static bool
+escapes(const std::string & key)
+{
+    size_t start = 0;
+    for (;;) {
+        size_t sep = key.find_first_of("/\\", start);
+        std::string part = key.substr(start, sep == std::string::npos
+                                      ? std::string::npos : sep - start);
+        if (part == "..") return true;
+        if (sep == std::string::npos) return false;
+        start = sep + 1;
+    }
+}
+
+// queue every image named in a list, one per line.  Relative paths are
+// found in the root directory, and are mirrored in the output
+static bool
+readList(const std::string & list)
+{
+    std::ifstream file;
+    std::istream * in = &std::cin;
+    if (list != "-") {
+        file.open(list.c_str());
+        if (!file) {
+            std::cerr << "can't open " << list << std::endl;
+            return false;
+        }
+        in = &file;
+    }
+
+    std::string line;
+    while (std::getline(*in, line)) {
+        if (!line.empty() && line[line.size() - 1] == '\r') {
+            line.erase(line.size() - 1);
+        }
+        if (line.empty() || line[0] == '#') continue;
+
+        std::string path = line;
+        std::string key = line;
+        if (tools::absolutePath(line) == line) {
+            // absolute paths are mirrored from the top of their volume
+            size_t start = (key.size() > 1 && key[1] == ':') ? 2 : 0;
+            start = key.find_first_not_of("/\\", start);
+            key = (start == std::string::npos ? "" : key.substr(start));
+        } else if (!s_opts.root.empty()) {
+            path = ft::pathAppend(s_opts.root, line);
+        }
+        if (key.empty()) continue;
+        if (escapes(key)) {
+            std::cerr << "skipping " << line << ", which is outside the "
+                      << "root" << std::endl;
+            continue;
+        }
+        enqueue(path, key);
+    }
+    return true;
+}
+
+// remove results left in the temporary directory by a run which crashed
+static void
+cleanTempDir()
+{
+    std::vector<std::string> dirs;
+    if (!ft::readDirectory(s_tempDir, dirs)) return;
+    for (unsigned int i = 0; i < dirs.size(); i++) {
+        std::string d = ft::pathAppend(s_tempDir, dirs[i]);
+        std::vector<std::string> files;
+        if (ft::readDirectory(d, files)) {
+            for (unsigned int j = 0; j < files.size(); j++) {
+                (void) ft::remove(ft::pathAppend(d, files[j]));
+            }
+        }
+        (void) ft::remove(d);
+    }
+}
+
+static void
+usage(const char * argv0)
+{
+    std::cerr
+        << "usage: " << argv0 << " [options] --output DIR "
+        << "<dir|image>... | --list FILE\n"
+        << "\n"
+        << "  --output DIR     where results are written, mirroring the\n"
+        << "                   layout of input directories\n"
+        << "  --list FILE      convert the images named in FILE, one per\n"
+        << "                   line ('-' for stdin)\n"
+        << "  --root DIR       where relative paths in the list are found\n"
+        << "  --actions JSON   the actions to perform, or @FILE to read\n"
+        << "                   them from FILE ([])\n"
+        << "  --format FMT     output format (that of each input)\n"
+        << "  --quality N      0-100, worst-best (" << IA_DEFAULT_QUALITY
+        << ")\n"
+        << "  --lossless       rotate and crop JPEGs without decoding\n"
+        << "  --optimize L     reorder downscales, 'safe' or 'fast'\n"
+        << "  --threads N      worker threads (one per processor)\n"
+        << "  --memory BYTES   pixels held at once, K, M or G suffixes\n"
+        << "                   allowed (" << (IA_MEMORY_BYTES >> 20)
+        << "M)\n"
+        << "  --journal FILE   record of completed inputs, for resuming\n"
+        << "                   (" BATCH_PREFIX ".journal in the output)\n"
+        << "  --retry          convert inputs which failed before again\n"
+        << "  --progress SECS  report progress every SECS, 0 never (5)\n"
+        << "  --verbose        show service log output and each failure\n";
+}
+
+int
+main(int argc, char ** argv)
+{
+    for (int i = 1; i < argc; i++) {
+        std::string a(argv[i]);
+        bool more = (i + 1 < argc);
+        bool ok = true;
+        if (a == "--output" && more) {
+            s_opts.output = argv[++i];
+        } else if (a == "--list" && more) {
+            s_opts.list = argv[++i];
+        } else if (a == "--root" && more) {
+            s_opts.root = argv[++i];
+        } else if (a == "--actions" && more) {
+            s_opts.actions = argv[++i];
+        } else if (a == "--format" && more) {
+            s_opts.formatName = argv[++i];
+        } else if (a == "--quality" && more) {
+            ok = (tools::parseCount(argv[++i], s_opts.quality) &&
+                  s_opts.quality <= 100);
+        } else if (a == "--lossless") {
+            s_opts.lossless = true;
+        } else if (a == "--optimize" && more) {
+            const char * level = argv[++i];
+            if (!strcasecmp(level, "safe")) {
+                s_opts.optimize = trans::SafeOptimization;
+            } else if (!strcasecmp(level, "fast")) {
+                s_opts.optimize = trans::FastOptimization;
+            } else {
+                ok = false;
+            }
+        } else if (a == "--threads" && more) {
+            ok = (tools::parseCount(argv[++i], s_opts.threads) &&
+                  s_opts.threads > 0);
+        } else if (a == "--memory" && more) {
+            ok = tools::parseBytes(argv[++i], s_opts.memory);
+        } else if (a == "--journal" && more) {
+            s_opts.journal = argv[++i];
+        } else if (a == "--retry") {
+            s_opts.retry = true;
+        } else if (a == "--progress" && more) {
+            ok = tools::parseCount(argv[++i], s_opts.progress);
+        } else if (a == "--verbose") {
+            s_opts.verbose = true;
+        } else if (!a.empty() && a[0] == '-') {
+            ok = false;
+        } else {
+            s_opts.inputs.push_back(a);
+        }
+        if (!ok) {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (s_opts.output.empty() ||
+        (s_opts.inputs.empty() && s_opts.list.empty()))
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    if (!s_opts.threads) {
+        s_opts.threads = bp::thread::Thread::numProcessors();
+    }
+
+    // imageproc logs through the core's function table
+    static BPCFunctionTable coreFunctions;
+    memset((void *) &coreFunctions, 0, sizeof(coreFunctions));
+    coreFunctions.coreletAPIVersion = BPP_CORELET_API_VERSION;
+    coreFunctions.postResults = batchPostResults;
+    coreFunctions.postError = batchPostError;
+    coreFunctions.log = batchLog;
+    g_bpCoreFunctions = &coreFunctions;
+
+    tools::findMagickConfig(argv[0]);
+    imageproc::init();
+    // every result is different, and each plan the same
+    imageproc::setResultCacheCapacity(0);
+
+    // inputs which don't fit in the budget whole are spilled, rather than
+    // exceeding it
+    {
+        imageproc::ResourceLimits limits = imageproc::resourceStats().limits;
+        limits.memory = s_opts.memory;
+        if (limits.requestMemory == 0 || limits.requestMemory > s_opts.memory)
+        {
+            limits.requestMemory = s_opts.memory;
+        }
+        imageproc::setResourceLimits(limits);
+    }
+
+    std::string err;
+    s_opts.format = imageproc::UNKNOWN;
+    if (!s_opts.formatName.empty()) {
+        s_opts.format = imageproc::pathToType(s_opts.formatName);
+        if (s_opts.format == imageproc::UNKNOWN) {
+            std::cerr << "unknown format: " << s_opts.formatName << "\n";
+            return 1;
+        }
+    }
+
+    // actions are validated before anything is converted
+    bp::Object * actions = NULL;
+    if (s_opts.actions.empty()) {
+        actions = new bp::List;
+    } else if (s_opts.actions[0] == '@') {
+        actions = bp::json::parseFile(s_opts.actions.substr(1), err);
+    } else {
+        actions = bp::json::parse(s_opts.actions, err);
+    }
+    trans::Plan plan;
+    if (!actions || actions->type() != BPTList ||
+        !trans::compile(*((const bp::List *) actions), plan, err))
+    {
+        std::cerr << "invalid actions: "
+                  << (err.empty() ? "must be an array" : err) << "\n";
+        return 1;
+    }
+    s_actions = (bp::List *) actions;
+
+    if (!ft::mkdir(s_opts.output, false)) {
+        std::cerr << "can't create " << s_opts.output << "\n";
+        return 1;
+    }
+    s_tempDir = ft::pathAppend(s_opts.output, BATCH_PREFIX ".tmp");
+    cleanTempDir();
+
+    if (s_opts.journal.empty()) {
+        s_opts.journal = ft::pathAppend(s_opts.output,
+                                        BATCH_PREFIX ".journal");
+    }
+    (void) loadJournal(s_opts.journal);
+    s_journal = fopen(s_opts.journal.c_str(), "ab");
+    if (!s_journal) {
+        std::cerr << "can't open journal " << s_opts.journal << "\n";
+        return 1;
+    }
+
+    // enough work is queued to keep every worker busy, no more, so that
+    // lists of millions of inputs aren't held in memory
+    s_queueLimit = s_opts.threads * 4;
+    std::vector<bp::thread::Thread *> threads;
+    for (unsigned int i = 0; i < s_opts.threads; i++) {
+        bp::thread::Thread * t = new bp::thread::Thread;
+        if (!t->run(worker, NULL)) {
+            delete t;
+            break;
+        }
+        threads.push_back(t);
+        bp::sync::Lock l(s_lock);
+        s_activeWorkers++;
+    }
+    if (threads.empty()) {
+        std::cerr << "couldn't start worker threads\n";
+        return 1;
+    }
+
+    s_clock.reset();
+    std::string outputDir = tools::absolutePath(s_opts.output);
+    for (unsigned int i = 0; i < s_opts.inputs.size(); i++) {
+        const std::string & in = s_opts.inputs[i];
+        if (ft::isDirectory(in)) {
+            walk(in, "", outputDir);
+        } else if (ft::isRegularFile(in)) {
+            std::string leaf = ft::basename(in);
+            enqueue(in, leaf.empty() ? in : leaf);
+        } else {
+            std::cerr << "can't find " << in << std::endl;
+        }
+    }
+    if (!s_opts.list.empty()) (void) readList(s_opts.list);
+
+    {
+        bp::sync::Lock l(s_lock);
+        s_exhausted = true;
+        s_changed.broadcast();
+        while (s_activeWorkers > 0) {
+            (void) s_changed.timeWait(&s_lock, 1000);
+            progress(false);
+        }
+        if (s_opts.progress) progress(true);
+    }
+    for (unsigned int i = 0; i < threads.size(); i++) {
+        threads[i]->join();
+        delete threads[i];
+    }
+
+    fclose(s_journal);
+    delete s_actions;
+    imageproc::shutdown();
+
+    std::cout << s_converted << " converted, " << s_failed << " failed, "
+              << s_skipped << " skipped (finished by an earlier run), "
+              << (s_bytesIn >> 20) << "MB in, " << (s_bytesOut >> 20)
+              << "MB out" << std::endl;
+
+    return (s_failed ? 2 : 0);
+}
@@ -0,0 +1,774 @@
+/*
+ * Copyright 2009, Yahoo!
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ * 
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ * 
+ *  3. Neither the name of Yahoo! nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * ImageAlterBench - replays transformations against the service
+ * in-process, without ServiceRunner, and reports latency and throughput.
+ *
+ * The service is driven through the same entry points BrowserPlus uses,
+ * with a stand-in core function table which records results as they're
+ * posted.  Latency runs from invocation until results (or an error) are
+ * posted, and so includes time spent queued for a worker thread, but not
+ * process I/O or JSON serialization.
+ *
+ * Inputs are test cases (JSON files of transform arguments, as in
+ * test/cases, whose 'file' names an image in the images directory),
+ * directories of test cases, or images, which are transformed with the
+ * arguments given by --args.  Cases with an 'outputs' array are run
+ * through transformMany.
+ */
+
+#include "service.hh"
+#include "bptypeutil.hh"
+#include "bpurlutil.hh"
+
+#include "util/bpjson.hh"
+#include "util/bpsync.hh"
+#include "util/bpthread.hh"
+#include "util/bptime.hh"
+#include "util/fileutil.hh"
+
+#include "ImageProcessor.hh"
+#include "ToolSupport.hh"
+
+#include <ServiceAPI/bppfunctions.h>
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <vector>
+
+#ifdef WIN32
+#define PATH_SEP "\\"
+#else
+#define PATH_SEP "/"
+#endif
+
+// a single invocation: the function, and its arguments
+struct Item {
+    Item() : args(NULL) { }
+    std::string name;
+    std::string function;
+    bp::Object * args;
+    // the expected output, if known (the .out file beside a test case)
+    std::string expected;
+};
+
+// what the service posted in response to an invocation
+struct Outcome {
+    Outcome() : done(false), ok(false), finished(0.0) { }
+    bool done;
+    bool ok;
+    std::string error;
+    std::vector<std::string> files;
+    // bp::time::nowMS() when results were posted
+    double finished;
+};
+
+struct Options {
+    Options() : warmup(1), reps(5), cache(false), verify(false),
+                json(false), verbose(false) { }
+    unsigned int warmup;
+    unsigned int reps;
+    std::vector<unsigned int> threads;
+    std::string images;
+    std::string args;
+    std::string temp;
+    bool cache;
+    bool verify;
+    bool json;
+    bool verbose;
+};
+
+static Options s_opts;
+
+// invocations awaiting results, by transaction id
+static bp::sync::Mutex s_lock;
+static bp::sync::Condition s_posted;
+static std::map<unsigned int, Outcome *> s_pending;
+static unsigned int s_nextTid = 1;
+
+// failures reported per run, beyond which they're only counted
+static const unsigned int s_maxErrors = 50;
+
+static const BPPFunctionTable * s_service = NULL;
+static void * s_session = NULL;
+
+static Outcome *
+claim(unsigned int tid)
+{
+    std::map<unsigned int, Outcome *>::iterator it = s_pending.find(tid);
+    if (it == s_pending.end()) return NULL;
+    return it->second;
+}
+
+static void
+benchPostResults(unsigned int tid, const BPElement * results)
+{
+    double now = bp::time::nowMS();
+    bp::Object * o = results ? bp::Object::build(results) : NULL;
+
+    bp::sync::Lock l(s_lock);
+    Outcome * out = claim(tid);
+    if (!out) {
+        delete o;
+        return;
+    }
+
+    // transform posts a map, transformMany a list of them
+    std::vector<const bp::Object *> maps;
+    if (o && o->type() == BPTMap) {
+        maps.push_back(o);
+    } else if (o && o->type() == BPTList) {
+        const bp::List * rl = (const bp::List *) o;
+        for (unsigned int i = 0; i < rl->size(); i++) {
+            maps.push_back(rl->value(i));
+        }
+    }
+    out->ok = true;
+    for (unsigned int i = 0; i < maps.size(); i++) {
+        if (maps[i]->type() != BPTMap) continue;
+        if (maps[i]->has("file")) {
+            out->files.push_back((std::string) (*(maps[i]->get("file"))));
+        } else if (maps[i]->has("error", BPTString)) {
+            out->ok = false;
+            out->error = (std::string) (*(maps[i]->get("error")));
+        }
+    }
+    delete o;
+
+    out->finished = now;
+    out->done = true;
+    s_posted.broadcast();
+}
+
+static void
+benchPostError(unsigned int tid, const char * error,
+               const char * verboseError)
+{
+    double now = bp::time::nowMS();
+
+    bp::sync::Lock l(s_lock);
+    Outcome * out = claim(tid);
+    if (!out) return;
+
+    out->ok = false;
+    out->error = (error ? error : "unknown");
+    if (verboseError) {
+        out->error.append(": ");
+        out->error.append(verboseError);
+    }
+    out->finished = now;
+    out->done = true;
+    s_posted.broadcast();
+}
+
+static void
+benchLog(unsigned int level, const char * fmt, ...)
+{
+    if (!s_opts.verbose) return;
+
+    va_list ap;
+    va_start(ap, fmt);
+    fprintf(stderr, "[%u] ", level);
+    vfprintf(stderr, fmt, ap);
+    fprintf(stderr, "\n");
+    va_end(ap);
+}
+
+// invoke the service and wait for it to post a result.  Returns the
+// latency in milliseconds.
+static double
+invoke(const Item & item, Outcome & out)
+{
+    unsigned int tid;
+    {
+        bp::sync::Lock l(s_lock);
+        tid = s_nextTid++;
+        s_pending[tid] = &out;
+    }
+
+    double start = bp::time::nowMS();
+    s_service->invokeFunc(s_session, item.function.c_str(), tid,
+                          item.args->elemPtr());
+
+    bp::sync::Lock l(s_lock);
+    while (!out.done) s_posted.wait(&s_lock);
+    s_pending.erase(tid);
+    return out.finished - start;
+}
+
+static bool
+readFile(const std::string & path, std::string & contents)
+{
+    contents.clear();
+    FILE * f = ft::fopen_binary_read(path);
+    if (!f) return false;
+    char buf[16384];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) contents.append(buf, n);
+    fclose(f);
+    return true;
+}
+
+// remove an output, and the directory ft::getPath() created for it
+static void
+discard(const std::string & path)
+{
+    (void) ft::remove(path);
+    size_t sep = path.find_last_of("/\\");
+    if (sep != std::string::npos) (void) ft::remove(path.substr(0, sep));
+}
+
+// build arguments from a template, naming the image at path
+static bp::Object *
+withFile(const bp::Object * tmpl, const std::string & path)
+{
+    bp::Map * m = (bp::Map *) tmpl->clone();
+    (void) m->kill("file");
+    // describes a test case's result, it isn't an argument
+    (void) m->kill("expect");
+    std::string url = bp::urlutil::urlFromPath(tools::absolutePath(path));
+    m->add("file", new bp::Path(url));
+    return m;
+}
+
+static bool
+hasSuffix(const std::string & s, const std::string & suffix)
+{
+    return (s.size() >= suffix.size() &&
+            s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0);
+}
+
+static bool
+addCase(const std::string & path, std::vector<Item> & items,
+        std::string & oError)
+{
+    bp::Object * c = bp::json::parseFile(path, oError);
+    if (!c) return false;
+    if (c->type() != BPTMap || !c->has("file", BPTString)) {
+        delete c;
+        oError.append(path);
+        oError.append(": not a test case, 'file' is required");
+        return false;
+    }
+
+    // 'file' is found in the images directory, which by default is
+    // test_images beside the directory holding the case, or failing
+    // that beside the case itself
+    std::string dir = tools::dirName(path);
+    std::string file = (std::string) (*(c->get("file")));
+    std::string images = s_opts.images;
+    if (images.empty()) {
+        images = ft::pathAppend(dir, ".." PATH_SEP "test_images");
+    }
+    std::string image = ft::pathAppend(images, file);
+    if (!ft::isRegularFile(image)) image = ft::pathAppend(dir, file);
+    if (!ft::isRegularFile(image)) image = file;
+    if (!ft::isRegularFile(image)) {
+        delete c;
+        oError.append(path);
+        oError.append(": can't find image ");
+        oError.append(file);
+        return false;
+    }
+
+    Item item;
+    std::string leaf = ft::basename(path);
+    if (leaf.empty()) leaf = path;
+    item.name = leaf.substr(0, leaf.size() - 5);
+    item.function = (c->has("outputs", BPTList) ? "transformMany"
+                                                 : "transform");
+    item.args = withFile(c, image);
+    delete c;
+
+    std::string out = path.substr(0, path.size() - 5) + ".out";
+    if (ft::isRegularFile(out)) item.expected = out;
+
+    items.push_back(item);
+    return true;
+}
+
+static bool
+addImage(const std::string & path, const bp::Object * tmpl,
+         std::vector<Item> & items)
+{
+    if (imageproc::pathToType(path) == imageproc::UNKNOWN) return false;
+    Item item;
+    item.name = ft::basename(path);
+    if (item.name.empty()) item.name = path;
+    item.function = (tmpl->has("outputs", BPTList) ? "transformMany"
+                                                    : "transform");
+    item.args = withFile(tmpl, path);
+    items.push_back(item);
+    return true;
+}
+
+static bool
+addInput(const std::string & path, const bp::Object * tmpl,
+         std::vector<Item> & items, std::string & oError)
+{
+    if (ft::isDirectory(path)) {
+        std::vector<std::string> names;
+        if (!ft::readDirectory(path, names)) {
+            oError.append("can't read directory ");
+            oError.append(path);
+            return false;
+        }
+        for (unsigned int i = 0; i < names.size(); i++) {
+            std::string p = ft::pathAppend(path, names[i]);
+            if (!ft::isRegularFile(p)) continue;
+            if (hasSuffix(names[i], ".json")) {
+                if (!addCase(p, items, oError)) return false;
+            } else {
+                // anything else we can't read is skipped
+                (void) addImage(p, tmpl, items);
+            }
+        }
+        return true;
+    }
+    if (hasSuffix(path, ".json")) return addCase(path, items, oError);
+    if (!addImage(path, tmpl, items)) {
+        oError.append("not a test case or an image: ");
+        oError.append(path);
+        return false;
+    }
+    return true;
+}
+
+// a completed invocation
+struct Sample {
+    unsigned int item;
+    double ms;
+    bool ok;
+    bool mismatch;
+};
+
+// work shared by the threads of a run
+struct Run {
+    Run(const std::vector<Item> & i, const std::vector<std::string> & e,
+        size_t n, bool k)
+        : items(i), expected(e), next(0), total(n), keep(k) { }
+    const std::vector<Item> & items;
+    // contents of expected outputs, empty if unknown
+    const std::vector<std::string> & expected;
+    bp::sync::Mutex lock;
+    size_t next;
+    size_t total;
+    // are samples kept, or is this warmup?
+    bool keep;
+    std::vector<Sample> samples;
+    std::vector<std::string> errors;
+};
+
+static void *
+runThread(void * cookie)
+{
+    Run * run = (Run *) cookie;
+
+    for (;;) {
+        unsigned int i;
+        {
+            bp::sync::Lock l(run->lock);
+            if (run->next >= run->total) break;
+            i = (unsigned int) (run->next++ % run->items.size());
+        }
+
+        Outcome out;
+        Sample s;
+        s.item = i;
+        s.ms = invoke(run->items[i], out);
+        s.ok = out.ok;
+        s.mismatch = false;
+
+        if (s.ok && s_opts.verify && !run->expected[i].empty()) {
+            std::string got;
+            s.mismatch = (out.files.empty() || !readFile(out.files[0], got)
+                          || got != run->expected[i]);
+        }
+        // cached results are handed out again, so are left alone
+        if (!s_opts.cache) {
+            for (unsigned int j = 0; j < out.files.size(); j++) {
+                discard(out.files[j]);
+            }
+        }
+
+        bp::sync::Lock l(run->lock);
+        if (!run->keep) continue;
+        run->samples.push_back(s);
+        if (run->errors.size() >= s_maxErrors) continue;
+        if (!s.ok) {
+            run->errors.push_back(run->items[i].name + ": " + out.error);
+        } else if (s.mismatch) {
+            run->errors.push_back(run->items[i].name + ": output mismatch");
+        }
+    }
+
+    return NULL;
+}
+
+// run total invocations, cycling through items, across n threads.
+// Returns wall clock milliseconds.
+static double
+runThreads(Run & run, unsigned int n)
+{
+    std::vector<bp::thread::Thread *> threads;
+    bp::time::Stopwatch sw;
+    for (unsigned int i = 0; i < n; i++) {
+        bp::thread::Thread * t = new bp::thread::Thread;
+        if (!t->run(runThread, (void *) &run)) {
+            delete t;
+            break;
+        }
+        threads.push_back(t);
+    }
+    // if no thread could be started, do the work here
+    if (threads.empty()) (void) runThread((void *) &run);
+    for (unsigned int i = 0; i < threads.size(); i++) {
+        threads[i]->join();
+        delete threads[i];
+    }
+    return sw.elapsedMS();
+}
+
+struct Latency {
+    Latency() : n(0), errors(0), mismatches(0), min(0), max(0), mean(0),
+                p50(0), p90(0), p99(0) { }
+    size_t n;
+    size_t errors;
+    size_t mismatches;
+    double min, max, mean, p50, p90, p99;
+};
+
+// nearest rank percentile of sorted samples
+static double
+percentile(const std::vector<double> & sorted, double p)
+{
+    if (sorted.empty()) return 0.0;
+    size_t rank = (size_t) (p / 100.0 * sorted.size() + 0.999999);
+    if (rank < 1) rank = 1;
+    if (rank > sorted.size()) rank = sorted.size();
+    return sorted[rank - 1];
+}
+
+// summarize samples of item, or of all items if item is negative
+static Latency
+summarize(const std::vector<Sample> & samples, int item)
+{
+    Latency lat;
+    std::vector<double> ms;
+    double sum = 0.0;
+    for (unsigned int i = 0; i < samples.size(); i++) {
+        if (item >= 0 && samples[i].item != (unsigned int) item) continue;
+        if (!samples[i].ok) {
+            lat.errors++;
+            continue;
+        }
+        if (samples[i].mismatch) lat.mismatches++;
+        ms.push_back(samples[i].ms);
+        sum += samples[i].ms;
+    }
+    lat.n = ms.size();
+    if (ms.empty()) return lat;
+    std::sort(ms.begin(), ms.end());
+    lat.min = ms.front();
+    lat.max = ms.back();
+    lat.mean = sum / ms.size();
+    lat.p50 = percentile(ms, 50.0);
+    lat.p90 = percentile(ms, 90.0);
+    lat.p99 = percentile(ms, 99.0);
+    return lat;
+}
+
+static std::string
+latencyJSON(const Latency & l)
+{
+    std::stringstream ss;
+    ss << "{\"n\": " << l.n << ", \"errors\": " << l.errors
+       << ", \"mismatches\": " << l.mismatches
+       << ", \"min_ms\": " << l.min << ", \"mean_ms\": " << l.mean
+       << ", \"p50_ms\": " << l.p50 << ", \"p90_ms\": " << l.p90
+       << ", \"p99_ms\": " << l.p99 << ", \"max_ms\": " << l.max << "}";
+    return ss.str();
+}
+
+static void
+latencyRow(std::ostream & os, const std::string & name, const Latency & l)
+{
+    char row[256];
+    sprintf(row, "  %-28.28s %6lu %9.2f %9.2f %9.2f %9.2f %9.2f",
+            name.c_str(), (unsigned long) l.n, l.mean, l.p50, l.p90,
+            l.p99, l.max);
+    os << row;
+    if (l.errors) os << "  " << l.errors << " failed";
+    if (l.mismatches) os << "  " << l.mismatches << " mismatched";
+    os << "\n";
+}
+
+static void
+usage(const char * argv0)
+{
+    std::cerr
+        << "usage: " << argv0 << " [options] <case.json|image|dir>...\n"
+        << "\n"
+        << "  --warmup N     untimed passes over the inputs (1)\n"
+        << "  --reps N       timed passes over the inputs (5)\n"
+        << "  --threads L    comma separated client thread counts (1)\n"
+        << "  --images DIR   where test cases find their images\n"
+        << "                 (test_images beside the cases directory)\n"
+        << "  --args JSON    transform arguments for images ({})\n"
+        << "  --temp DIR     where output is written\n"
+        << "  --cache        leave the result cache enabled\n"
+        << "  --verify       compare output with test case .out files\n"
+        << "  --json         report as JSON\n"
+        << "  --verbose      show service log output\n"
+        << "\n"
+        << "magic.mgk is found in MAGICK_CONFIGURE_PATH, or the ImageAlter\n"
+        << "directory beside this executable.\n";
+}
+
+static bool
+parseThreads(const std::string & s, std::vector<unsigned int> & threads)
+{
+    std::stringstream ss(s);
+    std::string tok;
+    while (std::getline(ss, tok, ',')) {
+        unsigned int n;
+        if (!tools::parseCount(tok.c_str(), n) || n == 0) return false;
+        threads.push_back(n);
+    }
+    return !threads.empty();
+}
+
+static std::string
+defaultTempDir()
+{
+    const char * tmp = getenv("TMPDIR");
+    if (!tmp) tmp = getenv("TEMP");
+#ifdef WIN32
+    if (!tmp) tmp = ".";
+#else
+    if (!tmp) tmp = "/tmp";
+#endif
+    return ft::pathAppend(tmp, "ImageAlterBench");
+}
+
+int
+main(int argc, char ** argv)
+{
+    std::vector<std::string> inputs;
+    for (int i = 1; i < argc; i++) {
+        std::string a(argv[i]);
+        bool more = (i + 1 < argc);
+        if (a == "--warmup" && more) {
+            if (!tools::parseCount(argv[++i], s_opts.warmup)) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (a == "--reps" && more) {
+            if (!tools::parseCount(argv[++i], s_opts.reps) ||
+                !s_opts.reps)
+            {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (a == "--threads" && more) {
+            if (!parseThreads(argv[++i], s_opts.threads)) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (a == "--images" && more) {
+            s_opts.images = argv[++i];
+        } else if (a == "--args" && more) {
+            s_opts.args = argv[++i];
+        } else if (a == "--temp" && more) {
+            s_opts.temp = argv[++i];
+        } else if (a == "--cache") {
+            s_opts.cache = true;
+        } else if (a == "--verify") {
+            s_opts.verify = true;
+        } else if (a == "--json") {
+            s_opts.json = true;
+        } else if (a == "--verbose") {
+            s_opts.verbose = true;
+        } else if (!a.empty() && a[0] == '-') {
+            usage(argv[0]);
+            return 1;
+        } else {
+            inputs.push_back(a);
+        }
+    }
+    if (inputs.empty()) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (s_opts.threads.empty()) s_opts.threads.push_back(1);
+    if (s_opts.temp.empty()) s_opts.temp = defaultTempDir();
+
+    // bring up the service, just as BrowserPlus would.  This
+    // must precede reading inputs, as it determines the image types
+    // which are recognized
+    tools::findMagickConfig(argv[0]);
+    static BPCFunctionTable coreFunctions;
+    memset((void *) &coreFunctions, 0, sizeof(coreFunctions));
+    coreFunctions.coreletAPIVersion = BPP_CORELET_API_VERSION;
+    coreFunctions.postResults = benchPostResults;
+    coreFunctions.postError = benchPostError;
+    coreFunctions.log = benchLog;
+
+    s_service = BPPGetEntryPoints();
+    (void) s_service->initializeFunc(&coreFunctions, NULL);
+    if (!s_opts.cache) imageproc::setResultCacheCapacity(0);
+
+    std::string err;
+    bp::Object * tmpl = (s_opts.args.empty() ? new bp::Map
+                         : bp::json::parse(s_opts.args, err));
+    if (!tmpl || tmpl->type() != BPTMap) {
+        std::cerr << "--args must be a JSON object " << err << "\n";
+        delete tmpl;
+        return 1;
+    }
+
+    std::vector<Item> items;
+    for (unsigned int i = 0; i < inputs.size(); i++) {
+        if (!addInput(inputs[i], tmpl, items, err)) {
+            std::cerr << err << "\n";
+            return 1;
+        }
+    }
+    delete tmpl;
+    if (items.empty()) {
+        std::cerr << "nothing to run\n";
+        return 1;
+    }
+
+    std::vector<std::string> expected(items.size());
+    if (s_opts.verify) {
+        for (unsigned int i = 0; i < items.size(); i++) {
+            if (!items[i].expected.empty()) {
+                (void) readFile(items[i].expected, expected[i]);
+            }
+        }
+    }
+
+    bp::Map context;
+    context.add("temp_dir", new bp::Path(s_opts.temp));
+    if (s_service->allocateFunc(&s_session, 0, context.elemPtr()) != 0) {
+        std::cerr << "couldn't allocate a session\n";
+        return 1;
+    }
+
+    unsigned int workers = bp::thread::Thread::numProcessors();
+    if (workers > IA_MAX_WORKERS) workers = IA_MAX_WORKERS;
+
+    std::stringstream report;
+    if (s_opts.json) {
+        report << "{\"inputs\": " << items.size()
+               << ", \"warmup\": " << s_opts.warmup
+               << ", \"repetitions\": " << s_opts.reps
+               << ", \"workers\": " << workers
+               << ", \"cache\": " << (s_opts.cache ? "true" : "false")
+               << ", \"runs\": [";
+    } else {
+        report << items.size() << " inputs, " << s_opts.warmup
+               << " warmup and " << s_opts.reps << " timed passes, "
+               << workers << " service workers, result cache "
+               << (s_opts.cache ? "on" : "off") << "\n";
+    }
+
+    bool failed = false;
+    for (unsigned int t = 0; t < s_opts.threads.size(); t++) {
+        unsigned int n = s_opts.threads[t];
+
+        Run warm(items, expected, s_opts.warmup * items.size(), false);
+        (void) runThreads(warm, n);
+
+        Run run(items, expected, s_opts.reps * items.size(), true);
+        double wall = runThreads(run, n);
+
+        Latency all = summarize(run.samples, -1);
+        double throughput = (wall > 0.0 ? all.n * 1000.0 / wall : 0.0);
+        if (all.errors || all.mismatches) failed = true;
+
+        if (s_opts.json) {
+            report << (t ? ", " : "") << "{\"threads\": " << n
+                   << ", \"wall_ms\": " << wall
+                   << ", \"throughput\": " << throughput
+                   << ", \"latency\": " << latencyJSON(all)
+                   << ", \"inputs\": [";
+            for (unsigned int i = 0; i < items.size(); i++) {
+                report << (i ? ", " : "") << "{\"name\": "
+                       << bp::json::quote(items[i].name)
+                       << ", \"latency\": "
+                       << latencyJSON(summarize(run.samples, (int) i))
+                       << "}";
+            }
+            report << "], \"errors\": [";
+            for (unsigned int i = 0; i < run.errors.size(); i++) {
+                report << (i ? ", " : "")
+                       << bp::json::quote(run.errors[i]);
+            }
+            report << "]}";
+        } else {
+            char line[128];
+            sprintf(line, "%.1f", throughput);
+            report << "\n" << n << " thread" << (n == 1 ? "" : "s") << ": "
+                   << all.n << " transformations in " << (wall / 1000.0)
+                   << "s, " << line << "/s\n";
+            sprintf(line, "  %-28s %6s %9s %9s %9s %9s %9s\n", "(ms)", "n",
+                    "mean", "p50", "p90", "p99", "max");
+            report << line;
+            for (unsigned int i = 0; i < items.size(); i++) {
+                latencyRow(report, items[i].name,
+                           summarize(run.samples, (int) i));
+            }
+            latencyRow(report, "all", all);
+            for (unsigned int i = 0; i < run.errors.size(); i++) {
+                report << "  error: " << run.errors[i] << "\n";
+            }
+        }
+    }
+    if (s_opts.json) report << "]}\n";
+    std::cout << report.str();
+
+    s_service->destroyFunc(s_session);
+    s_service->shutdownFunc();
+    for (unsigned int i = 0; i < items.size(); i++) delete items[i].args;
+
+    return (failed ? 2 : 0);
+}
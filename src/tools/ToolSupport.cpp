@@ -0,0 +1,110 @@
+/*
+ * Copyright 2009, Yahoo!
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ * 
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ * 
+ *  3. Neither the name of Yahoo! nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "ToolSupport.hh"
+#include "util/fileutil.hh"
+
+#include <stdlib.h>
+
+#ifdef WIN32
+#include <direct.h>
+#define getcwd _getcwd
+#else
+#include <unistd.h>
+#endif
+
+std::string
+tools::absolutePath(const std::string & path)
+{
+    bool absolute = (!path.empty() && (path[0] == '/' || path[0] == '\\'));
+#ifdef WIN32
+    if (path.size() > 1 && path[1] == ':') absolute = true;
+#endif
+    if (absolute) return path;
+
+    char cwd[4096];
+    if (!getcwd(cwd, sizeof(cwd))) return path;
+    return ft::pathAppend(cwd, path);
+}
+
+std::string
+tools::dirName(const std::string & path)
+{
+    size_t sep = path.find_last_of("/\\");
+    if (sep == std::string::npos) return ".";
+    if (sep == 0) return path.substr(0, 1);
+    return path.substr(0, sep);
+}
+
+void
+tools::findMagickConfig(const char * argv0)
+{
+    if (getenv("MAGICK_CONFIGURE_PATH")) return;
+
+    std::string dir = ft::pathAppend(dirName(absolutePath(argv0)),
+                                     "ImageAlter");
+#ifdef WIN32
+    (void) _putenv_s("MAGICK_CONFIGURE_PATH", dir.c_str());
+#else
+    (void) setenv("MAGICK_CONFIGURE_PATH", dir.c_str(), 0);
+#endif
+}
+
+bool
+tools::parseCount(const char * s, unsigned int & n)
+{
+    char * end = NULL;
+    long l = strtol(s, &end, 10);
+    if (!end || *end != '\0' || end == s || l < 0) return false;
+    n = (unsigned int) l;
+    return true;
+}
+
+bool
+tools::parseBytes(const char * s, unsigned long long & n)
+{
+    char * end = NULL;
+    double d = strtod(s, &end);
+    if (!end || end == s || d < 0.0) return false;
+
+    double scale = 1.0;
+    switch (*end) {
+        case '\0': break;
+        case 'k': case 'K': scale = 1024.0; end++; break;
+        case 'm': case 'M': scale = 1024.0 * 1024; end++; break;
+        case 'g': case 'G': scale = 1024.0 * 1024 * 1024; end++; break;
+        default: return false;
+    }
+    if (*end != '\0') return false;
+    n = (unsigned long long) (d * scale);
+    return true;
+}
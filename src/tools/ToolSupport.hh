@@ -0,0 +1,62 @@
+/*
+ * Copyright 2009, Yahoo!
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ * 
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ * 
+ *  3. Neither the name of Yahoo! nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Helpers shared by the command line tools which run imageproc outside
+ * of BrowserPlus.
+ */
+
+#ifndef __TOOLSUPPORT_HH__
+#define __TOOLSUPPORT_HH__
+
+#include <string>
+
+namespace tools {
+    /** path made absolute against the current directory, if it isn't */
+    std::string absolutePath(const std::string & path);
+
+    /** the directory holding path, or "." if it has none */
+    std::string dirName(const std::string & path);
+
+    /** GraphicsMagick needs magic.mgk, which the build copies into the
+     *  service directory beside the tools.  Unless MAGICK_CONFIGURE_PATH
+     *  is already set, point it there.  Call before imageproc::init() */
+    void findMagickConfig(const char * argv0);
+
+    /** parse a non-negative decimal integer */
+    bool parseCount(const char * s, unsigned int & n);
+
+    /** parse a byte count, which may have a K, M or G suffix */
+    bool parseBytes(const char * s, unsigned long long & n);
+};
+
+#endif
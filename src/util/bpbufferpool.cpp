@@ -0,0 +1,271 @@
+/**
+ * ***** BEGIN LICENSE BLOCK *****
+ * The contents of this file are subject to the Mozilla Public License
+ * Version 1.1 (the "License"); you may not use this file except in
+ * compliance with the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ * 
+ * Software distributed under the License is distributed on an "AS IS"
+ * basis, WITHOUT WARRANTY OF ANY KIND, either express or implied. See the
+ * License for the specific language governing rights and limitations
+ * under the License.
+ * 
+ * The Original Code is BrowserPlus (tm).
+ * 
+ * The Initial Developer of the Original Code is Yahoo!.
+ * Portions created by Yahoo! are Copyright (C) 2006-2009 Yahoo!.
+ * All Rights Reserved.
+ * 
+ * Contributor(s): 
+ * ***** END LICENSE BLOCK *****
+ */
+
+
+#include "bpbufferpool.hh"
+#include "bptime.hh"
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+using namespace bp::mem;
+
+// the smallest class is 2^MIN_SHIFT bytes, each power of two above that
+// is split into CLASS_STEPS classes
+#define MIN_SHIFT 16
+#define CLASS_STEPS 4
+#define NUM_CLASSES ((sizeof(size_t) * 8 - MIN_SHIFT) * CLASS_STEPS)
+
+// buffers at least this large are aligned to it, so that transparent
+// huge pages may back them
+#define HUGE_PAGE_BYTES (2 * 1024 * 1024)
+
+static size_t
+classSize(unsigned int c)
+{
+    unsigned int shift = MIN_SHIFT + c / CLASS_STEPS;
+    size_t base = ((size_t) 1) << shift;
+    return base + (c % CLASS_STEPS) * (base / CLASS_STEPS);
+}
+
+// the smallest class that holds bytes, NUM_CLASSES if none does
+static unsigned int
+classOf(size_t bytes)
+{
+    unsigned int shift = MIN_SHIFT;
+    while (shift + 1 < sizeof(size_t) * 8 &&
+           (((size_t) 1) << (shift + 1)) <= bytes)
+    {
+        shift++;
+    }
+    unsigned int c = (shift - MIN_SHIFT) * CLASS_STEPS;
+    while (c < NUM_CLASSES && classSize(c) < bytes) c++;
+    return c;
+}
+
+static void *
+mapPages(size_t bytes)
+{
+#ifdef WIN32
+    return VirtualAlloc(NULL, bytes, MEM_RESERVE | MEM_COMMIT,
+                        PAGE_READWRITE);
+#else
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+    size_t align = (bytes >= HUGE_PAGE_BYTES ? HUGE_PAGE_BYTES : 0);
+    size_t len = bytes + align;
+    if (len < bytes) return NULL;
+    char * p = (char *) mmap(NULL, len, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == (char *) MAP_FAILED) return NULL;
+    if (align) {
+        // unmap the slop either side of the aligned region
+        size_t head = (align - ((size_t) p % align)) % align;
+        if (head) (void) munmap(p, head);
+        if (align - head) (void) munmap(p + head + bytes, align - head);
+        p += head;
+#ifdef MADV_HUGEPAGE
+        (void) madvise(p, bytes, MADV_HUGEPAGE);
+#endif
+    }
+    return p;
+#endif
+}
+
+static void
+unmapPages(void * p, size_t bytes)
+{
+#ifdef WIN32
+    (void) VirtualFree(p, 0, MEM_RELEASE);
+#else
+    (void) munmap(p, bytes);
+#endif
+}
+
+BufferPool::BufferPool(size_t capacity)
+    : m_free(NUM_CLASSES), m_capacity(capacity), m_retained(0),
+      m_outstandingBytes(0), m_hits(0), m_misses(0), m_trimmed(0),
+      m_lastUse(0.0), m_idleMS(0), m_trimming(false)
+{
+}
+
+BufferPool::~BufferPool()
+{
+    stopTrimmer();
+    bp::sync::Lock l(m_lock);
+    trimLocked(0);
+}
+
+void
+BufferPool::setCapacity(size_t capacity)
+{
+    bp::sync::Lock l(m_lock);
+    m_capacity = capacity;
+    trimLocked(m_capacity);
+}
+
+void *
+BufferPool::acquire(size_t bytes, size_t * usable)
+{
+    unsigned int c = classOf(bytes);
+    if (c >= NUM_CLASSES) return NULL;
+    size_t len = classSize(c);
+    if (usable) *usable = len;
+
+    {
+        bp::sync::Lock l(m_lock);
+        m_lastUse = bp::time::nowMS();
+        if (!m_free[c].empty()) {
+            void * p = m_free[c].back();
+            m_free[c].pop_back();
+            m_retained -= len;
+            m_hits++;
+            m_outstanding[p] = c;
+            m_outstandingBytes += len;
+            return p;
+        }
+        m_misses++;
+    }
+
+    // map outside the lock, it may take a while
+    void * p = mapPages(len);
+    if (!p) return NULL;
+
+    bp::sync::Lock l(m_lock);
+    m_outstanding[p] = c;
+    m_outstandingBytes += len;
+    return p;
+}
+
+bool
+BufferPool::release(void * p)
+{
+    bp::sync::Lock l(m_lock);
+
+    std::map<const void *, unsigned int>::iterator it =
+        m_outstanding.find(p);
+    if (it == m_outstanding.end()) return false;
+
+    unsigned int c = it->second;
+    size_t len = classSize(c);
+    m_outstanding.erase(it);
+    m_outstandingBytes -= len;
+    m_lastUse = bp::time::nowMS();
+
+    if (m_retained + len <= m_capacity) {
+        m_free[c].push_back(p);
+        m_retained += len;
+    } else {
+        unmapPages(p, len);
+    }
+    return true;
+}
+
+size_t
+BufferPool::size(const void * p)
+{
+    bp::sync::Lock l(m_lock);
+    std::map<const void *, unsigned int>::const_iterator it =
+        m_outstanding.find(p);
+    return (it == m_outstanding.end() ? 0 : classSize(it->second));
+}
+
+void
+BufferPool::trim(size_t keep)
+{
+    bp::sync::Lock l(m_lock);
+    trimLocked(keep);
+}
+
+void
+BufferPool::trimLocked(size_t keep)
+{
+    for (unsigned int c = NUM_CLASSES; c-- > 0 && m_retained > keep; ) {
+        size_t len = classSize(c);
+        while (!m_free[c].empty() && m_retained > keep) {
+            unmapPages(m_free[c].back(), len);
+            m_free[c].pop_back();
+            m_retained -= len;
+            m_trimmed += len;
+        }
+    }
+}
+
+bool
+BufferPool::startTrimmer(unsigned int idleMS)
+{
+    bp::sync::Lock l(m_lock);
+    if (m_trimming || idleMS == 0) return false;
+    m_idleMS = idleMS;
+    m_trimming = true;
+    if (!m_trimmer.run(trimmerMain, (void *) this)) {
+        m_trimming = false;
+        return false;
+    }
+    return true;
+}
+
+void
+BufferPool::stopTrimmer()
+{
+    {
+        bp::sync::Lock l(m_lock);
+        if (!m_trimming) return;
+        m_trimming = false;
+        m_wake.signal();
+    }
+    m_trimmer.join();
+}
+
+void *
+BufferPool::trimmerMain(void * cookie)
+{
+    BufferPool * pool = (BufferPool *) cookie;
+    bp::sync::Lock l(pool->m_lock);
+    while (pool->m_trimming) {
+        (void) pool->m_wake.timeWait(&(pool->m_lock), pool->m_idleMS);
+        if (pool->m_trimming && pool->m_retained > 0 &&
+            bp::time::nowMS() - pool->m_lastUse >= pool->m_idleMS)
+        {
+            pool->trimLocked(0);
+        }
+    }
+    return NULL;
+}
+
+BufferPool::Stats
+BufferPool::stats()
+{
+    bp::sync::Lock l(m_lock);
+    Stats s;
+    s.hits = m_hits;
+    s.misses = m_misses;
+    s.trimmed = m_trimmed;
+    s.retained = m_retained;
+    s.outstanding = m_outstandingBytes;
+    s.capacity = m_capacity;
+    return s;
+}
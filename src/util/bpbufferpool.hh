@@ -0,0 +1,132 @@
+/**
+ * ***** BEGIN LICENSE BLOCK *****
+ * The contents of this file are subject to the Mozilla Public License
+ * Version 1.1 (the "License"); you may not use this file except in
+ * compliance with the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ * 
+ * Software distributed under the License is distributed on an "AS IS"
+ * basis, WITHOUT WARRANTY OF ANY KIND, either express or implied. See the
+ * License for the specific language governing rights and limitations
+ * under the License.
+ * 
+ * The Original Code is BrowserPlus (tm).
+ * 
+ * The Initial Developer of the Original Code is Yahoo!.
+ * Portions created by Yahoo! are Copyright (C) 2006-2009 Yahoo!.
+ * All Rights Reserved.
+ * 
+ * Contributor(s): 
+ * ***** END LICENSE BLOCK *****
+ */
+
+
+/*
+ *  bpbufferpool.hh
+ *
+ *  A pool of large buffers, grouped into size classes a quarter of a
+ *  power of two apart.  Freed buffers are retained, up to a limit, and
+ *  handed out again to later requests for the same class, sparing the
+ *  page faults of touching freshly mapped memory.  Buffers are mapped
+ *  directly from the system, and those of 2MB or more are aligned so
+ *  that they may be backed by huge pages.
+ */
+
+#ifndef __BPBUFFERPOOL_H__
+#define __BPBUFFERPOOL_H__
+
+#include "bpsync.hh"
+#include "bpthread.hh"
+
+#include <stddef.h>
+
+#include <map>
+#include <vector>
+
+namespace bp { namespace mem {
+
+class BufferPool
+{
+  public:
+    struct Stats {
+        Stats() : hits(0), misses(0), trimmed(0), retained(0),
+                  outstanding(0), capacity(0) { }
+        // buffers handed out from those retained, and freshly mapped
+        unsigned long long hits;
+        unsigned long long misses;
+        // bytes returned to the system by trim()
+        unsigned long long trimmed;
+        // bytes of buffers retained, and of buffers handed out
+        size_t retained;
+        size_t outstanding;
+        size_t capacity;
+    };
+
+    /** a pool which retains up to capacity bytes of freed buffers */
+    BufferPool(size_t capacity);
+    /** stops the trimmer, and returns retained buffers to the system.
+     *  Buffers still outstanding are leaked */
+    ~BufferPool();
+
+    /** change the bytes retained, trimming as required */
+    void setCapacity(size_t capacity);
+
+    /** a buffer of at least bytes, or NULL if none could be mapped.
+     *  If usable is non-NULL it's set to the buffer's usable size, as
+     *  size() would report */
+    void * acquire(size_t bytes, size_t * usable = NULL);
+
+    /** return a buffer to the pool.
+     *  \returns false if p didn't come from acquire() */
+    bool release(void * p);
+
+    /** the usable size of a buffer from acquire(), zero if p didn't come
+     *  from acquire() */
+    size_t size(const void * p);
+
+    /** return retained buffers to the system, largest first, until no
+     *  more than keep bytes are retained */
+    void trim(size_t keep);
+
+    /** spawn a thread which trims every retained buffer once the pool
+     *  has been idle (nothing acquired or released) for idleMS.
+     *  \returns false if it's already running or couldn't be started */
+    bool startTrimmer(unsigned int idleMS);
+
+    /** stop the trimmer thread, if it's running */
+    void stopTrimmer();
+
+    Stats stats();
+
+  private:
+    static void * trimmerMain(void * cookie);
+
+    // m_lock must be held
+    void trimLocked(size_t keep);
+
+    bp::sync::Mutex m_lock;
+    // wakes the trimmer when it's stopped
+    bp::sync::Condition m_wake;
+    // retained buffers of each class, most recently released last
+    std::vector<std::vector<void *> > m_free;
+    // the class of each buffer handed out
+    std::map<const void *, unsigned int> m_outstanding;
+    size_t m_capacity;
+    size_t m_retained;
+    size_t m_outstandingBytes;
+    unsigned long long m_hits;
+    unsigned long long m_misses;
+    unsigned long long m_trimmed;
+    // when a buffer was last acquired or released
+    double m_lastUse;
+    bp::thread::Thread m_trimmer;
+    unsigned int m_idleMS;
+    bool m_trimming;
+
+    BufferPool(const BufferPool &);             // prevent copy construct
+    BufferPool& operator=(const BufferPool &);  // prevent copy assign
+};
+
+}; };
+
+#endif
@@ -0,0 +1,353 @@
+/**
+ * ***** BEGIN LICENSE BLOCK *****
+ * The contents of this file are subject to the Mozilla Public License
+ * Version 1.1 (the "License"); you may not use this file except in
+ * compliance with the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ * 
+ * Software distributed under the License is distributed on an "AS IS"
+ * basis, WITHOUT WARRANTY OF ANY KIND, either express or implied. See the
+ * License for the specific language governing rights and limitations
+ * under the License.
+ * 
+ * The Original Code is BrowserPlus (tm).
+ * 
+ * The Initial Developer of the Original Code is Yahoo!.
+ * Portions created by Yahoo! are Copyright (C) 2006-2009 Yahoo!.
+ * All Rights Reserved.
+ * 
+ * Contributor(s): 
+ * ***** END LICENSE BLOCK *****
+ */
+
+
+#include "bpjson.hh"
+#include "fileutil.hh"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sstream>
+
+namespace {
+    // a recursive descent parser over text, which must outlive it
+    class Parser {
+      public:
+        Parser(const std::string & text) : m_text(text), m_pos(0) { }
+
+        bp::Object * document(std::string & oError) {
+            bp::Object * o = value(0);
+            if (o) {
+                skipSpace();
+                if (m_pos != m_text.size()) {
+                    delete o;
+                    o = NULL;
+                    m_error = "trailing garbage";
+                }
+            }
+            if (!o) {
+                std::stringstream ss;
+                ss << m_error << " at offset " << m_pos;
+                oError.append(ss.str());
+            }
+            return o;
+        }
+
+      private:
+        // deeper documents than this are surely not action lists
+        static const unsigned int s_maxDepth = 64;
+
+        const std::string & m_text;
+        size_t m_pos;
+        std::string m_error;
+
+        void skipSpace() {
+            while (m_pos < m_text.size() &&
+                   (m_text[m_pos] == ' ' || m_text[m_pos] == '\t' ||
+                    m_text[m_pos] == '\n' || m_text[m_pos] == '\r'))
+            {
+                m_pos++;
+            }
+        }
+
+        bool literal(const char * word) {
+            size_t n = strlen(word);
+            if (m_text.compare(m_pos, n, word) != 0) return false;
+            m_pos += n;
+            return true;
+        }
+
+        bp::Object * fail(const char * why) {
+            m_error = why;
+            return NULL;
+        }
+
+        bp::Object * value(unsigned int depth) {
+            if (depth > s_maxDepth) return fail("nested too deeply");
+            skipSpace();
+            if (m_pos >= m_text.size()) return fail("unexpected end");
+
+            char c = m_text[m_pos];
+            if (c == '{') return object(depth);
+            if (c == '[') return array(depth);
+            if (c == '"') {
+                std::string s;
+                if (!string(s)) return NULL;
+                return new bp::String(s);
+            }
+            if (c == '-' || (c >= '0' && c <= '9')) return number();
+            if (literal("true")) return new bp::Bool(true);
+            if (literal("false")) return new bp::Bool(false);
+            if (literal("null")) return new bp::Null;
+            return fail("unexpected character");
+        }
+
+        bp::Object * object(unsigned int depth) {
+            bp::Map * m = new bp::Map;
+            m_pos++;
+            skipSpace();
+            if (m_pos < m_text.size() && m_text[m_pos] == '}') {
+                m_pos++;
+                return m;
+            }
+            for (;;) {
+                skipSpace();
+                std::string key;
+                if (m_pos >= m_text.size() || m_text[m_pos] != '"') {
+                    delete m;
+                    return fail("expected a key");
+                }
+                if (!string(key)) {
+                    delete m;
+                    return NULL;
+                }
+                skipSpace();
+                if (m_pos >= m_text.size() || m_text[m_pos] != ':') {
+                    delete m;
+                    return fail("expected ':'");
+                }
+                m_pos++;
+                bp::Object * v = value(depth + 1);
+                if (!v) {
+                    delete m;
+                    return NULL;
+                }
+                // later duplicates win
+                (void) m->kill(key.c_str());
+                m->add(key.c_str(), v);
+                skipSpace();
+                if (m_pos < m_text.size() && m_text[m_pos] == ',') {
+                    m_pos++;
+                } else if (m_pos < m_text.size() && m_text[m_pos] == '}') {
+                    m_pos++;
+                    return m;
+                } else {
+                    delete m;
+                    return fail("expected ',' or '}'");
+                }
+            }
+        }
+
+        bp::Object * array(unsigned int depth) {
+            bp::List * l = new bp::List;
+            m_pos++;
+            skipSpace();
+            if (m_pos < m_text.size() && m_text[m_pos] == ']') {
+                m_pos++;
+                return l;
+            }
+            for (;;) {
+                bp::Object * v = value(depth + 1);
+                if (!v) {
+                    delete l;
+                    return NULL;
+                }
+                l->append(v);
+                skipSpace();
+                if (m_pos < m_text.size() && m_text[m_pos] == ',') {
+                    m_pos++;
+                } else if (m_pos < m_text.size() && m_text[m_pos] == ']') {
+                    m_pos++;
+                    return l;
+                } else {
+                    delete l;
+                    return fail("expected ',' or ']'");
+                }
+            }
+        }
+
+        bp::Object * number() {
+            size_t start = m_pos;
+            bool integral = true;
+            if (m_text[m_pos] == '-') m_pos++;
+            while (m_pos < m_text.size()) {
+                char c = m_text[m_pos];
+                if (c == '.' || c == 'e' || c == 'E' || c == '+' ||
+                    (c == '-' && m_pos > start))
+                {
+                    integral = false;
+                } else if (c < '0' || c > '9') {
+                    break;
+                }
+                m_pos++;
+            }
+            std::string n = m_text.substr(start, m_pos - start);
+            char * end = NULL;
+            if (integral) {
+                BPInteger i = (BPInteger) strtoll(n.c_str(), &end, 10);
+                if (end && *end == '\0' && end != n.c_str()) {
+                    return new bp::Integer(i);
+                }
+            } else {
+                double d = strtod(n.c_str(), &end);
+                if (end && *end == '\0' && end != n.c_str()) {
+                    return new bp::Double(d);
+                }
+            }
+            return fail("malformed number");
+        }
+
+        // append the UTF-8 encoding of code point cp
+        static void utf8(std::string & s, unsigned long cp) {
+            if (cp < 0x80) {
+                s += (char) cp;
+            } else if (cp < 0x800) {
+                s += (char) (0xC0 | (cp >> 6));
+                s += (char) (0x80 | (cp & 0x3F));
+            } else if (cp < 0x10000) {
+                s += (char) (0xE0 | (cp >> 12));
+                s += (char) (0x80 | ((cp >> 6) & 0x3F));
+                s += (char) (0x80 | (cp & 0x3F));
+            } else {
+                s += (char) (0xF0 | (cp >> 18));
+                s += (char) (0x80 | ((cp >> 12) & 0x3F));
+                s += (char) (0x80 | ((cp >> 6) & 0x3F));
+                s += (char) (0x80 | (cp & 0x3F));
+            }
+        }
+
+        bool hex4(unsigned long & cp) {
+            if (m_pos + 4 > m_text.size()) return false;
+            cp = 0;
+            for (unsigned int i = 0; i < 4; i++) {
+                char c = m_text[m_pos++];
+                cp <<= 4;
+                if (c >= '0' && c <= '9') cp |= c - '0';
+                else if (c >= 'a' && c <= 'f') cp |= c - 'a' + 10;
+                else if (c >= 'A' && c <= 'F') cp |= c - 'A' + 10;
+                else return false;
+            }
+            return true;
+        }
+
+        bool string(std::string & s) {
+            m_pos++;
+            while (m_pos < m_text.size()) {
+                char c = m_text[m_pos++];
+                if (c == '"') return true;
+                if ((unsigned char) c < 0x20) {
+                    m_error = "control character in string";
+                    return false;
+                }
+                if (c != '\\') {
+                    s += c;
+                    continue;
+                }
+                if (m_pos >= m_text.size()) break;
+                c = m_text[m_pos++];
+                switch (c) {
+                    case '"': case '\\': case '/': s += c; break;
+                    case 'b': s += '\b'; break;
+                    case 'f': s += '\f'; break;
+                    case 'n': s += '\n'; break;
+                    case 'r': s += '\r'; break;
+                    case 't': s += '\t'; break;
+                    case 'u': {
+                        unsigned long cp, lo;
+                        if (!hex4(cp)) {
+                            m_error = "malformed \\u escape";
+                            return false;
+                        }
+                        // combine surrogate pairs
+                        if (cp >= 0xD800 && cp < 0xDC00 &&
+                            m_text.compare(m_pos, 2, "\\u") == 0)
+                        {
+                            m_pos += 2;
+                            if (!hex4(lo) || lo < 0xDC00 || lo >= 0xE000) {
+                                m_error = "malformed surrogate pair";
+                                return false;
+                            }
+                            cp = 0x10000 + ((cp - 0xD800) << 10) +
+                                (lo - 0xDC00);
+                        }
+                        utf8(s, cp);
+                        break;
+                    }
+                    default:
+                        m_error = "invalid escape";
+                        return false;
+                }
+            }
+            m_error = "unterminated string";
+            return false;
+        }
+    };
+}
+
+bp::Object *
+bp::json::parse(const std::string & text, std::string & oError)
+{
+    Parser p(text);
+    return p.document(oError);
+}
+
+bp::Object *
+bp::json::parseFile(const std::string & path, std::string & oError)
+{
+    FILE * f = ft::fopen_binary_read(path);
+    if (!f) {
+        oError.append("can't open ");
+        oError.append(path);
+        return NULL;
+    }
+
+    std::string text;
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) text.append(buf, n);
+    fclose(f);
+
+    bp::Object * o = parse(text, oError);
+    if (!o) {
+        oError.append(" in ");
+        oError.append(path);
+    }
+    return o;
+}
+
+std::string
+bp::json::quote(const std::string & s)
+{
+    std::string q("\"");
+    for (size_t i = 0; i < s.size(); i++) {
+        unsigned char c = (unsigned char) s[i];
+        switch (c) {
+            case '"': q += "\\\""; break;
+            case '\\': q += "\\\\"; break;
+            case '\n': q += "\\n"; break;
+            case '\r': q += "\\r"; break;
+            case '\t': q += "\\t"; break;
+            default:
+                if (c < 0x20) {
+                    char esc[8];
+                    sprintf(esc, "\\u%04x", c);
+                    q += esc;
+                } else {
+                    q += (char) c;
+                }
+        }
+    }
+    q += '"';
+    return q;
+}
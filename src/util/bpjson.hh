@@ -0,0 +1,56 @@
+/**
+ * ***** BEGIN LICENSE BLOCK *****
+ * The contents of this file are subject to the Mozilla Public License
+ * Version 1.1 (the "License"); you may not use this file except in
+ * compliance with the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ * 
+ * Software distributed under the License is distributed on an "AS IS"
+ * basis, WITHOUT WARRANTY OF ANY KIND, either express or implied. See the
+ * License for the specific language governing rights and limitations
+ * under the License.
+ * 
+ * The Original Code is BrowserPlus (tm).
+ * 
+ * The Initial Developer of the Original Code is Yahoo!.
+ * Portions created by Yahoo! are Copyright (C) 2006-2009 Yahoo!.
+ * All Rights Reserved.
+ * 
+ * Contributor(s): 
+ * ***** END LICENSE BLOCK *****
+ */
+
+
+/*
+ *  bpjson.hh
+ *
+ *  Just enough JSON to drive the service from outside BrowserPlus:
+ *  text is parsed into the same bp::Object types the core hands to
+ *  BPPInvoke, and strings may be quoted for output.
+ */
+
+#ifndef __BPJSON_H__
+#define __BPJSON_H__
+
+#include "bptypeutil.hh"
+
+#include <string>
+
+namespace bp { namespace json {
+
+    /**
+     *  Parse a JSON document.  Numbers without a fraction or exponent
+     *  become bp::Integer, others bp::Double.  Returns a new object the
+     *  caller must delete, or NULL with oError populated.
+     */
+    bp::Object * parse(const std::string & text, std::string & oError);
+
+    /** read and parse a JSON file */
+    bp::Object * parseFile(const std::string & path, std::string & oError);
+
+    /** s as a quoted and escaped JSON string */
+    std::string quote(const std::string & s);
+
+} };
+
+#endif
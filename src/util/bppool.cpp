@@ -0,0 +1,126 @@
+/**
+ * ***** BEGIN LICENSE BLOCK *****
+ * The contents of this file are subject to the Mozilla Public License
+ * Version 1.1 (the "License"); you may not use this file except in
+ * compliance with the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ * 
+ * Software distributed under the License is distributed on an "AS IS"
+ * basis, WITHOUT WARRANTY OF ANY KIND, either express or implied. See the
+ * License for the specific language governing rights and limitations
+ * under the License.
+ * 
+ * The Original Code is BrowserPlus (tm).
+ * 
+ * The Initial Developer of the Original Code is Yahoo!.
+ * Portions created by Yahoo! are Copyright (C) 2006-2009 Yahoo!.
+ * All Rights Reserved.
+ * 
+ * Contributor(s): 
+ * ***** END LICENSE BLOCK *****
+ */
+
+#include "bppool.hh"
+
+#include <stdlib.h>
+
+using namespace bp::thread;
+
+Pool::Pool() : m_running(false)
+{
+}
+
+Pool::~Pool()
+{
+    stop();
+}
+
+bool
+Pool::start(unsigned int numThreads)
+{
+    bp::sync::Lock l(m_lock);
+    if (m_running) return false;
+
+    for (unsigned int i = 0; i < numThreads; i++) {
+        Thread * t = new Thread;
+        if (!t->run(workerMain, (void *) this)) {
+            delete t;
+            break;
+        }
+        m_threads.push_back(t);
+    }
+
+    m_running = !m_threads.empty();
+    return m_running;
+}
+
+bool
+Pool::post(WorkFunc func, void * cookie)
+{
+    bp::sync::Lock l(m_lock);
+    if (!m_running) return false;
+
+    Work w;
+    w.func = func;
+    w.cookie = cookie;
+    m_queue.push_back(w);
+    m_cond.signal();
+
+    return true;
+}
+
+void
+Pool::stop()
+{
+    std::vector<Thread *> threads;
+    {
+        bp::sync::Lock l(m_lock);
+        if (!m_running) return;
+        m_running = false;
+        threads.swap(m_threads);
+        m_cond.broadcast();
+    }
+
+    // workers exit once the queue is drained
+    for (unsigned int i = 0; i < threads.size(); i++) {
+        threads[i]->join();
+        delete threads[i];
+    }
+}
+
+unsigned int
+Pool::size()
+{
+    bp::sync::Lock l(m_lock);
+    return m_threads.size();
+}
+
+unsigned int
+Pool::pending()
+{
+    bp::sync::Lock l(m_lock);
+    return m_queue.size();
+}
+
+void *
+Pool::workerMain(void * cookie)
+{
+    Pool * self = (Pool *) cookie;
+
+    for (;;) {
+        Work w;
+        {
+            bp::sync::Lock l(self->m_lock);
+            // spurious wakeups are possible, always re-check state
+            while (self->m_running && self->m_queue.empty()) {
+                self->m_cond.wait(&self->m_lock);
+            }
+            if (self->m_queue.empty()) break;
+            w = self->m_queue.front();
+            self->m_queue.pop_front();
+        }
+        w.func(w.cookie);
+    }
+
+    return NULL;
+}
@@ -0,0 +1,92 @@
+/**
+ * ***** BEGIN LICENSE BLOCK *****
+ * The contents of this file are subject to the Mozilla Public License
+ * Version 1.1 (the "License"); you may not use this file except in
+ * compliance with the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ * 
+ * Software distributed under the License is distributed on an "AS IS"
+ * basis, WITHOUT WARRANTY OF ANY KIND, either express or implied. See the
+ * License for the specific language governing rights and limitations
+ * under the License.
+ * 
+ * The Original Code is BrowserPlus (tm).
+ * 
+ * The Initial Developer of the Original Code is Yahoo!.
+ * Portions created by Yahoo! are Copyright (C) 2006-2009 Yahoo!.
+ * All Rights Reserved.
+ * 
+ * Contributor(s): 
+ * ***** END LICENSE BLOCK *****
+ */
+
+/*
+ *  bppool.hh
+ *
+ *  A fixed size pool of worker threads that run queued work in the order
+ *  it was posted, built atop bp::thread and bp::sync.
+ */
+
+#ifndef __BPPOOL_H__
+#define __BPPOOL_H__
+
+#include "bpsync.hh"
+#include "bpthread.hh"
+
+#include <deque>
+#include <vector>
+
+namespace bp { namespace thread {
+
+class Pool
+{
+  public:
+    /** a unit of work, invoked on a worker thread with the cookie
+     *  supplied to post() */
+    typedef void (*WorkFunc)(void * cookie);
+
+    Pool();
+    /** stops the pool if it's running */
+    ~Pool();
+
+    /** spawn numThreads worker threads.
+     *  \returns false if the pool is already running or no thread
+     *           could be started */
+    bool start(unsigned int numThreads);
+
+    /** queue work to be run on the next available worker.
+     *  \returns false if the pool isn't running, in which case the
+     *           caller retains ownership of cookie */
+    bool post(WorkFunc func, void * cookie);
+
+    /** stop accepting work, run all work that's already queued, and
+     *  join all workers */
+    void stop();
+
+    /** the number of running workers */
+    unsigned int size();
+
+    /** the number of posted items which haven't yet started */
+    unsigned int pending();
+
+  private:
+    static void * workerMain(void * cookie);
+
+    struct Work {
+        WorkFunc func;
+        void * cookie;
+    };
+
+    bp::sync::Mutex m_lock;
+    bp::sync::Condition m_cond;
+    std::deque<Work> m_queue;
+    std::vector<Thread *> m_threads;
+    bool m_running;
+
+    Pool(const Pool &);             // prevent copy construct
+    Pool& operator=(const Pool &);  // prevent copy assign
+};
+
+}; };
+
+#endif
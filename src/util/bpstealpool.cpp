@@ -0,0 +1,198 @@
+/**
+ * ***** BEGIN LICENSE BLOCK *****
+ * The contents of this file are subject to the Mozilla Public License
+ * Version 1.1 (the "License"); you may not use this file except in
+ * compliance with the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ * 
+ * Software distributed under the License is distributed on an "AS IS"
+ * basis, WITHOUT WARRANTY OF ANY KIND, either express or implied. See the
+ * License for the specific language governing rights and limitations
+ * under the License.
+ * 
+ * The Original Code is BrowserPlus (tm).
+ * 
+ * The Initial Developer of the Original Code is Yahoo!.
+ * Portions created by Yahoo! are Copyright (C) 2006-2009 Yahoo!.
+ * All Rights Reserved.
+ * 
+ * Contributor(s): 
+ * ***** END LICENSE BLOCK *****
+ */
+
+
+#include "bpstealpool.hh"
+
+#include <stdlib.h>
+
+using namespace bp::thread;
+
+StealingPool::StealingPool() : m_queued(0), m_next(0), m_running(false)
+{
+}
+
+StealingPool::~StealingPool()
+{
+    stop();
+}
+
+bool
+StealingPool::start(unsigned int numThreads)
+{
+    bp::sync::Lock l(m_lock);
+    if (m_running) return false;
+
+    // workers look at each other's queues, so every one is created
+    // before any is started
+    for (unsigned int i = 0; i < numThreads; i++) {
+        Worker * w = new Worker;
+        w->pool = this;
+        w->index = i;
+        w->started = false;
+        w->id = 0;
+        m_workers.push_back(w);
+    }
+    m_running = true;
+
+    for (unsigned int i = 0; i < m_workers.size(); i++) {
+        if (!m_workers[i]->thread.run(workerMain, (void *) m_workers[i])) {
+            // those already started will find the pool stopped
+            m_running = false;
+            break;
+        }
+        m_workers[i]->started = true;
+    }
+
+    return m_running;
+}
+
+void
+StealingPool::stop()
+{
+    std::vector<Worker *> workers;
+    {
+        bp::sync::Lock l(m_lock);
+        if (m_workers.empty()) return;
+        m_running = false;
+        m_wake.broadcast();
+    }
+
+    // workers exit once every queue is drained
+    for (unsigned int i = 0; i < m_workers.size(); i++) {
+        if (m_workers[i]->started) m_workers[i]->thread.join();
+    }
+
+    bp::sync::Lock l(m_lock);
+    workers.swap(m_workers);
+    for (unsigned int i = 0; i < workers.size(); i++) delete workers[i];
+}
+
+unsigned int
+StealingPool::size()
+{
+    bp::sync::Lock l(m_lock);
+    return m_running ? m_workers.size() : 0;
+}
+
+bool
+StealingPool::onWorker()
+{
+    unsigned int id = Thread::currentThreadID();
+    bp::sync::Lock l(m_lock);
+    for (unsigned int i = 0; i < m_workers.size(); i++) {
+        if (m_workers[i]->id == id) return true;
+    }
+    return false;
+}
+
+void
+StealingPool::run(WorkFunc func, void ** cookies, unsigned int n)
+{
+    if (n == 0) return;
+
+    Batch batch;
+    batch.remaining = n;
+
+    {
+        // a worker waiting upon tasks queued behind its own could
+        // deadlock, so it does the work itself
+        bool self = onWorker();
+        bp::sync::Lock l(m_lock);
+        if (!m_running || self) {
+            for (unsigned int i = 0; i < n; i++) func(cookies[i]);
+            return;
+        }
+
+        // deal the tasks out across the workers' queues
+        for (unsigned int i = 0; i < n; i++) {
+            Worker * w = m_workers[m_next];
+            m_next = (m_next + 1) % m_workers.size();
+
+            Task t;
+            t.func = func;
+            t.cookie = cookies[i];
+            t.batch = &batch;
+            bp::sync::Lock wl(w->lock);
+            w->tasks.push_back(t);
+        }
+        m_queued += n;
+        m_wake.broadcast();
+    }
+
+    bp::sync::Lock bl(batch.lock);
+    while (batch.remaining > 0) batch.done.wait(&batch.lock);
+}
+
+void
+StealingPool::take(unsigned int i, Task & t)
+{
+    // a task is known to be queued somewhere, but it may be stolen from
+    // under us by a worker claiming a later one, so look until found
+    unsigned int n = m_workers.size();
+    for (unsigned int k = 0; ; k = (k + 1) % n) {
+        Worker * w = m_workers[(i + k) % n];
+        bp::sync::Lock wl(w->lock);
+        if (w->tasks.empty()) continue;
+        if (k == 0) {
+            t = w->tasks.front();
+            w->tasks.pop_front();
+        } else {
+            t = w->tasks.back();
+            w->tasks.pop_back();
+        }
+        return;
+    }
+}
+
+void *
+StealingPool::workerMain(void * cookie)
+{
+    Worker * self = (Worker *) cookie;
+    StealingPool * pool = self->pool;
+    {
+        bp::sync::Lock l(pool->m_lock);
+        self->id = Thread::currentThreadID();
+    }
+
+    for (;;) {
+        {
+            bp::sync::Lock l(pool->m_lock);
+            // spurious wakeups are possible, always re-check state
+            while (pool->m_running && pool->m_queued == 0) {
+                pool->m_wake.wait(&pool->m_lock);
+            }
+            if (pool->m_queued == 0) break;
+            // claim a task, there's now one for us in some queue
+            pool->m_queued--;
+        }
+
+        Task t;
+        pool->take(self->index, t);
+        t.func(t.cookie);
+
+        bp::sync::Lock bl(t.batch->lock);
+        if (--t.batch->remaining == 0) t.batch->done.signal();
+    }
+
+    return NULL;
+}
@@ -0,0 +1,123 @@
+/**
+ * ***** BEGIN LICENSE BLOCK *****
+ * The contents of this file are subject to the Mozilla Public License
+ * Version 1.1 (the "License"); you may not use this file except in
+ * compliance with the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ * 
+ * Software distributed under the License is distributed on an "AS IS"
+ * basis, WITHOUT WARRANTY OF ANY KIND, either express or implied. See the
+ * License for the specific language governing rights and limitations
+ * under the License.
+ * 
+ * The Original Code is BrowserPlus (tm).
+ * 
+ * The Initial Developer of the Original Code is Yahoo!.
+ * Portions created by Yahoo! are Copyright (C) 2006-2009 Yahoo!.
+ * All Rights Reserved.
+ * 
+ * Contributor(s): 
+ * ***** END LICENSE BLOCK *****
+ */
+
+
+/*
+ *  bpstealpool.hh
+ *
+ *  A fixed size pool of worker threads for fork/join parallelism.  Each
+ *  worker has its own queue of tasks, and workers which run out of tasks
+ *  steal from the back of their peers' queues, so that batches of
+ *  unevenly sized tasks keep every worker busy.
+ */
+
+#ifndef __BPSTEALPOOL_H__
+#define __BPSTEALPOOL_H__
+
+#include "bpsync.hh"
+#include "bpthread.hh"
+
+#include <deque>
+#include <vector>
+
+namespace bp { namespace thread {
+
+class StealingPool
+{
+  public:
+    /** a unit of work, invoked on a worker thread with one of the
+     *  cookies supplied to run() */
+    typedef void (*WorkFunc)(void * cookie);
+
+    StealingPool();
+    /** stops the pool if it's running */
+    ~StealingPool();
+
+    /** spawn numThreads worker threads.
+     *  \returns false if the pool is already running or no thread
+     *           could be started */
+    bool start(unsigned int numThreads);
+
+    /** run all queued work, and join all workers */
+    void stop();
+
+    /** the number of running workers */
+    unsigned int size();
+
+    /** invoke func once for each of n cookies, spread across the
+     *  workers, and block until all have returned.  If the pool isn't
+     *  running, or this is called from one of its workers, work is
+     *  performed on the calling thread. */
+    void run(WorkFunc func, void ** cookies, unsigned int n);
+
+    /** is the calling thread one of the pool's workers? */
+    bool onWorker();
+
+  private:
+    static void * workerMain(void * cookie);
+
+    // a set of tasks posted by one call to run()
+    struct Batch {
+        bp::sync::Mutex lock;
+        bp::sync::Condition done;
+        unsigned int remaining;
+    };
+
+    struct Task {
+        WorkFunc func;
+        void * cookie;
+        Batch * batch;
+    };
+
+    struct Worker {
+        StealingPool * pool;
+        unsigned int index;
+        bp::sync::Mutex lock;
+        std::deque<Task> tasks;
+        Thread thread;
+        bool started;
+        // Thread::currentThreadID() of the worker, once it's running
+        unsigned int id;
+    };
+
+    // take a claimed task from the front of worker i's queue, or failing
+    // that from the back of another's
+    void take(unsigned int i, Task & t);
+
+    // guards m_running and m_queued, and is the mutex m_wake waits with.
+    // when both are held, m_lock is taken before a worker's lock
+    bp::sync::Mutex m_lock;
+    bp::sync::Condition m_wake;
+    std::vector<Worker *> m_workers;
+    // tasks in all queues which no worker has claimed
+    unsigned int m_queued;
+    // the queue the next task is posted to
+    unsigned int m_next;
+    bool m_running;
+
+    StealingPool(const StealingPool &);             // prevent copy construct
+    StealingPool& operator=(const StealingPool &);  // prevent copy assign
+};
+
+}; };
+
+#endif
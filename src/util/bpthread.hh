@@ -55,6 +55,9 @@ class Thread
     /** get a numeric ID for the current thread */
     static unsigned int currentThreadID();
 
+    /** the number of processors available on this machine (at least 1) */
+    static unsigned int numProcessors();
+
   private:
     void * m_osSpecific;
 };
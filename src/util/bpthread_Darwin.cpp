@@ -31,6 +31,7 @@
 #include <stdio.h>
 #include <signal.h>
 #include <pthread.h>
+#include <unistd.h>
 #include <assert.h>
 
 using namespace bp::thread;
@@ -114,3 +115,10 @@ Thread::currentThreadID()
 {
     return (unsigned int) pthread_self();
 }
+
+unsigned int
+Thread::numProcessors()
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return (n > 0) ? (unsigned int) n : 1;
+}
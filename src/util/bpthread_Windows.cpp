@@ -92,3 +92,12 @@ Thread::currentThreadID()
 {
     return (unsigned int) GetCurrentThreadId();
 }
+
+unsigned int
+Thread::numProcessors()
+{
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    return (si.dwNumberOfProcessors > 0) ?
+        (unsigned int) si.dwNumberOfProcessors : 1;
+}
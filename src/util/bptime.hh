@@ -0,0 +1,53 @@
+/**
+ * ***** BEGIN LICENSE BLOCK *****
+ * The contents of this file are subject to the Mozilla Public License
+ * Version 1.1 (the "License"); you may not use this file except in
+ * compliance with the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ * 
+ * Software distributed under the License is distributed on an "AS IS"
+ * basis, WITHOUT WARRANTY OF ANY KIND, either express or implied. See the
+ * License for the specific language governing rights and limitations
+ * under the License.
+ * 
+ * The Original Code is BrowserPlus (tm).
+ * 
+ * The Initial Developer of the Original Code is Yahoo!.
+ * Portions created by Yahoo! are Copyright (C) 2006-2009 Yahoo!.
+ * All Rights Reserved.
+ * 
+ * Contributor(s): 
+ * ***** END LICENSE BLOCK *****
+ */
+
+/*
+ *  bptime.hh
+ *
+ *  Lightweight cross-platform wall clock timing, suitable for measuring
+ *  how long the phases of a request take.
+ */
+
+#ifndef __BPTIME_H__
+#define __BPTIME_H__
+
+namespace bp {
+namespace time {
+    /** the current time in milliseconds, relative to some arbitrary
+     *  fixed point.  Only meaningful when compared to another value
+     *  returned by this function */
+    double nowMS();
+
+    /** a stopwatch that starts running when it's constructed */
+    class Stopwatch {
+      public:
+        Stopwatch() : m_start(nowMS()) { }
+        /** restart the stopwatch */
+        void reset() { m_start = nowMS(); }
+        /** milliseconds elapsed since construction or the last reset() */
+        double elapsedMS() const { return nowMS() - m_start; }
+      private:
+        double m_start;
+    };
+}}
+
+#endif
@@ -0,0 +1,48 @@
+/**
+ * ***** BEGIN LICENSE BLOCK *****
+ * The contents of this file are subject to the Mozilla Public License
+ * Version 1.1 (the "License"); you may not use this file except in
+ * compliance with the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ * 
+ * Software distributed under the License is distributed on an "AS IS"
+ * basis, WITHOUT WARRANTY OF ANY KIND, either express or implied. See the
+ * License for the specific language governing rights and limitations
+ * under the License.
+ * 
+ * The Original Code is BrowserPlus (tm).
+ * 
+ * The Initial Developer of the Original Code is Yahoo!.
+ * Portions created by Yahoo! are Copyright (C) 2006-2009 Yahoo!.
+ * All Rights Reserved.
+ * 
+ * Contributor(s): 
+ * ***** END LICENSE BLOCK *****
+ */
+#include "bptime.hh"
+#include <windows.h>
+
+static LARGE_INTEGER
+frequency()
+{
+    LARGE_INTEGER f;
+    QueryPerformanceFrequency(&f);
+    return f;
+}
+
+// the counter's frequency is fixed at boot.  read it once, as the module
+// loads, before any thread could be timing anything
+static const LARGE_INTEGER s_freq = frequency();
+
+double
+bp::time::nowMS()
+{
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+
+    // only another file's static initialization can get here first
+    LONGLONG freq = s_freq.QuadPart;
+    if (freq == 0) freq = frequency().QuadPart;
+
+    return ((double) now.QuadPart * 1000.0) / (double) freq;
+}
@@ -24,14 +24,24 @@
 #include "bpsync.hh"
 
 #ifdef WIN32
+#include <errno.h>
 #define PATH_SEP '\\'
 #else
+#include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
 #include <errno.h>
 #define PATH_SEP '/'
 #endif
 
+#include <algorithm>
 #include <sstream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #if 0
 static
@@ -67,8 +77,8 @@ ft::basename(const std::string & path)
     return filename;
 }
 
-static 
-std::string pathAppend(const std::string & parent, const std::string & child)
+std::string
+ft::pathAppend(const std::string & parent, const std::string & child)
 {
     std::string rv = parent;
     if (!parent.empty() && parent[parent.size()-1] != PATH_SEP) {
@@ -77,25 +87,38 @@ std::string pathAppend(const std::string & parent, const std::string & child)
     return (rv + child);
 }
 
+// ids used to generate unique directory names in getPath().  These live
+// at file scope so they're initialized before any thread can call getPath
+static bp::sync::Mutex s_idLock;
+static unsigned int s_id = 0;
+
+static unsigned int
+nextID()
+{
+    bp::sync::Lock l(s_idLock);
+    return s_id++;
+}
+
 std::string
 ft::getPath(std::string tempDir, std::string sourcePath)
 {
     if (!mkdir(tempDir, false)) return std::string();
 
-    // generate a unique name within this directory
-    {
-        static unsigned int id = 0;
-        static bp::sync::Mutex m;
-        bp::sync::Lock l(m);
+    // generate a unique name within this directory.  If a directory by
+    // that name already exists (i.e. left from a previous process), move
+    // on to the next id.
+    for (unsigned int tries = 0; tries < 1000; tries++) {
         std::stringstream ss;
-        ss << id++;
-        tempDir = pathAppend(tempDir, ss.str());        
+        ss << nextID();
+        std::string dir = pathAppend(tempDir, ss.str());
+        if (mkdir(dir, true)) {
+            // append the filename of sourcePath
+            return pathAppend(dir, sourcePath);
+        }
+        if (errno != EEXIST) break;
     }
-    if (!mkdir(tempDir, true)) return std::string();
-    // append the filename of sourcePath
-    tempDir = pathAppend(tempDir, sourcePath);
     
-    return tempDir;
+    return std::string();
 }
 
 #ifdef WIN32
@@ -127,6 +150,24 @@ utf8ToWide(const std::string& sIn)
     }
     return rval;
 }
+
+static std::string
+wideToUtf8(const std::wstring& sIn)
+{
+    std::string rval;
+    int nBytes = WideCharToMultiByte(CP_UTF8, 0, sIn.c_str(), -1,
+                                     0, 0, NULL, NULL);
+    if (nBytes <= 0) return rval;
+
+    char* pBuf = new char[nBytes];
+    if (WideCharToMultiByte(CP_UTF8, 0, sIn.c_str(), -1,
+                            pBuf, nBytes, NULL, NULL) != 0)
+    {
+        rval = pBuf;
+    }
+    delete[] pBuf;
+    return rval;
+}
 #endif
 
 bool
@@ -150,6 +191,73 @@ ft::isRegularFile(std::string path)
     return false;
 }
 
+bool
+ft::isDirectory(std::string path)
+{
+    if (path.empty()) return false;
+#ifdef WIN32
+    struct _stat s;
+    memset((void *) &s, 0, sizeof(s));
+    std::wstring wpath = utf8ToWide(path);
+    if (!_wstat(wpath.c_str(), &s)) {
+        return (s.st_mode & _S_IFDIR);
+    }
+#else
+    struct stat s;
+    memset((void *) &s, 0, sizeof(s));
+    if (!stat(path.c_str(), &s)) {
+        return ((s.st_mode & S_IFMT) == S_IFDIR);
+    }
+#endif
+    return false;
+}
+
+bool
+ft::readDirectory(std::string path, std::vector<std::string> & names)
+{
+    names.clear();
+    if (path.empty()) return false;
+#ifdef WIN32
+    WIN32_FIND_DATAW fd;
+    std::wstring pattern = utf8ToWide(pathAppend(path, "*"));
+    HANDLE h = FindFirstFileW(pattern.c_str(), &fd);
+    if (h == INVALID_HANDLE_VALUE) return false;
+    do {
+        std::string name = wideToUtf8(fd.cFileName);
+        if (name != "." && name != "..") names.push_back(name);
+    } while (FindNextFileW(h, &fd));
+    FindClose(h);
+#else
+    DIR * d = opendir(path.c_str());
+    if (!d) return false;
+    struct dirent * de;
+    while ((de = readdir(d)) != NULL) {
+        std::string name(de->d_name);
+        if (name != "." && name != "..") names.push_back(name);
+    }
+    closedir(d);
+#endif
+    std::sort(names.begin(), names.end());
+    return true;
+}
+
+long long
+ft::mtime(std::string path)
+{
+    if (path.empty()) return -1;
+#ifdef WIN32
+    struct _stat s;
+    memset((void *) &s, 0, sizeof(s));
+    std::wstring wpath = utf8ToWide(path);
+    if (!_wstat(wpath.c_str(), &s)) return (long long) s.st_mtime;
+#else
+    struct stat s;
+    memset((void *) &s, 0, sizeof(s));
+    if (!stat(path.c_str(), &s)) return (long long) s.st_mtime;
+#endif
+    return -1;
+}
+
 bool
 ft::mkdir(std::string path, bool failIfExists)
 {
@@ -163,10 +271,31 @@ ft::mkdir(std::string path, bool failIfExists)
     return false;
 }
 
+std::string
+ft::tempDirectory()
+{
+#ifdef WIN32
+    wchar_t buf[MAX_PATH + 1];
+    DWORD n = GetTempPathW(MAX_PATH + 1, buf);
+    if (n > 0 && n <= MAX_PATH) {
+        std::string path = wideToUtf8(buf);
+        // without its trailing separator
+        if (path.size() > 1 && path[path.size() - 1] == PATH_SEP) {
+            path.erase(path.size() - 1);
+        }
+        return path;
+    }
+    return std::string("C:\\");
+#else
+    const char * dir = getenv("TMPDIR");
+    return std::string((dir && *dir) ? dir : "/tmp");
+#endif
+}
+
 FILE *
 ft::fopen_binary_read(std::string utf8Path)
 {
-    if (utf8Path.empty()) return false;
+    if (utf8Path.empty()) return NULL;
 #ifdef WIN32    
     return _wfopen(utf8ToWide(utf8Path).c_str(), L"rb");
 #else
@@ -177,10 +306,110 @@ ft::fopen_binary_read(std::string utf8Path)
 FILE *
 ft::fopen_binary_write(std::string utf8Path)
 {
-    if (utf8Path.empty()) return false;
+    if (utf8Path.empty()) return NULL;
 #ifdef WIN32    
     return _wfopen(utf8ToWide(utf8Path).c_str(), L"wb");
 #else
     return fopen(utf8Path.c_str(), "w");
 #endif
 }
+
+bool
+ft::remove(std::string utf8Path)
+{
+    if (utf8Path.empty()) return false;
+#ifdef WIN32    
+    return (0 == _wremove(utf8ToWide(utf8Path).c_str()));
+#else
+    return (0 == ::remove(utf8Path.c_str()));
+#endif
+}
+
+bool
+ft::rename(std::string fromPath, std::string toPath)
+{
+    if (fromPath.empty() || toPath.empty()) return false;
+#ifdef WIN32
+    return (0 != MoveFileExW(utf8ToWide(fromPath).c_str(),
+                             utf8ToWide(toPath).c_str(),
+                             MOVEFILE_REPLACE_EXISTING));
+#else
+    return (0 == ::rename(fromPath.c_str(), toPath.c_str()));
+#endif
+}
+
+const void *
+ft::mmap_read(std::string utf8Path, size_t & len, void ** handle)
+{
+    len = 0;
+    *handle = NULL;
+    if (utf8Path.empty()) return NULL;
+#ifdef WIN32
+    HANDLE f = CreateFileW(utf8ToWide(utf8Path).c_str(), GENERIC_READ,
+                           FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                           FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN,
+                           NULL);
+    if (f == INVALID_HANDLE_VALUE) return NULL;
+
+    LARGE_INTEGER sz;
+    if (!GetFileSizeEx(f, &sz) || sz.QuadPart <= 0 ||
+        (unsigned long long) sz.QuadPart > (size_t) -1)
+    {
+        CloseHandle(f);
+        return NULL;
+    }
+
+    HANDLE m = CreateFileMappingW(f, NULL, PAGE_READONLY, 0, 0, NULL);
+    // the mapping holds its own reference to the file
+    CloseHandle(f);
+    if (m == NULL) return NULL;
+
+    const void * addr = MapViewOfFile(m, FILE_MAP_READ, 0, 0, 0);
+    if (addr == NULL) {
+        CloseHandle(m);
+        return NULL;
+    }
+
+    len = (size_t) sz.QuadPart;
+    *handle = (void *) m;
+    return addr;
+#else
+    int fd = open(utf8Path.c_str(), O_RDONLY);
+    if (fd < 0) return NULL;
+
+    struct stat s;
+    if (fstat(fd, &s) != 0 || (s.st_mode & S_IFMT) != S_IFREG ||
+        s.st_size <= 0)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    void * addr = mmap(NULL, (size_t) s.st_size, PROT_READ, MAP_PRIVATE,
+                       fd, 0);
+    // the mapping holds its own reference to the file
+    close(fd);
+    if (addr == MAP_FAILED) return NULL;
+
+#ifdef MADV_SEQUENTIAL
+    // decoders walk the input front to back, let the kernel read ahead
+    (void) madvise(addr, (size_t) s.st_size, MADV_SEQUENTIAL);
+#endif
+
+    len = (size_t) s.st_size;
+    return addr;
+#endif
+}
+
+void
+ft::munmap_read(const void * addr, size_t len, void * handle)
+{
+    if (addr == NULL) return;
+#ifdef WIN32
+    UnmapViewOfFile(addr);
+    if (handle) CloseHandle((HANDLE) handle);
+#else
+    (void) handle;
+    munmap((void *) addr, len);
+#endif
+}
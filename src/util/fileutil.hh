@@ -30,6 +30,8 @@
 #define __FILETOOLS_HH__
 
 #include <string>
+#include <stdio.h>
+#include <vector>
 
 namespace ft {
     // generate a path within the specified tempDir with a leaf named
@@ -39,14 +41,50 @@ namespace ft {
 
     std::string basename(const std::string & path);
 
+    // join a leaf (or relative path) onto a directory
+    std::string pathAppend(const std::string & parent,
+                           const std::string & child);
+
     // check if that's a regular ol' file.  like one we could compress.
     bool isRegularFile(std::string path);
 
+    // check if that's a directory
+    bool isDirectory(std::string path);
+
+    // the names of the entries in a directory, other than . and .., in
+    // sorted order.  returns false on failure
+    bool readDirectory(std::string path, std::vector<std::string> & names);
+
+    // the time a file was last modified, in seconds since the epoch.
+    // returns -1 on failure
+    long long mtime(std::string path);
+
     // create a directory with user only perms
     bool mkdir(std::string path, bool failIfExists = true);
 
+    // the system's directory for temporary files
+    std::string tempDirectory();
+
     FILE * fopen_binary_read(std::string utf8Path);
     FILE * fopen_binary_write(std::string utf8Path);
+
+    // delete a file.  returns false on failure
+    bool remove(std::string utf8Path);
+
+    // move a file, replacing any file at the destination.  Atomic when
+    // both are on the same volume.  returns false on failure
+    bool rename(std::string fromPath, std::string toPath);
+
+    // map a whole file read-only into memory.  upon success returns a
+    // pointer to the file's contents, sets len to its size, and sets
+    // handle to an opaque value that must be passed to munmap_read.
+    // returns NULL on failure (including empty files), in which case
+    // the caller should fall back to fopen_binary_read.
+    const void * mmap_read(std::string utf8Path, size_t & len,
+                           void ** handle);
+
+    // release a mapping acquired with mmap_read
+    void munmap_read(const void * addr, size_t len, void * handle);
 };
 
 #endif
@@ -45,7 +45,17 @@ clet = File.join(File.dirname(__FILE__), "..", "src", "build", "ImageAlter")
 raise "can't execute ServiceRunner: #{sr}" if !File.executable? sr
 raise "can't find built service to test: #{clet}" if !File.directory? clet
 
-# arguments are a string that must match the test name
+# --stress N issues N concurrent invocations of every test, all of which
+# must produce the expected output.  This exercises the service's worker
+# threads.
+stress = 1
+if (i = ARGV.index("--stress"))
+  stress = ARGV[i+1].to_i
+  stress = 1 if stress < 1
+  ARGV.slice!(i, 2)
+end
+
+# remaining arguments are a string that must match the test name
 substrpat = ARGV.length ? ARGV[0] : ""
 
 # perform a blocking read.  the third parameter is a magic duck:
@@ -61,6 +71,34 @@ def mypread(pio, timeo, lookFor = false)
   output
 end
 
+# the number of images in a GIF, found by walking its blocks
+def gifFrames(data)
+  raise "output isn't a GIF" if data[0, 3] != "GIF"
+  skipTable = lambda { |flags| (flags & 0x80) != 0 ? 3 * (2 << (flags & 7)) : 0 }
+  skipSubBlocks = lambda { |i|
+    i += data.getbyte(i) + 1 while data.getbyte(i) != 0
+    i + 1
+  }
+  i = 13 + skipTable.call(data.getbyte(10))
+  frames = 0
+  while i < data.length
+    case data.getbyte(i)
+    when 0x21 # extension
+      i = skipSubBlocks.call(i + 2)
+    when 0x2C # image descriptor
+      frames += 1
+      i += 10 + skipTable.call(data.getbyte(i + 9))
+      # LZW minimum code size, then the image data
+      i = skipSubBlocks.call(i + 1)
+    when 0x3B # trailer
+      return frames
+    else
+      raise "malformed GIF"
+    end
+  end
+  raise "truncated GIF"
+end
+
 rv = 0
 
 IO.popen("#{sr} #{clet}", "w+") do |srp|
@@ -81,6 +119,9 @@ IO.popen("#{sr} #{clet}", "w+") do |srp|
     $stdout.write "#{File.basename(f, ".json")}: "
     $stdout.flush
     json = JSON.parse(File.read(f))
+    # a case may describe its result rather than supply a .out: its
+    # width, height, and for GIFs the number of frames
+    expect = json.delete("expect")
     # now let's change the 'file' param to a absolute URI
     p = File.join(File.dirname(__FILE__), "test_images", json["file"])
     p = File.expand_path(p)
@@ -95,25 +136,48 @@ IO.popen("#{sr} #{clet}", "w+") do |srp|
     #       once that's live 
     
     took = Time.now
-    srp.syswrite "inv transform '#{cmd}'\nshow\n"
+    srp.syswrite "inv transform '#{cmd}'\n" * stress + "show\n"
     rez = mypread(srp, 5.0, /allocated:/)
+    # with concurrent invocations, results may trail the output of 'show'
+    deadline = Time.now + 5.0 * stress
+    while rez.scan(/\{[^{}]*\}/m).length < stress && Time.now < deadline
+      srp.syswrite "show\n"
+      rez += mypread(srp, 0.5, /allocated:/)
+    end
     took = Time.now - took
 
-    # now rez is of the form >{ "file": "file:///foo.x" } 1 instance...<
-    # we'll strip off the trailing gunk, extract the file url
+    # now rez contains one or more results of the form
+    # >{ "file": "file:///foo.x" } 1 instance...<
+    # we'll extract each result, pull out the file url
     # and compare it to the .out file.  if we faqil anywhere along this
     # path, then we'll give up and call it a failure
     imgGot = nil
     begin
-      robj = JSON.parse(rez.sub(/^.*\{/m, '{').sub(/\}.*$/m, '}'))
-      gotImgPath = URI.parse(robj['file']).path
-      gotImgPath.sub!(/^\//, "") if gotImgPath =~ /^\/[a-zA-Z]:/ 
-      imgGot = File.open(gotImgPath, "rb") { |oi| oi.read }
+      results = rez.scan(/\{[^{}]*\}/m)
+      raise "got #{results.length} of #{stress} results" if results.length < stress
       wantImgPath = File.join(File.dirname(f),
                               File.basename(f, ".json") + ".out")
-      raise "no output file for test!" if !File.exist? wantImgPath
-      imgWant = File.open(wantImgPath, "rb") { |oi| oi.read }
-      raise "output mismatch" if imgGot != imgWant
+      robj = nil
+      results.each { |r|
+        robj = JSON.parse(r)
+        gotImgPath = URI.parse(robj['file']).path
+        gotImgPath.sub!(/^\//, "") if gotImgPath =~ /^\/[a-zA-Z]:/ 
+        imgGot = File.open(gotImgPath, "rb") { |oi| oi.read }
+        if expect
+          ["width", "height"].each { |k|
+            next if !expect.has_key? k
+            raise "#{k} #{robj[k]}, expected #{expect[k]}" if robj[k] != expect[k]
+          }
+          if expect.has_key? "frames"
+            n = gifFrames(imgGot)
+            raise "#{n} frames, expected #{expect['frames']}" if n != expect["frames"]
+          end
+          next
+        end
+        raise "no output file for test!" if !File.exist? wantImgPath
+        imgWant = File.open(wantImgPath, "rb") { |oi| oi.read }
+        raise "output mismatch" if imgGot != imgWant
+      }
       # yay!  it worked!
       successes += 1
       puts "ok. (#{robj['orig_width']}x#{robj['orig_height']} -> #{robj['width']}x#{robj['height']} took #{took}s)"